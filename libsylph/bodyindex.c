@@ -0,0 +1,726 @@
+/*
+ * LibSylph -- E-Mail client library
+ * Copyright (C) 1999-2014 Hiroyuki Yamamoto
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Persistent inverted index of the text parts of the messages in a
+ * folder, used to skip the messages which cannot match a body search.
+ *
+ * The text is decoded exactly as procmime_find_string() sees it and is
+ * split into terms, which are the runs of ASCII alphanumerics and
+ * non-ASCII bytes, folded to ASCII lower case. A message can contain a
+ * search string only if every such run of the string is a part of one
+ * of its terms, so the index gives a set of candidates that still have
+ * to be verified with the real match. Messages which cannot be indexed
+ * (not available locally, or encrypted) are always candidates.
+ *
+ * The entries of removed or modified messages are dropped when the index
+ * is opened. The other messages are indexed lazily, when a body search
+ * first asks about them, so that a search whose other conditions reject
+ * most messages does not read every new message. The index is written
+ * back when it is closed.
+ */
+
+#include "defs.h"
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bodyindex.h"
+#include "procmime.h"
+#include "prefs_common.h"
+#include "utils.h"
+
+#define BODY_INDEX_MIN_KEY_LEN	3
+
+/* protects the tables and the lookup cache of BodyIndex, which may be
+   shared by the threads searching a folder */
+G_LOCK_DEFINE_STATIC(body_index);
+
+typedef struct _BodyIndexMsg	BodyIndexMsg;
+
+struct _BodyIndexMsg
+{
+	guint msgnum;
+	guint32 size;
+	guint32 mtime;
+};
+
+struct _BodyIndex
+{
+	FolderItem *item;
+
+	/* term -> GArray of ascending message numbers */
+	GHashTable *term_table;
+	/* msgnum -> BodyIndexMsg */
+	GHashTable *msg_table;
+
+	gboolean dirty;
+
+	/* result of the last lookup */
+	gchar *last_key;
+	GHashTable *last_result;
+};
+
+static gchar *body_index_get_file	(FolderItem	*item);
+static gchar *body_index_get_charset_key(void);
+
+static gboolean body_index_read		(BodyIndex	*index);
+static void body_index_write		(BodyIndex	*index);
+
+static GHashTable *body_index_get_terms	(MsgInfo	*msginfo);
+static void body_index_add_msg		(BodyIndex	*index,
+					 MsgInfo	*msginfo,
+					 GHashTable	*terms);
+static void body_index_remove_msgs	(BodyIndex	*index,
+					 GHashTable	*remove_table);
+
+static GHashTable *body_index_lookup	(BodyIndex	*index,
+					 const gchar	*key);
+static gboolean body_index_terms_may_contain
+					(GHashTable	*terms,
+					 const gchar	*key);
+
+
+static gchar *body_index_get_file(FolderItem *item)
+{
+	gchar *path;
+	gchar *file;
+
+	path = folder_item_get_path(item);
+	g_return_val_if_fail(path != NULL, NULL);
+	if (!is_dir_exist(path))
+		make_dir_hier(path);
+	file = g_strconcat(path, G_DIR_SEPARATOR_S, BODY_INDEX_FILE, NULL);
+	g_free(path);
+
+	return file;
+}
+
+/* the decoded text depends on these settings */
+static gchar *body_index_get_charset_key(void)
+{
+	return g_strconcat(prefs_common.force_charset ?
+			   prefs_common.force_charset : "", "/",
+			   prefs_common.default_encoding ?
+			   prefs_common.default_encoding : "", NULL);
+}
+
+static void body_index_posting_free(gpointer data)
+{
+	g_array_free((GArray *)data, TRUE);
+}
+
+static void body_index_copy_msgnum(gpointer key, gpointer value,
+				   gpointer data)
+{
+	g_hash_table_insert((GHashTable *)data, key, key);
+}
+
+static BodyIndex *body_index_new(FolderItem *item)
+{
+	BodyIndex *index;
+
+	index = g_new0(BodyIndex, 1);
+	index->item = item;
+	index->term_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+						  g_free,
+						  body_index_posting_free);
+	index->msg_table = g_hash_table_new_full(NULL, g_direct_equal,
+						 NULL, g_free);
+
+	return index;
+}
+
+BodyIndex *body_index_open(FolderItem *item, GSList *mlist)
+{
+	BodyIndex *index;
+	GHashTable *remove_table;
+	GSList *cur;
+	BodyIndexMsg *imsg;
+	GTimer *timer;
+
+	g_return_val_if_fail(item != NULL, NULL);
+
+	if (!prefs_common.use_body_index)
+		return NULL;
+	if (!item->path || item->stype == F_VIRTUAL)
+		return NULL;
+
+	timer = g_timer_new();
+
+	index = body_index_new(item);
+	if (!body_index_read(index)) {
+		g_hash_table_destroy(index->term_table);
+		g_hash_table_destroy(index->msg_table);
+		g_free(index);
+		index = body_index_new(item);
+		index->dirty = TRUE;
+	}
+
+	/* every indexed message not found unmodified below is removed */
+	remove_table = g_hash_table_new(NULL, g_direct_equal);
+	g_hash_table_foreach(index->msg_table, body_index_copy_msgnum,
+			     remove_table);
+
+	for (cur = mlist; cur != NULL; cur = cur->next) {
+		MsgInfo *msginfo = (MsgInfo *)cur->data;
+
+		imsg = g_hash_table_lookup(index->msg_table,
+					   GUINT_TO_POINTER(msginfo->msgnum));
+		if (imsg && imsg->size == (guint32)msginfo->size &&
+		    imsg->mtime == (guint32)msginfo->mtime)
+			g_hash_table_remove(remove_table,
+					    GUINT_TO_POINTER(msginfo->msgnum));
+	}
+
+	if (g_hash_table_size(remove_table) > 0) {
+		body_index_remove_msgs(index, remove_table);
+		index->dirty = TRUE;
+	}
+	g_hash_table_destroy(remove_table);
+
+	debug_print("body_index_open: %s: %u messages, %u terms "
+		    "(%.3f sec)\n", item->path,
+		    g_hash_table_size(index->msg_table),
+		    g_hash_table_size(index->term_table),
+		    g_timer_elapsed(timer, NULL));
+	g_timer_destroy(timer);
+
+	return index;
+}
+
+void body_index_close(BodyIndex *index)
+{
+	if (!index)
+		return;
+
+	if (index->dirty)
+		body_index_write(index);
+
+	g_hash_table_destroy(index->term_table);
+	g_hash_table_destroy(index->msg_table);
+	g_free(index->last_key);
+	if (index->last_result)
+		g_hash_table_destroy(index->last_result);
+	g_free(index);
+}
+
+static gboolean body_index_msg_is_indexed(BodyIndex *index,
+					  MsgInfo *msginfo)
+{
+	BodyIndexMsg *imsg;
+
+	imsg = g_hash_table_lookup(index->msg_table,
+				   GUINT_TO_POINTER(msginfo->msgnum));
+	return imsg && imsg->size == (guint32)msginfo->size &&
+		imsg->mtime == (guint32)msginfo->mtime;
+}
+
+/* Returns FALSE only if msginfo is indexed and certainly does not contain
+   str in its text parts. A message which is not indexed yet is indexed
+   here. */
+gboolean body_index_may_contain(BodyIndex *index, MsgInfo *msginfo,
+				const gchar *str)
+{
+	GHashTable *terms;
+	gboolean found;
+
+	g_return_val_if_fail(index != NULL, TRUE);
+	g_return_val_if_fail(msginfo != NULL, TRUE);
+
+	if (!str || msginfo->folder != index->item)
+		return TRUE;
+
+	G_LOCK(body_index);
+
+	if (!body_index_msg_is_indexed(index, msginfo)) {
+		G_UNLOCK(body_index);
+
+		/* the message is read without the lock */
+		if (MSG_IS_ENCRYPTED(msginfo->flags) ||
+		    (terms = body_index_get_terms(msginfo)) == NULL)
+			return TRUE;
+
+		G_LOCK(body_index);
+		/* another thread may have indexed it meanwhile */
+		if (!body_index_msg_is_indexed(index, msginfo)) {
+			body_index_add_msg(index, msginfo, terms);
+			/* keep the cached result of the last key valid */
+			if (index->last_result &&
+			    body_index_terms_may_contain
+				(terms, index->last_key))
+				g_hash_table_insert
+					(index->last_result,
+					 GUINT_TO_POINTER(msginfo->msgnum),
+					 GUINT_TO_POINTER(msginfo->msgnum));
+		}
+		g_hash_table_destroy(terms);
+	}
+
+	if (!index->last_key || strcmp(index->last_key, str) != 0) {
+		g_free(index->last_key);
+		if (index->last_result)
+			g_hash_table_destroy(index->last_result);
+		index->last_key = g_strdup(str);
+		index->last_result = body_index_lookup(index, str);
+	}
+
+	if (index->last_result)
+		found = g_hash_table_lookup(index->last_result,
+					    GUINT_TO_POINTER(msginfo->msgnum))
+			!= NULL;
+	else
+		found = TRUE;
+
+	G_UNLOCK(body_index);
+
+	return found;
+}
+
+void body_index_clear(FolderItem *item)
+{
+	gchar *file;
+
+	g_return_if_fail(item != NULL);
+
+	if (!item->path || item->stype == F_VIRTUAL)
+		return;
+
+	file = body_index_get_file(item);
+	if (file && is_file_exist(file))
+		g_unlink(file);
+	g_free(file);
+}
+
+#define IS_TERM_CHAR(c)	(g_ascii_isalnum(c) || ((guchar)(c) & 0x80) != 0)
+
+static void body_index_add_terms(GHashTable *terms, const gchar *text)
+{
+	const gchar *p = text;
+	const gchar *start;
+	gchar *term;
+
+	while (*p != '\0') {
+		while (*p != '\0' && !IS_TERM_CHAR(*p))
+			p++;
+		if (*p == '\0')
+			break;
+		start = p;
+		while (IS_TERM_CHAR(*p))
+			p++;
+		term = g_ascii_strdown(start, p - start);
+		if (g_hash_table_lookup(terms, term))
+			g_free(term);
+		else
+			g_hash_table_insert(terms, term, term);
+	}
+}
+
+static void body_index_add_posting(gpointer key, gpointer value,
+				   gpointer data)
+{
+	BodyIndex *index = ((gpointer *)data)[0];
+	guint msgnum = GPOINTER_TO_UINT(((gpointer *)data)[1]);
+	GArray *posting;
+	guint lo, hi, mid;
+
+	posting = g_hash_table_lookup(index->term_table, key);
+	if (!posting) {
+		posting = g_array_new(FALSE, FALSE, sizeof(guint));
+		g_hash_table_insert(index->term_table, g_strdup(key), posting);
+	}
+
+	/* messages are mostly added in ascending order */
+	lo = 0;
+	hi = posting->len;
+	if (hi > 0 && g_array_index(posting, guint, hi - 1) < msgnum)
+		lo = hi;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (g_array_index(posting, guint, mid) < msgnum)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < posting->len && g_array_index(posting, guint, lo) == msgnum)
+		return;
+	g_array_insert_val(posting, lo, msgnum);
+}
+
+/* returns the set of the terms in the text parts of msginfo, or NULL if
+   it cannot be read */
+static GHashTable *body_index_get_terms(MsgInfo *msginfo)
+{
+	gchar *file;
+	FILE *fp, *outfp;
+	MimeInfo *mimeinfo, *partinfo;
+	GHashTable *terms;
+	gchar buf[BUFFSIZE];
+
+	/* only messages already available locally are indexed, so that
+	   remote ones are not downloaded here */
+	file = procmsg_get_message_file_path(msginfo);
+	if (!file)
+		return NULL;
+	if ((fp = g_fopen(file, "rb")) == NULL) {
+		g_free(file);
+		return NULL;
+	}
+	g_free(file);
+
+	mimeinfo = procmime_scan_message_stream(fp);
+	if (!mimeinfo) {
+		fclose(fp);
+		return NULL;
+	}
+
+	terms = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	for (partinfo = mimeinfo; partinfo != NULL;
+	     partinfo = procmime_mimeinfo_next(partinfo)) {
+		if (partinfo->mime_type != MIME_TEXT &&
+		    partinfo->mime_type != MIME_TEXT_HTML)
+			continue;
+		outfp = procmime_get_text_content(partinfo, fp, NULL);
+		if (!outfp)
+			continue;
+		/* split into lines the same way as
+		   procmime_find_string_part() */
+		while (fgets(buf, sizeof(buf), outfp) != NULL) {
+			strretchomp(buf);
+			body_index_add_terms(terms, buf);
+		}
+		fclose(outfp);
+	}
+
+	procmime_mimeinfo_free_all(mimeinfo);
+	fclose(fp);
+
+	return terms;
+}
+
+/* must be called with the body_index lock held */
+static void body_index_add_msg(BodyIndex *index, MsgInfo *msginfo,
+			       GHashTable *terms)
+{
+	BodyIndexMsg *imsg;
+	gpointer data[2];
+
+	data[0] = index;
+	data[1] = GUINT_TO_POINTER(msginfo->msgnum);
+	g_hash_table_foreach(terms, body_index_add_posting, data);
+
+	imsg = g_new(BodyIndexMsg, 1);
+	imsg->msgnum = msginfo->msgnum;
+	imsg->size = msginfo->size;
+	imsg->mtime = msginfo->mtime;
+	g_hash_table_replace(index->msg_table,
+			     GUINT_TO_POINTER(msginfo->msgnum), imsg);
+	index->dirty = TRUE;
+}
+
+static gboolean body_index_remove_func(gpointer key, gpointer value,
+				       gpointer data)
+{
+	GArray *posting = (GArray *)value;
+	GHashTable *remove_table = (GHashTable *)data;
+	guint i, n = 0;
+	guint msgnum;
+
+	for (i = 0; i < posting->len; i++) {
+		msgnum = g_array_index(posting, guint, i);
+		if (!g_hash_table_lookup(remove_table,
+					 GUINT_TO_POINTER(msgnum)))
+			g_array_index(posting, guint, n++) = msgnum;
+	}
+	g_array_set_size(posting, n);
+
+	return n == 0;
+}
+
+static void body_index_remove_msg(gpointer key, gpointer value,
+				  gpointer data)
+{
+	g_hash_table_remove((GHashTable *)data, key);
+}
+
+static void body_index_remove_msgs(BodyIndex *index, GHashTable *remove_table)
+{
+	g_hash_table_foreach_remove(index->term_table, body_index_remove_func,
+				    remove_table);
+	g_hash_table_foreach(remove_table, body_index_remove_msg,
+			     index->msg_table);
+}
+
+typedef struct _BodyIndexLookupData
+{
+	const gchar *run;
+	GHashTable *candidates;
+	GHashTable *result;
+} BodyIndexLookupData;
+
+static void body_index_lookup_func(gpointer key, gpointer value, gpointer data)
+{
+	const gchar *term = (const gchar *)key;
+	GArray *posting = (GArray *)value;
+	BodyIndexLookupData *ldata = (BodyIndexLookupData *)data;
+	gpointer msgnum;
+	guint i;
+
+	if (!strstr(term, ldata->run))
+		return;
+
+	for (i = 0; i < posting->len; i++) {
+		msgnum = GUINT_TO_POINTER(g_array_index(posting, guint, i));
+		if (!ldata->candidates ||
+		    g_hash_table_lookup(ldata->candidates, msgnum))
+			g_hash_table_insert(ldata->result, msgnum, msgnum);
+	}
+}
+
+/* Returns the set of message numbers which may contain key, or NULL if
+   the key has no part long enough to narrow the messages down. */
+static GHashTable *body_index_lookup(BodyIndex *index, const gchar *key)
+{
+	BodyIndexLookupData ldata;
+	const gchar *p = key;
+	const gchar *start;
+	gchar *run;
+
+	ldata.candidates = NULL;
+
+	while (*p != '\0') {
+		while (*p != '\0' && !IS_TERM_CHAR(*p))
+			p++;
+		if (*p == '\0')
+			break;
+		start = p;
+		while (IS_TERM_CHAR(*p))
+			p++;
+		if (p - start < BODY_INDEX_MIN_KEY_LEN)
+			continue;
+
+		/* every run in the key is a part of a term of the text */
+		run = g_ascii_strdown(start, p - start);
+		ldata.run = run;
+		ldata.result = g_hash_table_new(NULL, g_direct_equal);
+		g_hash_table_foreach(index->term_table, body_index_lookup_func,
+				     &ldata);
+		g_free(run);
+
+		if (ldata.candidates)
+			g_hash_table_destroy(ldata.candidates);
+		ldata.candidates = ldata.result;
+		if (g_hash_table_size(ldata.candidates) == 0)
+			break;
+	}
+
+	return ldata.candidates;
+}
+
+static gboolean body_index_term_contains(gpointer key, gpointer value,
+					 gpointer data)
+{
+	return strstr((const gchar *)key, (const gchar *)data) != NULL;
+}
+
+/* same as body_index_lookup() for the terms of one message */
+static gboolean body_index_terms_may_contain(GHashTable *terms,
+					     const gchar *key)
+{
+	const gchar *p = key;
+	const gchar *start;
+	gchar *run;
+	gboolean found = TRUE;
+
+	while (found && *p != '\0') {
+		while (*p != '\0' && !IS_TERM_CHAR(*p))
+			p++;
+		if (*p == '\0')
+			break;
+		start = p;
+		while (IS_TERM_CHAR(*p))
+			p++;
+		if (p - start < BODY_INDEX_MIN_KEY_LEN)
+			continue;
+
+		run = g_ascii_strdown(start, p - start);
+		found = g_hash_table_find(terms, body_index_term_contains,
+					  run) != NULL;
+		g_free(run);
+	}
+
+	return found;
+}
+
+#undef IS_TERM_CHAR
+
+#define READ_INDEX_DATA_INT(n, fp)				\
+{								\
+	guint32 idata;						\
+								\
+	if (fread(&idata, sizeof(idata), 1, fp) != 1)		\
+		goto corrupted;					\
+	n = idata;						\
+}
+
+static gboolean body_index_read(BodyIndex *index)
+{
+	gchar *file;
+	FILE *fp;
+	gchar *charset_key;
+	gchar *str;
+	guint32 len, n, count, i, j;
+	BodyIndexMsg *imsg;
+	GArray *posting;
+	guint msgnum, size, mtime;
+
+	file = body_index_get_file(index->item);
+	if (!file)
+		return FALSE;
+	fp = procmsg_open_data_file(file, BODY_INDEX_VERSION, DATA_READ,
+				    NULL, 0);
+	if (!fp) {
+		g_free(file);
+		return FALSE;
+	}
+
+	READ_INDEX_DATA_INT(len, fp);
+	str = g_malloc(len + 1);
+	if (len > 0 && fread(str, len, 1, fp) != 1) {
+		g_free(str);
+		goto corrupted;
+	}
+	str[len] = '\0';
+	charset_key = body_index_get_charset_key();
+	if (strcmp(str, charset_key) != 0) {
+		debug_print("%s: charset settings changed. Rebuilding.\n",
+			    file);
+		g_free(charset_key);
+		g_free(str);
+		fclose(fp);
+		g_free(file);
+		return FALSE;
+	}
+	g_free(charset_key);
+	g_free(str);
+
+	READ_INDEX_DATA_INT(n, fp);
+	for (i = 0; i < n; i++) {
+		READ_INDEX_DATA_INT(msgnum, fp);
+		READ_INDEX_DATA_INT(size, fp);
+		READ_INDEX_DATA_INT(mtime, fp);
+		imsg = g_new(BodyIndexMsg, 1);
+		imsg->msgnum = msgnum;
+		imsg->size = size;
+		imsg->mtime = mtime;
+		g_hash_table_replace(index->msg_table,
+				     GUINT_TO_POINTER(msgnum), imsg);
+	}
+
+	READ_INDEX_DATA_INT(n, fp);
+	for (i = 0; i < n; i++) {
+		READ_INDEX_DATA_INT(len, fp);
+		if (len == 0 || len > BUFFSIZE)
+			goto corrupted;
+		str = g_malloc(len + 1);
+		if (fread(str, len, 1, fp) != 1) {
+			g_free(str);
+			goto corrupted;
+		}
+		str[len] = '\0';
+		posting = g_array_new(FALSE, FALSE, sizeof(guint));
+		g_hash_table_replace(index->term_table, str, posting);
+
+		READ_INDEX_DATA_INT(count, fp);
+		for (j = 0; j < count; j++) {
+			READ_INDEX_DATA_INT(msgnum, fp);
+			g_array_append_val(posting, msgnum);
+		}
+	}
+
+	fclose(fp);
+	g_free(file);
+	return TRUE;
+
+corrupted:
+	g_warning("%s: body index is corrupted\n", file);
+	fclose(fp);
+	g_free(file);
+	return FALSE;
+}
+
+#undef READ_INDEX_DATA_INT
+
+static void body_index_write_msg(gpointer key, gpointer value, gpointer data)
+{
+	BodyIndexMsg *imsg = (BodyIndexMsg *)value;
+	FILE *fp = (FILE *)data;
+
+	WRITE_CACHE_DATA_INT(imsg->msgnum, fp);
+	WRITE_CACHE_DATA_INT(imsg->size, fp);
+	WRITE_CACHE_DATA_INT(imsg->mtime, fp);
+}
+
+static void body_index_write_term(gpointer key, gpointer value, gpointer data)
+{
+	const gchar *term = (const gchar *)key;
+	GArray *posting = (GArray *)value;
+	FILE *fp = (FILE *)data;
+	guint i;
+
+	WRITE_CACHE_DATA(term, fp);
+	WRITE_CACHE_DATA_INT(posting->len, fp);
+	for (i = 0; i < posting->len; i++)
+		WRITE_CACHE_DATA_INT(g_array_index(posting, guint, i), fp);
+}
+
+static void body_index_write(BodyIndex *index)
+{
+	gchar *file;
+	gchar *charset_key;
+	FILE *fp;
+
+	file = body_index_get_file(index->item);
+	if (!file)
+		return;
+
+	debug_print("Writing body index: %s\n", file);
+
+	if ((fp = procmsg_open_data_file(file, BODY_INDEX_VERSION, DATA_WRITE,
+					 NULL, 0)) != NULL) {
+		charset_key = body_index_get_charset_key();
+		WRITE_CACHE_DATA(charset_key, fp);
+		g_free(charset_key);
+		WRITE_CACHE_DATA_INT(g_hash_table_size(index->msg_table), fp);
+		g_hash_table_foreach(index->msg_table, body_index_write_msg,
+				     fp);
+		WRITE_CACHE_DATA_INT(g_hash_table_size(index->term_table), fp);
+		g_hash_table_foreach(index->term_table, body_index_write_term,
+				     fp);
+		if (fclose(fp) == EOF) {
+			FILE_OP_ERROR(file, "fclose");
+			g_unlink(file);
+		}
+	}
+
+	index->dirty = FALSE;
+	g_free(file);
+}
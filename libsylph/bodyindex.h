@@ -0,0 +1,40 @@
+/*
+ * LibSylph -- E-Mail client library
+ * Copyright (C) 1999-2014 Hiroyuki Yamamoto
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __BODYINDEX_H__
+#define __BODYINDEX_H__
+
+#include <glib.h>
+
+typedef struct _BodyIndex	BodyIndex;
+
+#include "folder.h"
+#include "procmsg.h"
+
+BodyIndex *body_index_open	(FolderItem	*item,
+				 GSList		*mlist);
+void	 body_index_close	(BodyIndex	*index);
+
+gboolean body_index_may_contain	(BodyIndex	*index,
+				 MsgInfo	*msginfo,
+				 const gchar	*str);
+
+void	 body_index_clear	(FolderItem	*item);
+
+#endif /* __BODYINDEX_H__ */
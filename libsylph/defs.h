@@ -75,10 +75,15 @@
 #define FOLDER_LIST		"folderlist.xml"
 #define CACHE_FILE		".sylpheed_cache"
 #define MARK_FILE		".sylpheed_mark"
+#define THREAD_FILE		".sylpheed_thread"
+#define BODY_INDEX_FILE		".sylpheed_body_index"
 #define SEARCH_CACHE		"search_cache"
-#define CACHE_VERSION		0x21
+#define CACHE_VERSION		0x22
+#define OLD_CACHE_VERSION	0x21
 #define MARK_VERSION		2
 #define SEARCH_CACHE_VERSION	1
+#define THREAD_VERSION		2
+#define BODY_INDEX_VERSION	1
 
 #ifdef G_OS_WIN32
 #  define REMOTE_CMD_PORT	50215
@@ -56,10 +56,19 @@ typedef enum
 
 static FilterInAddressBookFunc default_addrbook_func = NULL;
 
+static gboolean filter_match_rule_real	(FilterRule	*rule,
+					 MsgInfo	*msginfo,
+					 GSList		*hlist,
+					 GHashTable	*header_table,
+					 FilterInfo	*fltinfo);
 static gboolean filter_match_cond	(FilterCond	*cond,
 					 MsgInfo	*msginfo,
 					 GSList		*hlist,
 					 FilterInfo	*fltinfo);
+
+static GHashTable *filter_header_table_new
+					(GSList		*hlist);
+static void filter_header_table_free	(GHashTable	*header_table);
 static gboolean filter_match_header_cond(FilterCond	*cond,
 					 GSList		*hlist);
 static gboolean filter_match_in_addressbook
@@ -102,6 +111,7 @@ gint filter_apply_msginfo(GSList *fltlist, MsgInfo *msginfo,
 {
 	gchar *file;
 	GSList *hlist, *cur;
+	GHashTable *header_table;
 	FilterRule *rule;
 	gint ret = 0;
 
@@ -121,6 +131,9 @@ gint filter_apply_msginfo(GSList *fltlist, MsgInfo *msginfo,
 		return 0;
 	}
 
+	/* the headers are parsed and indexed once for all the rules */
+	header_table = filter_header_table_new(hlist);
+
 	procmsg_set_auto_decrypt_message(FALSE);
 
 	for (cur = fltlist; cur != NULL; cur = cur->next) {
@@ -128,7 +141,8 @@ gint filter_apply_msginfo(GSList *fltlist, MsgInfo *msginfo,
 
 		rule = (FilterRule *)cur->data;
 		if (!rule->enabled) continue;
-		matched = filter_match_rule(rule, msginfo, hlist, fltinfo);
+		matched = filter_match_rule_real(rule, msginfo, hlist,
+						 header_table, fltinfo);
 		if (fltinfo->error != FLT_ERROR_OK) {
 			g_warning("filter_match_rule() returned error (code: %d)\n", fltinfo->error);
 		}
@@ -148,6 +162,7 @@ gint filter_apply_msginfo(GSList *fltlist, MsgInfo *msginfo,
 
 	procmsg_set_auto_decrypt_message(TRUE);
 
+	filter_header_table_free(header_table);
 	procheader_header_list_destroy(hlist);
 	g_free(file);
 
@@ -333,64 +348,476 @@ gint filter_action_exec(FilterRule *rule, MsgInfo *msginfo, const gchar *file,
 	return 0;
 }
 
-static gboolean strmatch_regex(const gchar *haystack, const gchar *needle)
+#if USE_ONIGURUMA
+typedef OnigRegex	FilterRegex;
+#elif defined(HAVE_REGCOMP)
+typedef regex_t *	FilterRegex;
+#else
+typedef gpointer	FilterRegex;
+#endif
+
+static FilterRegex filter_regex_compile(const gchar *pattern)
 {
 #ifdef USE_ONIGURUMA
 	gint ret = 0;
 	OnigRegex reg;
 	OnigErrorInfo err_info;
-	const UChar *ptn = (const UChar *)needle;
-	const UChar *str = (const UChar *)haystack;
-	size_t haystack_len;
+	const UChar *ptn = (const UChar *)pattern;
 
-	ret = onig_new(&reg, ptn, ptn + strlen(needle),
+	ret = onig_new(&reg, ptn, ptn + strlen(pattern),
 		       /* ONIG_OPTION_EXTEND requires spaces to be escaped */
 		       /* ONIG_OPTION_IGNORECASE|ONIG_OPTION_EXTEND, */
 		       ONIG_OPTION_IGNORECASE,
 		       ONIG_ENCODING_UTF8, ONIG_SYNTAX_POSIX_EXTENDED,
 		       &err_info);
 	if (ret != ONIG_NORMAL) {
-		g_warning("strmatch_regex: onig_new() failed: %d", ret);
-		return FALSE;
+		g_warning("filter_regex_compile: onig_new() failed: %d", ret);
+		return NULL;
+	}
+
+	return reg;
+#elif defined(HAVE_REGCOMP)
+	regex_t *preg;
+
+	preg = g_new(regex_t, 1);
+	if (regcomp(preg, pattern, REG_ICASE|REG_EXTENDED) != 0) {
+		g_free(preg);
+		return NULL;
 	}
 
-	haystack_len = strlen(haystack);
-	ret = onig_search(reg, str, str + haystack_len,
-			  str, str + haystack_len, NULL, 0);
-	onig_free(reg);
+	return preg;
+#else
+	return NULL;
+#endif
+}
+
+static gboolean filter_regex_match(FilterRegex regex, const gchar *str)
+{
+#ifdef USE_ONIGURUMA
+	const UChar *ustr = (const UChar *)str;
+	size_t len;
 
-	if (ret >= 0)
-		return TRUE;
-	else
-		return FALSE;
+	len = strlen(str);
+	return onig_search(regex, ustr, ustr + len, ustr, ustr + len,
+			   NULL, 0) >= 0;
 #elif defined(HAVE_REGCOMP)
-	gint ret = 0;
-	regex_t preg;
+	return regexec(regex, str, 0, NULL, 0) == 0;
+#else
+	return FALSE;
+#endif
+}
+
+static void filter_regex_free(FilterRegex regex)
+{
+	if (!regex)
+		return;
+#ifdef USE_ONIGURUMA
+	onig_free(regex);
+#elif defined(HAVE_REGCOMP)
+	regfree(regex);
+	g_free(regex);
+#endif
+}
+
+static gboolean strmatch_regex(const gchar *haystack, const gchar *needle)
+{
+	FilterRegex regex;
+	gboolean ret;
 
-	ret = regcomp(&preg, needle, REG_ICASE|REG_EXTENDED);
-	if (ret != 0)
+	regex = filter_regex_compile(needle);
+	if (!regex)
 		return FALSE;
+	ret = filter_regex_match(regex, haystack);
+	filter_regex_free(regex);
 
-	ret = regexec(&preg, haystack, 0, NULL, 0);
-	regfree(&preg);
+	return ret;
+}
 
-	if (ret == 0)
+/*
+ * A FilterRule is compiled into a FilterPlan when it is created. The plan
+ * keeps the conditions grouped by cost, so that a rule is evaluated in
+ * a single walk, with the regular expressions compiled and the
+ * case-insensitive keys lower-cased in advance. The header conditions
+ * are dispatched by header name, so that every header is looked at only
+ * once for all of them.
+ */
+
+typedef struct _FilterCondPlan	FilterCondPlan;
+
+struct _FilterCondPlan
+{
+	FilterCond *cond;
+	FilterRegex regex;
+	gchar *needle;		/* lower-cased key of a case-insensitive
+				   FLT_CONTAIN match */
+	gsize needle_len;
+	guint index;		/* index among the header conditions */
+};
+
+struct _FilterPlan
+{
+	/* conditions on the flags and the summary, the headers, and the
+	   message contents, in this order of evaluation */
+	GPtrArray *status_conds;
+	GPtrArray *header_conds;
+	GPtrArray *content_conds;
+
+	/* header name -> GSList of FilterCondPlan */
+	GHashTable *header_table;
+	GSList *header_names;
+	GSList *any_header_conds;
+	GSList *to_or_cc_conds;
+};
+
+static gboolean filter_str_case_find(const gchar *haystack,
+				     const gchar *needle, gsize len)
+{
+	const gchar *p;
+
+	for (p = haystack; *p != '\0'; p++) {
+		if (g_ascii_tolower(*p) == needle[0] &&
+		    g_ascii_strncasecmp(p, needle, len) == 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static gboolean filter_cond_plan_match_str(FilterCondPlan *cp,
+					   const gchar *str)
+{
+	FilterCond *cond = cp->cond;
+
+	if (cond->match_type == FLT_IN_ADDRESSBOOK &&
+	    cond->type != FLT_COND_ANY_HEADER)
+		return default_addrbook_func ? default_addrbook_func(str)
+			: FALSE;
+	if (!cond->str_value)
 		return TRUE;
-	else
-		return FALSE;
-#else
+	if (cond->match_type == FLT_REGEX)
+		return cp->regex ? filter_regex_match(cp->regex, str) : FALSE;
+	if (cp->needle)
+		return filter_str_case_find(str, cp->needle, cp->needle_len);
+
+	return cond->match_func(str, cond->str_value);
+}
+
+static FilterPlan *filter_plan_new(GSList *cond_list)
+{
+	FilterPlan *plan;
+	FilterCondPlan *cp;
+	GSList *cur, *list;
+
+	plan = g_new0(FilterPlan, 1);
+	plan->status_conds = g_ptr_array_new();
+	plan->header_conds = g_ptr_array_new();
+	plan->content_conds = g_ptr_array_new();
+	plan->header_table = g_hash_table_new_full(str_case_hash,
+						   str_case_equal, NULL,
+						   (GDestroyNotify)g_slist_free);
+
+	for (cur = cond_list; cur != NULL; cur = cur->next) {
+		FilterCond *cond = (FilterCond *)cur->data;
+
+		cp = g_new0(FilterCondPlan, 1);
+		cp->cond = cond;
+
+		switch (cond->type) {
+		case FLT_COND_HEADER:
+		case FLT_COND_ANY_HEADER:
+		case FLT_COND_TO_OR_CC:
+			if (cond->str_value && cond->match_type == FLT_REGEX)
+				cp->regex = filter_regex_compile
+					(cond->str_value);
+			else if (cond->str_value &&
+				 cond->match_type == FLT_CONTAIN &&
+				 !FLT_IS_CASE_SENS(cond->match_flag)) {
+				cp->needle = g_ascii_strdown
+					(cond->str_value, -1);
+				cp->needle_len = strlen(cp->needle);
+			}
+			cp->index = plan->header_conds->len;
+			g_ptr_array_add(plan->header_conds, cp);
+
+			if (cond->type == FLT_COND_ANY_HEADER)
+				plan->any_header_conds = g_slist_append
+					(plan->any_header_conds, cp);
+			else if (cond->type == FLT_COND_TO_OR_CC)
+				plan->to_or_cc_conds = g_slist_append
+					(plan->to_or_cc_conds, cp);
+			else if (cond->header_name) {
+				list = g_hash_table_lookup
+					(plan->header_table,
+					 cond->header_name);
+				if (list)
+					list = g_slist_append(list, cp);
+				else {
+					g_hash_table_insert
+						(plan->header_table,
+						 cond->header_name,
+						 g_slist_append(NULL, cp));
+					plan->header_names = g_slist_append
+						(plan->header_names,
+						 cond->header_name);
+				}
+			}
+			break;
+		case FLT_COND_BODY:
+		case FLT_COND_CMD_TEST:
+			g_ptr_array_add(plan->content_conds, cp);
+			break;
+		default:
+			g_ptr_array_add(plan->status_conds, cp);
+			break;
+		}
+	}
+
+	return plan;
+}
+
+static void filter_plan_free_conds(GPtrArray *conds)
+{
+	FilterCondPlan *cp;
+	guint i;
+
+	for (i = 0; i < conds->len; i++) {
+		cp = g_ptr_array_index(conds, i);
+		filter_regex_free(cp->regex);
+		g_free(cp->needle);
+		g_free(cp);
+	}
+	g_ptr_array_free(conds, TRUE);
+}
+
+static void filter_plan_free(FilterPlan *plan)
+{
+	if (!plan)
+		return;
+
+	g_hash_table_destroy(plan->header_table);
+	g_slist_free(plan->header_names);
+	g_slist_free(plan->any_header_conds);
+	g_slist_free(plan->to_or_cc_conds);
+	filter_plan_free_conds(plan->status_conds);
+	filter_plan_free_conds(plan->header_conds);
+	filter_plan_free_conds(plan->content_conds);
+	g_free(plan);
+}
+
+static void filter_header_cond_log(FilterCond *cond, gboolean not_match)
+{
+	gchar *sv = cond->str_value ? cond->str_value : "";
+	gchar *nm = not_match ? " (reverse match)" : "";
+
+	if (cond->match_type == FLT_IN_ADDRESSBOOK &&
+	    cond->type != FLT_COND_ANY_HEADER) {
+		switch (cond->type) {
+		case FLT_COND_HEADER:
+			debug_print("filter-log: %s: HEADER [%s], IN_ADDRESSBOOK%s\n", G_STRFUNC, cond->header_name, nm);
+			break;
+		case FLT_COND_TO_OR_CC:
+			debug_print("filter-log: %s: TO_OR_CC, IN_ADDRESSBOOK%s\n", G_STRFUNC, nm);
+			break;
+		default:
+			break;
+		}
+		return;
+	}
+
+	switch (cond->type) {
+	case FLT_COND_HEADER:
+		debug_print("filter-log: %s: HEADER [%s], str_value: [%s]%s\n", G_STRFUNC, cond->header_name, sv, nm);
+		break;
+	case FLT_COND_ANY_HEADER:
+		debug_print("filter-log: %s: ANY_HEADER, str_value: [%s]%s\n", G_STRFUNC, sv, nm);
+		break;
+	case FLT_COND_TO_OR_CC:
+		debug_print("filter-log: %s: TO_OR_CC, str_value: [%s]%s\n", G_STRFUNC, sv, nm);
+		break;
+	default:
+		break;
+	}
+}
+
+static void filter_plan_match_header_list(GSList *cond_list, Header *header,
+					  gboolean *found)
+{
+	GSList *cur;
+
+	for (cur = cond_list; cur != NULL; cur = cur->next) {
+		FilterCondPlan *cp = (FilterCondPlan *)cur->data;
+
+		if (!found[cp->index] &&
+		    filter_cond_plan_match_str(cp, header->body))
+			found[cp->index] = TRUE;
+	}
+}
+
+static void filter_plan_match_indexed_headers(GSList *cond_list,
+					      GHashTable *header_table,
+					      const gchar *name,
+					      gboolean *found)
+{
+	GSList *cur;
+
+	for (cur = g_hash_table_lookup(header_table, name); cur != NULL;
+	     cur = cur->next)
+		filter_plan_match_header_list(cond_list, (Header *)cur->data,
+					      found);
+}
+
+/* Evaluates all the header conditions of the plan, either in one pass
+   over hlist, or by looking up only the headers they refer to if
+   header_table indexes hlist. Returns TRUE if the rule is decided, with
+   the result in *matched. */
+static gboolean filter_plan_match_headers(FilterPlan *plan,
+					  FilterBoolOp bool_op, GSList *hlist,
+					  GHashTable *header_table,
+					  gboolean *matched)
+{
+	gboolean *found;
+	GSList *cur;
+	Header *header;
+	guint i;
+	gboolean decided = FALSE;
+
+	found = g_new0(gboolean, plan->header_conds->len);
+
+	if (header_table) {
+		for (cur = plan->header_names; cur != NULL; cur = cur->next)
+			filter_plan_match_indexed_headers
+				(g_hash_table_lookup(plan->header_table,
+						     cur->data),
+				 header_table, (const gchar *)cur->data, found);
+		if (plan->to_or_cc_conds) {
+			filter_plan_match_indexed_headers
+				(plan->to_or_cc_conds, header_table, "To",
+				 found);
+			filter_plan_match_indexed_headers
+				(plan->to_or_cc_conds, header_table, "Cc",
+				 found);
+		}
+		for (cur = plan->any_header_conds ? hlist : NULL; cur != NULL;
+		     cur = cur->next)
+			filter_plan_match_header_list(plan->any_header_conds,
+						      (Header *)cur->data,
+						      found);
+	} else {
+		for (cur = hlist; cur != NULL; cur = cur->next) {
+			header = (Header *)cur->data;
+
+			filter_plan_match_header_list
+				(g_hash_table_lookup(plan->header_table,
+						     header->name),
+				 header, found);
+			filter_plan_match_header_list
+				(plan->any_header_conds, header, found);
+			if (plan->to_or_cc_conds &&
+			    (!g_ascii_strcasecmp(header->name, "To") ||
+			     !g_ascii_strcasecmp(header->name, "Cc")))
+				filter_plan_match_header_list
+					(plan->to_or_cc_conds, header, found);
+		}
+	}
+
+	for (i = 0; i < plan->header_conds->len; i++) {
+		FilterCondPlan *cp = g_ptr_array_index(plan->header_conds, i);
+		gboolean not_match = FLT_IS_NOT_MATCH(cp->cond->match_flag);
+		gboolean result;
+
+		if (cp->cond->match_type == FLT_IN_ADDRESSBOOK &&
+		    cp->cond->type != FLT_COND_ANY_HEADER &&
+		    !default_addrbook_func)
+			result = FALSE;
+		else
+			result = not_match ? !found[i] : found[i];
+
+		if (result && get_debug_mode())
+			filter_header_cond_log(cp->cond, not_match);
+
+		if (bool_op == FLT_AND && !result) {
+			*matched = FALSE;
+			decided = TRUE;
+			break;
+		} else if (bool_op == FLT_OR && result) {
+			*matched = TRUE;
+			decided = TRUE;
+			break;
+		}
+	}
+
+	g_free(found);
+
+	return decided;
+}
+
+static gboolean filter_plan_match_conds(GPtrArray *conds, FilterBoolOp bool_op,
+					MsgInfo *msginfo, GSList *hlist,
+					FilterInfo *fltinfo, gboolean *matched)
+{
+	FilterCondPlan *cp;
+	gboolean result;
+	guint i;
+
+	for (i = 0; i < conds->len; i++) {
+		cp = g_ptr_array_index(conds, i);
+		result = filter_match_cond(cp->cond, msginfo, hlist, fltinfo);
+		if (bool_op == FLT_AND && !result) {
+			*matched = FALSE;
+			return TRUE;
+		} else if (bool_op == FLT_OR && result) {
+			*matched = TRUE;
+			return TRUE;
+		}
+	}
+
 	return FALSE;
-#endif
+}
+
+static GHashTable *filter_header_table_new(GSList *hlist)
+{
+	GHashTable *header_table;
+	GSList *cur, *list;
+	Header *header;
+
+	header_table = g_hash_table_new_full(str_case_hash, str_case_equal,
+					     NULL,
+					     (GDestroyNotify)g_slist_free);
+
+	for (cur = hlist; cur != NULL; cur = cur->next) {
+		header = (Header *)cur->data;
+		list = g_hash_table_lookup(header_table, header->name);
+		if (list)
+			list = g_slist_append(list, header);
+		else
+			g_hash_table_insert(header_table, header->name,
+					    g_slist_append(NULL, header));
+	}
+
+	return header_table;
+}
+
+static void filter_header_table_free(GHashTable *header_table)
+{
+	if (header_table)
+		g_hash_table_destroy(header_table);
 }
 
 gboolean filter_match_rule(FilterRule *rule, MsgInfo *msginfo, GSList *hlist,
 			   FilterInfo *fltinfo)
 {
-	FilterCond *cond;
-	GSList *cur;
+	return filter_match_rule_real(rule, msginfo, hlist, NULL, fltinfo);
+}
+
+static gboolean filter_match_rule_real(FilterRule *rule, MsgInfo *msginfo,
+				       GSList *hlist, GHashTable *header_table,
+				       FilterInfo *fltinfo)
+{
+	FilterPlan *plan;
 	gboolean matched;
 
 	g_return_val_if_fail(rule->cond_list != NULL, FALSE);
+	g_return_val_if_fail(rule->plan != NULL, FALSE);
 
 	switch (rule->timing) {
 	case FLT_TIMING_ANY:
@@ -407,75 +834,24 @@ gboolean filter_match_rule(FilterRule *rule, MsgInfo *msginfo, GSList *hlist,
 		break;
 	}
 
-	if (rule->bool_op == FLT_AND) {
-		for (cur = rule->cond_list; cur != NULL; cur = cur->next) {
-			cond = (FilterCond *)cur->data;
-			if (cond->type >= FLT_COND_SIZE_GREATER) {
-				matched = filter_match_cond
-					(cond, msginfo, hlist, fltinfo);
-				if (matched == FALSE)
-					return FALSE;
-			}
-		}
-
-		for (cur = rule->cond_list; cur != NULL; cur = cur->next) {
-			cond = (FilterCond *)cur->data;
-			if (cond->type <= FLT_COND_TO_OR_CC) {
-				matched = filter_match_cond
-					(cond, msginfo, hlist, fltinfo);
-				if (matched == FALSE)
-					return FALSE;
-			}
-		}
-
-		for (cur = rule->cond_list; cur != NULL; cur = cur->next) {
-			cond = (FilterCond *)cur->data;
-			if (cond->type == FLT_COND_BODY ||
-			    cond->type == FLT_COND_CMD_TEST) {
-				matched = filter_match_cond
-					(cond, msginfo, hlist, fltinfo);
-				if (matched == FALSE)
-					return FALSE;
-			}
-		}
-
-		return TRUE;
-	} else if (rule->bool_op == FLT_OR) {
-		for (cur = rule->cond_list; cur != NULL; cur = cur->next) {
-			cond = (FilterCond *)cur->data;
-			if (cond->type >= FLT_COND_SIZE_GREATER) {
-				matched = filter_match_cond
-					(cond, msginfo, hlist, fltinfo);
-				if (matched == TRUE)
-					return TRUE;
-			}
-		}
-
-		for (cur = rule->cond_list; cur != NULL; cur = cur->next) {
-			cond = (FilterCond *)cur->data;
-			if (cond->type <= FLT_COND_TO_OR_CC) {
-				matched = filter_match_cond
-					(cond, msginfo, hlist, fltinfo);
-				if (matched == TRUE)
-					return TRUE;
-			}
-		}
-
-		for (cur = rule->cond_list; cur != NULL; cur = cur->next) {
-			cond = (FilterCond *)cur->data;
-			if (cond->type == FLT_COND_BODY ||
-			    cond->type == FLT_COND_CMD_TEST) {
-				matched = filter_match_cond
-					(cond, msginfo, hlist, fltinfo);
-				if (matched == TRUE)
-					return TRUE;
-			}
-		}
-
+	if (rule->bool_op != FLT_AND && rule->bool_op != FLT_OR)
 		return FALSE;
-	}
 
-	return FALSE;
+	plan = rule->plan;
+
+	if (filter_plan_match_conds(plan->status_conds, rule->bool_op,
+				    msginfo, hlist, fltinfo, &matched))
+		return matched;
+	if (plan->header_conds->len > 0 &&
+	    filter_plan_match_headers(plan, rule->bool_op, hlist,
+				      header_table, &matched))
+		return matched;
+	if (filter_plan_match_conds(plan->content_conds, rule->bool_op,
+				    msginfo, hlist, fltinfo, &matched))
+		return matched;
+
+	/* no condition decided the rule */
+	return rule->bool_op == FLT_AND;
 }
 
 static gboolean filter_match_cond(FilterCond *cond, MsgInfo *msginfo,
@@ -503,8 +879,13 @@ static gboolean filter_match_cond(FilterCond *cond, MsgInfo *msginfo,
 		else
 			return filter_match_header_cond(cond, hlist);
 	case FLT_COND_BODY:
-		matched = procmime_find_string(msginfo, cond->str_value,
-					       cond->match_func);
+		if (fltinfo->body_index && cond->match_type != FLT_REGEX &&
+		    !body_index_may_contain(fltinfo->body_index, msginfo,
+					    cond->str_value))
+			matched = FALSE;
+		else
+			matched = procmime_find_string(msginfo, cond->str_value,
+						       cond->match_func);
 		break;
 	case FLT_COND_CMD_TEST:
 		file = procmsg_get_message_file(msginfo);
@@ -743,6 +1124,21 @@ gboolean filter_rule_requires_full_headers(FilterRule *rule)
 	return FALSE;
 }
 
+gboolean filter_rule_uses_body_index(FilterRule *rule)
+{
+	GSList *cur;
+
+	for (cur = rule->cond_list; cur != NULL; cur = cur->next) {
+		FilterCond *cond = (FilterCond *)cur->data;
+
+		if (cond->type == FLT_COND_BODY &&
+		    cond->match_type != FLT_REGEX)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
 #define RETURN_IF_TAG_NOT_MATCH(tag_name)			\
 	if (strcmp2(xmlnode->tag->tag, tag_name) != 0) {	\
 		g_warning("tag name != \"" tag_name "\"\n");	\
@@ -1466,6 +1862,7 @@ FilterRule *filter_rule_new(const gchar *name, FilterBoolOp bool_op,
 	rule->action_list = action_list;
 	rule->timing = FLT_TIMING_ANY;
 	rule->enabled = TRUE;
+	rule->plan = filter_plan_new(cond_list);
 
 	return rule;
 }
@@ -1907,6 +2304,7 @@ void filter_rule_free(FilterRule *rule)
 	g_free(rule->name);
 	g_free(rule->target_folder);
 
+	filter_plan_free(rule->plan);
 	filter_cond_list_free(rule->cond_list);
 	filter_action_list_free(rule->action_list);
 
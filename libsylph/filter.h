@@ -24,12 +24,14 @@
 
 #include "folder.h"
 #include "procmsg.h"
+#include "bodyindex.h"
 #include "utils.h"
 
 typedef struct _FilterCond	FilterCond;
 typedef struct _FilterAction	FilterAction;
 typedef struct _FilterRule	FilterRule;
 typedef struct _FilterInfo	FilterInfo;
+typedef struct _FilterPlan	FilterPlan;
 
 typedef enum
 {
@@ -150,6 +152,9 @@ struct _FilterRule
 
 	gchar *target_folder;
 	gboolean recursive;
+
+	/* compiled from cond_list by filter_rule_new() */
+	FilterPlan *plan;
 };
 
 struct _FilterInfo
@@ -164,6 +169,8 @@ struct _FilterInfo
 
 	FilterErrorValue error;
 	gint last_exec_exit_status;
+
+	BodyIndex *body_index;
 };
 
 gint filter_apply			(GSList			*fltlist,
@@ -184,6 +191,7 @@ gboolean filter_match_rule		(FilterRule		*rule,
 					 FilterInfo		*fltinfo);
 
 gboolean filter_rule_requires_full_headers	(FilterRule	*rule);
+gboolean filter_rule_uses_body_index		(FilterRule	*rule);
 
 /* read / write config */
 GSList *filter_xml_node_to_filter_list	(GNode			*node);
@@ -28,6 +28,15 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+
+#if defined(HAVE_OPENAT) && !defined(G_OS_WIN32)
+#  include <sys/types.h>
+#  include <sys/stat.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#  define USE_DIR_FD	1
+#endif
 
 #include "folder.h"
 #include "session.h"
@@ -42,6 +51,7 @@
 #include "account.h"
 #include "prefs_account.h"
 #include "sylmain.h"
+#include "stringtable.h"
 
 typedef struct _FolderPrivData FolderPrivData;
 
@@ -52,12 +62,55 @@ struct _FolderPrivData {
 	FolderUIFunc2 ui_func2;
 	gpointer ui_func2_data;
 
+	StringTable *string_table;
+
 	gpointer data;
 };
 
 static GList *folder_list = NULL;
 static GList *folder_priv_list = NULL;
 
+#ifdef USE_DIR_FD
+/* directory descriptors of the recently used folders, the most recently
+   used one first. the number is limited so that a large folder tree does
+   not exhaust the file descriptor table */
+#define DIR_FD_CACHE_MAX	64
+
+typedef struct _FolderItemDirFd
+{
+	FolderItem *item;
+	gint fd;
+	gint ref_count;		/* users between get and release */
+} FolderItemDirFd;
+
+static GList *dir_fd_list = NULL;
+static guint dir_fd_count = 0;
+/* descriptors dropped from dir_fd_list while in use. they are closed
+   when the last user releases them */
+static GList *dir_fd_stale_list = NULL;
+
+#if USE_THREADS
+G_LOCK_DEFINE_STATIC(dir_fd);
+#define S_LOCK(name)	G_LOCK(name)
+#define S_UNLOCK(name)	G_UNLOCK(name)
+#else
+#define S_LOCK(name)
+#define S_UNLOCK(name)
+#endif
+
+/* closes a descriptor removed from dir_fd_list, or defers it to the last
+   user. must be called with the dir_fd lock held */
+static void folder_item_dir_fd_discard(FolderItemDirFd *dfd)
+{
+	if (dfd->ref_count > 0) {
+		dir_fd_stale_list = g_list_prepend(dir_fd_stale_list, dfd);
+		return;
+	}
+	close(dfd->fd);
+	g_free(dfd);
+}
+#endif /* USE_DIR_FD */
+
 static void folder_init		(Folder		*folder,
 				 const gchar	*name);
 
@@ -145,6 +198,8 @@ void folder_destroy(Folder *folder)
 
 	priv = folder_get_priv(folder);
 	folder_priv_list = g_list_remove(folder_priv_list, priv);
+	if (priv && priv->string_table)
+		string_table_free(priv->string_table);
 	g_free(priv);
 
 	g_free(folder->name);
@@ -241,6 +296,10 @@ FolderItem *folder_item_new(const gchar *name, const gchar *path)
 	item->name = g_strdup(name);
 	item->path = g_strdup(path);
 	item->mtime = 0;
+	item->dir_mtime = 0;
+	item->dir_ino = 0;
+	item->dir_size = 0;
+	item->highest_modseq = 0;
 	item->new = 0;
 	item->unread = 0;
 	item->total = 0;
@@ -265,6 +324,7 @@ FolderItem *folder_item_new(const gchar *name, const gchar *path)
 	item->auto_bcc = NULL;
 	item->auto_replyto = NULL;
 	item->mark_queue = NULL;
+	item->mark_records = 0;
 	item->last_selected = 0;
 	item->qsearch_cond_type = 0;
 	item->data = NULL;
@@ -294,6 +354,10 @@ FolderItem *folder_item_copy(FolderItem *item)
 	new_item->name = g_strdup(item->name);
 	new_item->path = g_strdup(item->path);
 	new_item->mtime = item->mtime;
+	new_item->dir_mtime = item->dir_mtime;
+	new_item->dir_ino = item->dir_ino;
+	new_item->dir_size = item->dir_size;
+	new_item->highest_modseq = item->highest_modseq;
 	new_item->new = item->new;
 	new_item->unread = item->unread;
 	new_item->total = item->total;
@@ -373,6 +437,8 @@ void folder_item_destroy(FolderItem *item)
 
 	g_return_if_fail(item != NULL);
 
+	folder_item_close_dir_fd(item);
+
 	folder = item->folder;
 	if (folder) {
 		if (folder->inbox == item)
@@ -457,6 +523,20 @@ void folder_set_ui_func2(Folder *folder, FolderUIFunc2 func, gpointer data)
 	}
 }
 
+StringTable *folder_get_string_table(Folder *folder)
+{
+	FolderPrivData *priv;
+
+	priv = folder_get_priv(folder);
+	if (!priv)
+		return NULL;
+
+	if (!priv->string_table)
+		priv->string_table = string_table_new();
+
+	return priv->string_table;
+}
+
 FolderUIFunc2 folder_get_ui_func2(Folder *folder)
 {
 	FolderPrivData *priv;
@@ -1203,6 +1283,156 @@ gchar *folder_item_get_path(FolderItem *item)
 	return path;
 }
 
+/* Returns a directory descriptor of the folder for use with openat() and
+   friends, or -1 if it is not available (the caller should fall back to
+   folder_item_get_path()). The descriptor is owned by the folder item and
+   must not be closed by the caller. It is pinned until it is released
+   with folder_item_release_dir_fd(), so that it is not closed by another
+   thread while in use. */
+gint folder_item_get_dir_fd(FolderItem *item)
+{
+#ifdef USE_DIR_FD
+	FolderItemDirFd *dfd = NULL;
+	GList *cur;
+	struct stat s;
+	gchar *path;
+	gint fd;
+
+	g_return_val_if_fail(item != NULL, -1);
+
+	S_LOCK(dir_fd);
+
+	for (cur = dir_fd_list; cur != NULL; cur = cur->next) {
+		dfd = (FolderItemDirFd *)cur->data;
+		if (dfd->item == item)
+			break;
+	}
+
+	if (cur) {
+		/* the directory was removed behind us */
+		if (fstat(dfd->fd, &s) < 0 || s.st_nlink == 0) {
+			dir_fd_list = g_list_delete_link(dir_fd_list, cur);
+			dir_fd_count--;
+			folder_item_dir_fd_discard(dfd);
+		} else {
+			if (cur != dir_fd_list) {
+				dir_fd_list = g_list_remove_link
+					(dir_fd_list, cur);
+				dir_fd_list = g_list_concat(cur, dir_fd_list);
+			}
+			dfd->ref_count++;
+			S_UNLOCK(dir_fd);
+			return dfd->fd;
+		}
+	}
+
+	path = folder_item_get_path(item);
+	if (!path) {
+		S_UNLOCK(dir_fd);
+		return -1;
+	}
+#ifdef O_DIRECTORY
+	fd = open(path, O_RDONLY | O_DIRECTORY);
+#else
+	fd = open(path, O_RDONLY);
+#endif
+	if (fd < 0) {
+		if (errno != ENOENT)
+			FILE_OP_ERROR(path, "open");
+		g_free(path);
+		S_UNLOCK(dir_fd);
+		return -1;
+	}
+	g_free(path);
+#ifdef FD_CLOEXEC
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+
+	dfd = g_new(FolderItemDirFd, 1);
+	dfd->item = item;
+	dfd->fd = fd;
+	dfd->ref_count = 1;
+	dir_fd_list = g_list_prepend(dir_fd_list, dfd);
+	dir_fd_count++;
+
+	if (dir_fd_count > DIR_FD_CACHE_MAX) {
+		cur = g_list_last(dir_fd_list);
+		dir_fd_list = g_list_delete_link(dir_fd_list, cur);
+		dir_fd_count--;
+		folder_item_dir_fd_discard((FolderItemDirFd *)cur->data);
+	}
+
+	S_UNLOCK(dir_fd);
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+/* releases the descriptor returned by folder_item_get_dir_fd(). It does
+   nothing if fd is negative */
+void folder_item_release_dir_fd(FolderItem *item, gint fd)
+{
+#ifdef USE_DIR_FD
+	FolderItemDirFd *dfd;
+	GList *cur;
+
+	if (fd < 0)
+		return;
+
+	S_LOCK(dir_fd);
+
+	for (cur = dir_fd_list; cur != NULL; cur = cur->next) {
+		dfd = (FolderItemDirFd *)cur->data;
+		if (dfd->item == item && dfd->fd == fd) {
+			dfd->ref_count--;
+			S_UNLOCK(dir_fd);
+			return;
+		}
+	}
+
+	/* the descriptor was dropped from the cache while in use */
+	for (cur = dir_fd_stale_list; cur != NULL; cur = cur->next) {
+		dfd = (FolderItemDirFd *)cur->data;
+		if (dfd->item == item && dfd->fd == fd) {
+			if (--dfd->ref_count == 0) {
+				close(dfd->fd);
+				dir_fd_stale_list = g_list_delete_link
+					(dir_fd_stale_list, cur);
+				g_free(dfd);
+			}
+			break;
+		}
+	}
+
+	S_UNLOCK(dir_fd);
+#endif
+}
+
+void folder_item_close_dir_fd(FolderItem *item)
+{
+#ifdef USE_DIR_FD
+	FolderItemDirFd *dfd;
+	GList *cur;
+
+	g_return_if_fail(item != NULL);
+
+	S_LOCK(dir_fd);
+
+	for (cur = dir_fd_list; cur != NULL; cur = cur->next) {
+		dfd = (FolderItemDirFd *)cur->data;
+		if (dfd->item == item) {
+			dir_fd_list = g_list_delete_link(dir_fd_list, cur);
+			dir_fd_count--;
+			folder_item_dir_fd_discard(dfd);
+			break;
+		}
+	}
+
+	S_UNLOCK(dir_fd);
+#endif
+}
+
 gint folder_item_scan(FolderItem *item)
 {
 	Folder *folder;
@@ -1213,6 +1443,31 @@ gint folder_item_scan(FolderItem *item)
 	return folder->klass->scan(folder, item);
 }
 
+/* scans the items, which must belong to the same folder. IMAP folders
+   check all of them at once */
+gint folder_item_scan_list(GSList *item_list)
+{
+	Folder *folder;
+	GSList *cur;
+	gint ret = 0;
+
+	if (!item_list)
+		return 0;
+
+	folder = FOLDER_ITEM(item_list->data)->folder;
+	g_return_val_if_fail(folder != NULL, -1);
+
+	if (FOLDER_TYPE(folder) == F_IMAP)
+		return imap_scan_folder_list(folder, item_list);
+
+	for (cur = item_list; cur != NULL; cur = cur->next) {
+		if (folder_item_scan(FOLDER_ITEM(cur->data)) < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
 static void folder_item_scan_foreach_func(gpointer key, gpointer val,
 					  gpointer data)
 {
@@ -1588,8 +1843,10 @@ static gboolean folder_build_tree(GNode *node, gpointer data)
 	FolderSortKey sort_key = SORT_BY_NONE;
 	FolderSortType sort_type = SORT_ASCENDING;
 	gboolean qsearch_cond_type = 0;
-	gint new = 0, unread = 0, total = 0;
-	time_t mtime = 0;
+	gint new = 0, unread = 0, total = 0, last_num = -1;
+	time_t mtime = 0, dir_mtime = 0;
+	gint64 dir_ino = 0, dir_size = 0;
+	guint64 highest_modseq = 0;
 	gboolean use_auto_to_on_reply = FALSE;
 	gchar *auto_to = NULL, *auto_cc = NULL, *auto_bcc = NULL,
 	      *auto_replyto = NULL;
@@ -1635,6 +1892,16 @@ static gboolean folder_build_tree(GNode *node, gpointer data)
 			path = attr->value;
 		} else if (!strcmp(attr->name, "mtime"))
 			mtime = strtoll(attr->value, NULL, 10);
+		else if (!strcmp(attr->name, "dir_mtime"))
+			dir_mtime = strtoll(attr->value, NULL, 10);
+		else if (!strcmp(attr->name, "dir_ino"))
+			dir_ino = strtoll(attr->value, NULL, 10);
+		else if (!strcmp(attr->name, "dir_size"))
+			dir_size = strtoll(attr->value, NULL, 10);
+		else if (!strcmp(attr->name, "highest_modseq"))
+			highest_modseq = g_ascii_strtoull(attr->value, NULL, 10);
+		else if (!strcmp(attr->name, "last_num"))
+			last_num = atoi(attr->value);
 		else if (!strcmp(attr->name, "new"))
 			new = atoi(attr->value);
 		else if (!strcmp(attr->name, "unread"))
@@ -1731,6 +1998,14 @@ static gboolean folder_build_tree(GNode *node, gpointer data)
 	item = folder_item_new(name, path);
 	item->stype = stype;
 	item->mtime = mtime;
+	item->highest_modseq = highest_modseq;
+	/* the snapshot is useless without the last number */
+	if (last_num >= 0) {
+		item->dir_mtime = dir_mtime;
+		item->dir_ino = dir_ino;
+		item->dir_size = dir_size;
+		item->last_num = last_num;
+	}
 	item->new = new;
 	item->unread = unread;
 	item->total = total;
@@ -1947,6 +2222,14 @@ static void folder_write_list_recursive(GNode *node, gpointer data)
 		fprintf(fp,
 			" mtime=\"%lld\" new=\"%d\" unread=\"%d\" total=\"%d\"",
 			(gint64)item->mtime, item->new, item->unread, item->total);
+		if (item->dir_mtime != 0 && item->last_num >= 0)
+			fprintf(fp, " dir_mtime=\"%lld\" dir_ino=\"%lld\""
+				" dir_size=\"%lld\" last_num=\"%d\"",
+				(gint64)item->dir_mtime, item->dir_ino,
+				item->dir_size, item->last_num);
+		if (item->highest_modseq != 0)
+			fprintf(fp, " highest_modseq=\"%llu\"",
+				(guint64)item->highest_modseq);
 
 		if (item->account)
 			fprintf(fp, " account_id=\"%d\"",
@@ -132,6 +132,7 @@ typedef void (*FolderDestroyNotify)	(Folder		*folder,
 #include "session.h"
 #include "procmsg.h"
 #include "utils.h"
+#include "stringtable.h"
 
 struct _Folder
 {
@@ -279,6 +280,15 @@ struct _FolderItem
 
 	stime_t mtime;
 
+	/* directory status at the last scan. the scan is skipped while
+	   the directory is unchanged (MH) */
+	stime_t dir_mtime;
+	gint64 dir_ino;
+	gint64 dir_size;
+
+	/* HIGHESTMODSEQ of the cached messages (IMAP CONDSTORE) */
+	guint64 highest_modseq;
+
 	gint new;
 	gint unread;
 	gint total;
@@ -322,6 +332,7 @@ struct _FolderItem
 
 	GSList *cache_queue;
 	GSList *mark_queue;
+	guint mark_records;	/* records in the mark file */
 
 	guint last_selected;
 	gint qsearch_cond_type;
@@ -376,6 +387,8 @@ gboolean    folder_call_ui_func2	(Folder		*folder,
 					 guint		 count,
 					 guint		 total);
 
+StringTable *folder_get_string_table	(Folder		*folder);
+
 void        folder_set_name	(Folder		*folder,
 				 const gchar	*name);
 void        folder_tree_destroy	(Folder		*folder);
@@ -422,7 +435,13 @@ void folder_unref_account_all		(PrefsAccount	*account);
 gchar *folder_get_path			(Folder		*folder);
 gchar *folder_item_get_path		(FolderItem	*item);
 
+gint   folder_item_get_dir_fd		(FolderItem	*item);
+void   folder_item_release_dir_fd	(FolderItem	*item,
+					 gint		 fd);
+void   folder_item_close_dir_fd		(FolderItem	*item);
+
 gint   folder_item_scan			(FolderItem	*item);
+gint   folder_item_scan_list		(GSList		*item_list);
 void   folder_item_scan_foreach		(GHashTable	*table);
 GSList *folder_item_get_msg_list	(FolderItem	*item,
 					 gboolean	 use_cache);
@@ -130,8 +130,21 @@ static gint imap_search_flags		(IMAPSession	*session,
 					 GArray	       **uids,
 					 GHashTable    **flags_table);
 static gint imap_fetch_flags		(IMAPSession	*session,
+					 guint64	 changedsince,
 					 GArray	       **uids,
-					 GHashTable    **flags_table);
+					 GHashTable    **flags_table,
+					 GArray	       **vanished);
+static void imap_parse_uid_set		(const gchar	*str,
+					 GArray		*set);
+static gboolean imap_uid_set_contains	(GArray		*set,
+					 guint32	 uid);
+static gboolean imap_check_changed_uids	(GSList		*mlist,
+					 gint		 exists,
+					 guint32	 cache_last,
+					 GArray		*uids,
+					 GArray		*vanished,
+					 guint32	*first_new,
+					 guint32	*last_uid);
 
 static GSList *imap_get_msg_list	(Folder		*folder,
 					 FolderItem	*item,
@@ -196,7 +209,22 @@ static gint imap_close			(Folder		*folder,
 
 static gint imap_scan_folder		(Folder		*folder,
 					 FolderItem	*item);
+static void imap_scan_folder_set_status	(FolderItem	*item,
+					 gint		 messages,
+					 gint		 recent,
+					 guint32	 uid_next,
+					 gint		 unseen);
+static gint imap_scan_folder_list_status(IMAPSession	*session,
+					 Folder		*folder,
+					 GSList		*item_list);
+static GSList *imap_scan_folder_list_list_status
+					(IMAPSession	*session,
+					 Folder		*folder,
+					 GSList		*item_list);
 static gint imap_scan_tree		(Folder		*folder);
+static gboolean imap_scan_tree_add_item_func
+					(GNode		*node,
+					 gpointer	 data);
 
 static gint imap_create_tree		(Folder		*folder);
 
@@ -295,6 +323,12 @@ static gint imap_status				(IMAPSession	*session,
 						 guint32	*uid_next,
 						 guint32	*uid_validity,
 						 gint		*unseen);
+static gint imap_parse_status			(const gchar	*str,
+						 gint		*messages,
+						 gint		*recent,
+						 guint32	*uid_next,
+						 guint32	*uid_validity,
+						 gint		*unseen);
 
 static void imap_parse_namespace		(IMAPSession	*session,
 						 IMAPFolder	*folder);
@@ -324,6 +358,13 @@ static void imap_capability_free	(IMAPSession	*session);
 
 /* low-level IMAP4rev1 commands */
 static gint imap_cmd_capability	(IMAPSession	*session);
+static gint imap_cmd_enable	(IMAPSession	*session,
+				 const gchar	*capability);
+static void imap_enable_condstore
+				(IMAPSession	*session);
+#if USE_ZLIB
+static gint imap_cmd_compress	(IMAPSession	*session);
+#endif
 static gint imap_cmd_authenticate
 				(IMAPSession	*session,
 				 const gchar	*user,
@@ -395,6 +436,15 @@ static gint imap_cmd_ok		(IMAPSession	*session,
 				 GPtrArray	*argbuf);
 static gint imap_cmd_ok_real	(IMAPSession	*session,
 				 GPtrArray	*argbuf);
+static gint imap_cmd_pipeline	(IMAPSession	*session,
+				 gchar	       **cmds,
+				 gchar	       **mailboxes,
+				 guint		 n_cmds,
+				 GPtrArray     **argbufs,
+				 gint		*results);
+static gint imap_cmd_gen_recv_response
+				(IMAPSession	*session,
+				 GString	*str);
 static gint imap_cmd_gen_send	(IMAPSession	*session,
 				 const gchar	*format, ...);
 static gint imap_cmd_gen_recv	(IMAPSession	*session,
@@ -442,6 +492,19 @@ static gint imap_thread_run_progress	(IMAPSession		*session,
 					 gpointer		 data);
 #endif
 
+static gint imap_idle_connect		(Folder		*folder);
+static void imap_idle_disconnect	(Folder		*folder);
+static gint imap_idle_enter		(Folder		*folder);
+static gint imap_idle_cycle		(Folder		*folder);
+static void imap_idle_parse_untagged	(IMAPIdle	*idle,
+					 const gchar	*str);
+static void imap_idle_queue_notify	(Folder		*folder);
+static gboolean imap_idle_recv_func	(SockInfo	*sock,
+					 GIOCondition	 condition,
+					 gpointer	 data);
+static gboolean imap_idle_timeout_func	(gpointer	 data);
+static gboolean imap_idle_notify_func	(gpointer	 data);
+
 static FolderClass imap_class =
 {
 	F_IMAP,
@@ -515,6 +578,7 @@ static void imap_folder_destroy(Folder *folder)
 		g_free(server);
 	}
 
+	imap_idle_stop(folder);
 	folder_remote_folder_destroy(REMOTE_FOLDER(folder));
 }
 
@@ -677,7 +741,10 @@ static Session *imap_session_new(PrefsAccount *account)
 	session->authenticated = FALSE;
 	session->capability    = NULL;
 	session->uidplus       = FALSE;
+	session->condstore     = FALSE;
+	session->qresync       = FALSE;
 	session->mbox          = NULL;
+	session->highest_modseq = 0;
 	session->cmd_count     = 0;
 
 	session_list = g_list_append(session_list, session);
@@ -778,6 +845,22 @@ static gint imap_session_connect(IMAPSession *session)
 		return IMAP_AUTHFAIL;
 	}
 
+	imap_enable_condstore(session);
+
+#if USE_ZLIB
+	if (imap_has_capability(session, "COMPRESS=DEFLATE")) {
+		gint ok;
+
+		/* the session can't continue once the server has started
+		   compressing */
+		ok = imap_cmd_compress(session);
+		if (ok != IMAP_SUCCESS)
+			log_warning(_("Can't start compression.\n"));
+		if (ok == IMAP_SOCKET || ok == IMAP_IOERR)
+			return IMAP_SOCKET;
+	}
+#endif
+
 	return IMAP_SUCCESS;
 }
 
@@ -789,8 +872,11 @@ static gint imap_session_reconnect(IMAPSession *session)
 
 	imap_capability_free(session);
 	session->uidplus = FALSE;
+	session->condstore = FALSE;
+	session->qresync = FALSE;
 	g_free(session->mbox);
 	session->mbox = NULL;
+	session->highest_modseq = 0;
 	session->authenticated = FALSE;
 	SESSION(session)->state = SESSION_READY;
 
@@ -886,8 +972,12 @@ static gint imap_search_flags(IMAPSession *session, GArray **uids,
 	return IMAP_SUCCESS;
 }
 
-static gint imap_fetch_flags(IMAPSession *session, GArray **uids,
-			     GHashTable **flags_table)
+/* If changedsince is not 0, only the messages whose flags have been
+   changed since that mod-sequence are fetched, and the UIDs expunged
+   since then are returned in *vanished if QRESYNC is enabled. */
+static gint imap_fetch_flags(IMAPSession *session, guint64 changedsince,
+			     GArray **uids, GHashTable **flags_table,
+			     GArray **vanished)
 {
 	gint ok;
 	gchar *tmp;
@@ -896,11 +986,24 @@ static gint imap_fetch_flags(IMAPSession *session, GArray **uids,
 	guint32 uid;
 	IMAPFlags flags;
 
-	if (imap_cmd_gen_send(session, "UID FETCH 1:* (UID FLAGS)") != IMAP_SUCCESS)
+	if (vanished)
+		*vanished = NULL;
+
+	if (changedsince > 0)
+		ok = imap_cmd_gen_send(session, "UID FETCH 1:* (UID FLAGS) "
+				       "(CHANGEDSINCE %" G_GUINT64_FORMAT "%s)",
+				       changedsince,
+				       vanished && session->qresync ?
+				       " VANISHED" : "");
+	else
+		ok = imap_cmd_gen_send(session, "UID FETCH 1:* (UID FLAGS)");
+	if (ok != IMAP_SUCCESS)
 		return IMAP_ERROR;
 
 	*uids = g_array_new(FALSE, FALSE, sizeof(guint32));
 	*flags_table = g_hash_table_new(NULL, g_direct_equal);
+	if (changedsince > 0 && vanished && session->qresync)
+		*vanished = g_array_new(FALSE, FALSE, sizeof(guint32));
 
 	log_print("IMAP4< %s\n", _("(retrieving FLAGS...)"));
 
@@ -920,11 +1023,21 @@ static gint imap_fetch_flags(IMAPSession *session, GArray **uids,
 		g_free(tmp);					\
 		g_hash_table_destroy(*flags_table);		\
 		g_array_free(*uids, TRUE);			\
+		if (vanished && *vanished) {			\
+			g_array_free(*vanished, TRUE);		\
+			*vanished = NULL;			\
+		}						\
 		return IMAP_ERROR;				\
 	}							\
 }
 
 		PARSE_ONE_ELEMENT(' ');
+		if (!strcmp(buf, "VANISHED")) {
+			if (vanished && *vanished)
+				imap_parse_uid_set(cur_pos, *vanished);
+			g_free(tmp);
+			continue;
+		}
 		PARSE_ONE_ELEMENT(' ');
 		if (strcmp(buf, "FETCH") != 0) {
 			g_free(tmp);
@@ -954,6 +1067,9 @@ static gint imap_fetch_flags(IMAPSession *session, GArray **uids,
 				PARSE_ONE_ELEMENT(')');
 				flags = imap_parse_imap_flags(buf);
 				flags |= IMAP_FLAG_DRAFT;
+			} else if (!strncmp(cur_pos, "MODSEQ (", 8)) {
+				cur_pos += 8;
+				PARSE_ONE_ELEMENT(')');
 			} else {
 				g_warning("invalid FETCH response: %s\n", cur_pos);
 				break;
@@ -974,11 +1090,102 @@ static gint imap_fetch_flags(IMAPSession *session, GArray **uids,
 	if (ok != IMAP_SUCCESS) {
 		g_hash_table_destroy(*flags_table);
 		g_array_free(*uids, TRUE);
+		if (vanished && *vanished) {
+			g_array_free(*vanished, TRUE);
+			*vanished = NULL;
+		}
 	}
 
 	return ok;
 }
 
+/* Parses a sequence set like "(EARLIER) 41,43:116" into pairs of the
+   first and the last UIDs of each range. */
+static void imap_parse_uid_set(const gchar *str, GArray *set)
+{
+	gchar *p = (gchar *)str;
+	guint32 first, last, tmp;
+
+	while (*p == ' ') p++;
+	if (*p == '(') {
+		while (*p != '\0' && *p != ')') p++;
+		if (*p == ')') p++;
+		while (*p == ' ') p++;
+	}
+
+	while (g_ascii_isdigit(*p)) {
+		first = last = strtoul(p, &p, 10);
+		if (*p == ':') {
+			p++;
+			last = strtoul(p, &p, 10);
+			if (first > last) {
+				tmp = first;
+				first = last;
+				last = tmp;
+			}
+		}
+		g_array_append_val(set, first);
+		g_array_append_val(set, last);
+		if (*p != ',')
+			break;
+		p++;
+	}
+}
+
+static gboolean imap_uid_set_contains(GArray *set, guint32 uid)
+{
+	guint i;
+
+	for (i = 0; i + 1 < set->len; i += 2) {
+		if (uid >= g_array_index(set, guint32, i) &&
+		    uid <= g_array_index(set, guint32, i + 1))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Checks that the cached messages which have not vanished plus the new
+   messages found by CHANGEDSINCE make up the whole mailbox. Otherwise
+   some expunges have been missed and the full flags must be fetched. */
+static gboolean imap_check_changed_uids(GSList *mlist, gint exists,
+					guint32 cache_last, GArray *uids,
+					GArray *vanished, guint32 *first_new,
+					guint32 *last_uid)
+{
+	GSList *cur;
+	MsgInfo *msginfo;
+	guint32 uid;
+	gint count = 0;
+	guint i;
+
+	*first_new = 0;
+	*last_uid = cache_last;
+
+	for (cur = mlist; cur != NULL; cur = cur->next) {
+		msginfo = (MsgInfo *)cur->data;
+		if (!vanished ||
+		    !imap_uid_set_contains(vanished, msginfo->msgnum))
+			count++;
+	}
+
+	for (i = 0; i < uids->len; i++) {
+		uid = g_array_index(uids, guint32, i);
+		if (uid <= cache_last)
+			continue;
+		count++;
+		if (*first_new == 0 || uid < *first_new)
+			*first_new = uid;
+		if (uid > *last_uid)
+			*last_uid = uid;
+	}
+
+	debug_print("imap_check_changed_uids: %d messages, %d exist\n",
+		    count, exists);
+
+	return count == exists;
+}
+
 static GSList *imap_get_msg_list_full(Folder *folder, FolderItem *item,
 				      gboolean use_cache,
 				      gboolean uncached_only)
@@ -987,6 +1194,7 @@ static GSList *imap_get_msg_list_full(Folder *folder, FolderItem *item,
 	IMAPSession *session;
 	gint ok, exists = 0, recent = 0, unseen = 0;
 	guint32 uid_validity = 0;
+	guint64 highest_modseq;
 	guint32 first_uid = 0, last_uid = 0;
 	GSList *newlist = NULL;
 
@@ -1011,6 +1219,7 @@ static GSList *imap_get_msg_list_full(Folder *folder, FolderItem *item,
 	ok = imap_select(session, IMAP_FOLDER(folder), item->path,
 			 &exists, &recent, &unseen, &uid_validity);
 	if (ok != IMAP_SUCCESS) THROW;
+	highest_modseq = session->highest_modseq;
 
 	if (exists == 0) {
 		imap_delete_all_cached_messages(item);
@@ -1028,6 +1237,8 @@ static GSList *imap_get_msg_list_full(Folder *folder, FolderItem *item,
 		GArray *uids;
 		GHashTable *msg_table;
 		GHashTable *flags_table;
+		GArray *vanished = NULL;
+		gboolean changed_only = FALSE;
 		guint32 cache_last;
 		guint32 begin = 0;
 		GSList *cur, *next = NULL;
@@ -1040,16 +1251,52 @@ static GSList *imap_get_msg_list_full(Folder *folder, FolderItem *item,
 		procmsg_set_flags(mlist, item);
 		cache_last = procmsg_get_last_num_in_msg_list(mlist);
 
+		/* get only the flags changed since the last sync if the
+		   server supports CONDSTORE */
+		if (session->condstore && highest_modseq > 0 &&
+		    item->highest_modseq > 0 &&
+		    item->highest_modseq <= highest_modseq) {
+			if (item->highest_modseq == highest_modseq) {
+				debug_print("imap_get_msg_list: "
+					    "HIGHESTMODSEQ not changed.\n");
+				uids = g_array_new(FALSE, FALSE,
+						   sizeof(guint32));
+				flags_table = g_hash_table_new(NULL,
+							       g_direct_equal);
+				ok = IMAP_SUCCESS;
+			} else
+				ok = imap_fetch_flags(session,
+						      item->highest_modseq,
+						      &uids, &flags_table,
+						      &vanished);
+			if (ok == IMAP_SOCKET || ok == IMAP_IOERR) THROW;
+			if (ok == IMAP_SUCCESS) {
+				changed_only = imap_check_changed_uids
+					(mlist, exists, cache_last, uids,
+					 vanished, &begin, &last_uid);
+				if (!changed_only) {
+					g_array_free(uids, TRUE);
+					g_hash_table_destroy(flags_table);
+					if (vanished) {
+						g_array_free(vanished, TRUE);
+						vanished = NULL;
+					}
+				}
+			}
+		}
+
 		/* get all UID list and flags */
+		if (!changed_only) {
 #if 0
 		ok = imap_search_flags(session, &uids, &flags_table);
 		if (ok != IMAP_SUCCESS) {
 			if (ok == IMAP_SOCKET || ok == IMAP_IOERR) THROW;
-			ok = imap_fetch_flags(session, &uids, &flags_table);
+			ok = imap_fetch_flags(session, 0, &uids, &flags_table,
+					      NULL);
 			if (ok != IMAP_SUCCESS) THROW;
 		}
 #else
-		ok = imap_fetch_flags(session, &uids, &flags_table);
+		ok = imap_fetch_flags(session, 0, &uids, &flags_table, NULL);
 		if (ok != IMAP_SUCCESS) THROW;
 #endif
 
@@ -1061,6 +1308,7 @@ static GSList *imap_get_msg_list_full(Folder *folder, FolderItem *item,
 			g_hash_table_destroy(flags_table);
 			THROW;
 		}
+		}
 
 		/* sync message flags with server */
 		for (cur = mlist; cur != NULL; cur = next) {
@@ -1070,6 +1318,13 @@ static GSList *imap_get_msg_list_full(Folder *folder, FolderItem *item,
 				(flags_table,
 				 GUINT_TO_POINTER(msginfo->msgnum)));
 
+			/* unchanged since the last sync */
+			if (imap_flags == 0 && changed_only &&
+			    (!vanished ||
+			     !imap_uid_set_contains(vanished,
+						    msginfo->msgnum)))
+				continue;
+
 			if (imap_flags == 0) {
 				debug_print("imap_get_msg_list: "
 					    "message %u has been deleted.\n",
@@ -1144,11 +1399,15 @@ static GSList *imap_get_msg_list_full(Folder *folder, FolderItem *item,
 			}
 		}
 
-		/* check for the first new message */
-		msg_table = procmsg_msg_hash_table_create(mlist);
-		if (msg_table == NULL)
-			begin = first_uid;
-		else {
+		/* check for the first new message (already found by
+		   imap_check_changed_uids() if only the changes are known) */
+		msg_table = NULL;
+		if (!changed_only) {
+			msg_table = procmsg_msg_hash_table_create(mlist);
+			if (msg_table == NULL)
+				begin = first_uid;
+		}
+		if (msg_table) {
 			gint i;
 
 			for (i = 0; i < uids->len; i++) {
@@ -1169,6 +1428,8 @@ static GSList *imap_get_msg_list_full(Folder *folder, FolderItem *item,
 
 		g_array_free(uids, TRUE);
 		g_hash_table_destroy(flags_table);
+		if (vanished)
+			g_array_free(vanished, TRUE);
 
 		/* remove ununsed caches */
 		if (first_uid > 0 && last_uid > 0) {
@@ -1213,6 +1474,7 @@ static GSList *imap_get_msg_list_full(Folder *folder, FolderItem *item,
 
 	if (!item->opened) {
 		item->mtime = uid_validity;
+		item->highest_modseq = highest_modseq;
 		if (item->cache_dirty)
 			procmsg_write_cache_list(item, mlist);
 		if (item->mark_dirty)
@@ -1880,14 +2142,232 @@ static gint imap_scan_folder(Folder *folder, FolderItem *item)
 			 &messages, &recent, &uid_next, &uid_validity, &unseen);
 	if (ok != IMAP_SUCCESS) return -1;
 
+	imap_scan_folder_set_status(item, messages, recent, uid_next, unseen);
+
+	return 0;
+}
+
+static void imap_scan_folder_set_status(FolderItem *item, gint messages,
+					gint recent, guint32 uid_next,
+					gint unseen)
+{
 	item->new = unseen > 0 ? recent : 0;
 	item->unread = unseen;
 	item->total = messages;
 	item->last_num = (messages > 0 && uid_next > 0) ? uid_next - 1 : 0;
 	/* item->mtime = uid_validity; */
 	item->updated = TRUE;
+}
 
-	return 0;
+/* Scans the items of the folder at once. With LIST-STATUS (RFC 5819) the
+   whole tree is checked by one LIST command. Otherwise, or for the items
+   the LIST did not cover, the STATUS commands are sent back-to-back, so
+   the check costs about one round trip instead of one per folder. */
+gint imap_scan_folder_list(Folder *folder, GSList *item_list)
+{
+	IMAPSession *session;
+	GSList *rest;
+	gint ret;
+
+	g_return_val_if_fail(folder != NULL, -1);
+
+	if (!item_list)
+		return 0;
+
+	session = imap_session_get(folder);
+	if (!session) return -1;
+
+	if (!imap_has_capability(session, "LIST-STATUS"))
+		return imap_scan_folder_list_status(session, folder, item_list);
+
+	rest = imap_scan_folder_list_list_status(session, folder, item_list);
+	ret = imap_scan_folder_list_status(session, folder, rest);
+	g_slist_free(rest);
+
+	return ret;
+}
+
+static gint imap_scan_folder_list_status(IMAPSession *session,
+					 Folder *folder, GSList *item_list)
+{
+	FolderItem *item;
+	GSList *cur;
+	gchar **cmds;
+	gchar **mailboxes;
+	GPtrArray **argbufs;
+	gint *results;
+	guint n_cmds, i;
+	gint messages, recent, unseen;
+	guint32 uid_next, uid_validity;
+	gint ok, ret = 0;
+
+	if (!item_list)
+		return 0;
+
+	n_cmds = g_slist_length(item_list);
+	cmds = g_new0(gchar *, n_cmds + 1);
+	mailboxes = g_new0(gchar *, n_cmds + 1);
+	argbufs = g_new(GPtrArray *, n_cmds);
+	results = g_new(gint, n_cmds);
+
+	for (cur = item_list, i = 0; cur != NULL; cur = cur->next, i++) {
+		gchar *real_path;
+		gchar *real_path_;
+
+		item = FOLDER_ITEM(cur->data);
+		real_path = imap_get_real_path(IMAP_FOLDER(folder), item->path);
+		QUOTE_IF_REQUIRED(real_path_, real_path);
+		cmds[i] = g_strdup_printf("STATUS %s "
+					  "(MESSAGES RECENT UIDNEXT UIDVALIDITY "
+					  "UNSEEN)", real_path_);
+		mailboxes[i] = real_path;
+		argbufs[i] = g_ptr_array_new();
+	}
+
+	ok = imap_cmd_pipeline(session, cmds, mailboxes, n_cmds, argbufs,
+			       results);
+	if (ok != IMAP_SUCCESS) {
+		log_warning(_("error on imap command: STATUS\n"));
+		ret = -1;
+	}
+
+	for (cur = item_list, i = 0; cur != NULL; cur = cur->next, i++) {
+		item = FOLDER_ITEM(cur->data);
+
+		if (ok == IMAP_SUCCESS && results[i] == IMAP_SUCCESS &&
+		    imap_parse_status(search_array_str(argbufs[i], "STATUS"),
+				      &messages, &recent, &uid_next,
+				      &uid_validity, &unseen) == IMAP_SUCCESS)
+			imap_scan_folder_set_status(item, messages, recent,
+						    uid_next, unseen);
+		else if (ok == IMAP_SUCCESS) {
+			log_warning(_("error on imap command: STATUS\n"));
+			ret = -1;
+		}
+
+		ptr_array_free_strings(argbufs[i]);
+		g_ptr_array_free(argbufs[i], TRUE);
+	}
+
+	g_strfreev(cmds);
+	g_strfreev(mailboxes);
+	g_free(argbufs);
+	g_free(results);
+
+	return ret;
+}
+
+/* returns the mailbox name of a STATUS response line */
+static gchar *imap_get_status_mailbox(const gchar *str)
+{
+	GString *name;
+	const gchar *p;
+	gint len;
+
+	if (strncmp(str, "STATUS ", 7) != 0)
+		return NULL;
+	str += 7;
+
+	if (*str == '{') {
+		/* literal */
+		len = atoi(str + 1);
+		if (len < 0 || (p = strstr(str, "\r\n")) == NULL ||
+		    strlen(p + 2) < len)
+			return NULL;
+		return g_strndup(p + 2, len);
+	} else if (*str != '"') {
+		if ((p = strchr(str, ' ')) == NULL)
+			return NULL;
+		return g_strndup(str, p - str);
+	}
+
+	name = g_string_new(NULL);
+	for (p = str + 1; *p != '\0' && *p != '"'; p++) {
+		if (*p == '\\' && *(p + 1) != '\0')
+			p++;
+		g_string_append_c(name, *p);
+	}
+	if (*p != '"') {
+		g_string_free(name, TRUE);
+		return NULL;
+	}
+
+	return g_string_free(name, FALSE);
+}
+
+/* checks the items with a LIST command returning STATUS of each mailbox.
+   returns the items which were not found in the response */
+static GSList *imap_scan_folder_list_list_status(IMAPSession *session,
+						 Folder *folder,
+						 GSList *item_list)
+{
+	FolderItem *root;
+	FolderItem *item;
+	GPtrArray *argbuf;
+	GHashTable *status_table;
+	GSList *rest = NULL, *cur;
+	gchar *real_path;
+	gchar *wildcard_path;
+	gchar separator;
+	gint messages, recent, unseen;
+	guint32 uid_next, uid_validity;
+	guint i;
+	gint ok;
+
+	root = FOLDER_ITEM(folder->node->data);
+	separator = imap_get_path_separator(IMAP_FOLDER(folder), root->path);
+	if (root->path) {
+		real_path = imap_get_real_path(IMAP_FOLDER(folder), root->path);
+		strtailchomp(real_path, separator);
+		wildcard_path = g_strdup_printf("%s%c*", real_path, separator);
+		g_free(real_path);
+	} else
+		wildcard_path = g_strdup("*");
+
+	argbuf = g_ptr_array_new();
+	ok = imap_cmd_gen_send(session, "LIST \"\" \"%s\" RETURN (STATUS "
+			       "(MESSAGES RECENT UIDNEXT UIDVALIDITY UNSEEN))",
+			       wildcard_path);
+	if (ok == IMAP_SUCCESS)
+		ok = imap_cmd_ok(session, argbuf);
+	g_free(wildcard_path);
+	if (ok != IMAP_SUCCESS) {
+		log_warning(_("error on imap command: LIST\n"));
+		ptr_array_free_strings(argbuf);
+		g_ptr_array_free(argbuf, TRUE);
+		return g_slist_copy(item_list);
+	}
+
+	status_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+					     g_free, NULL);
+	for (i = 0; i < argbuf->len; i++) {
+		gchar *str = g_ptr_array_index(argbuf, i);
+		gchar *name;
+
+		if ((name = imap_get_status_mailbox(str)) != NULL)
+			g_hash_table_insert(status_table, name, str);
+	}
+
+	for (cur = item_list; cur != NULL; cur = cur->next) {
+		const gchar *str;
+
+		item = FOLDER_ITEM(cur->data);
+		real_path = imap_get_real_path(IMAP_FOLDER(folder), item->path);
+		str = g_hash_table_lookup(status_table, real_path);
+		if (imap_parse_status(str, &messages, &recent, &uid_next,
+				      &uid_validity, &unseen) == IMAP_SUCCESS)
+			imap_scan_folder_set_status(item, messages, recent,
+						    uid_next, unseen);
+		else
+			rest = g_slist_prepend(rest, item);
+		g_free(real_path);
+	}
+
+	g_hash_table_destroy(status_table);
+	ptr_array_free_strings(argbuf);
+	g_ptr_array_free(argbuf, TRUE);
+
+	return g_slist_reverse(rest);
 }
 
 static gint imap_scan_tree(Folder *folder)
@@ -1959,9 +2439,32 @@ static gint imap_scan_tree(Folder *folder)
 		folder_item_destroy(FOLDER_ITEM(cur->data));
 	g_slist_free(item_list);
 
+	/* refresh the counts of the whole tree in one exchange. without
+	   LIST-STATUS it would take a STATUS for every folder, so it is left
+	   to the check for new messages */
+	if (imap_has_capability(session, "LIST-STATUS")) {
+		item_list = NULL;
+		g_node_traverse(folder->node, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+				imap_scan_tree_add_item_func, &item_list);
+		item_list = g_slist_reverse(item_list);
+		imap_scan_folder_list(folder, item_list);
+		g_slist_free(item_list);
+	}
+
 	return 0;
 }
 
+static gboolean imap_scan_tree_add_item_func(GNode *node, gpointer data)
+{
+	GSList **item_list = (GSList **)data;
+	FolderItem *item = FOLDER_ITEM(node->data);
+
+	if (item->path && !item->no_select && item->stype != F_VIRTUAL)
+		*item_list = g_slist_prepend(*item_list, item);
+
+	return FALSE;
+}
+
 static gint imap_scan_tree_recursive(IMAPSession *session, FolderItem *item,
 				     GSList *item_list)
 {
@@ -2826,6 +3329,7 @@ static GSList *imap_get_uncached_messages(IMAPSession *session,
 {
 	IMAPGetData get_data = {item, exists, update_count, NULL};
 	gchar seq_set[22];
+	GSList *cur;
 	gint ok;
 
 	g_return_val_if_fail(session != NULL, NULL);
@@ -2852,6 +3356,10 @@ static GSList *imap_get_uncached_messages(IMAPSession *session,
 	ok = imap_get_uncached_messages_func(session, &get_data);
 #endif
 
+	/* the string table is not thread-safe */
+	for (cur = get_data.newlist; cur != NULL; cur = cur->next)
+		procmsg_msginfo_intern((MsgInfo *)cur->data);
+
 	progress_show(0, 0);
 	return get_data.newlist;
 }
@@ -2930,6 +3438,7 @@ static void imap_delete_all_cached_messages(FolderItem *item)
 	if (is_dir_exist(dir))
 		remove_all_numbered_files(dir);
 	g_free(dir);
+	item->highest_modseq = 0;
 
 	debug_print("done.\n");
 }
@@ -3453,6 +3962,9 @@ static MsgInfo *imap_parse_envelope(IMAPSession *session, FolderItem *item,
 			if (!msginfo)
 				msginfo = procheader_parse_str(headers, flags, FALSE);
 			g_free(headers);
+		} else if (!strncmp(cur_pos, "MODSEQ (", 8)) {
+			cur_pos += 8;
+			PARSE_ONE_ELEMENT(')');
 		} else {
 			g_warning("invalid FETCH response: %s\n", cur_pos);
 			break;
@@ -3702,7 +4214,6 @@ static gint imap_status(IMAPSession *session, IMAPFolder *folder,
 	gchar *real_path_;
 	gint ok;
 	GPtrArray *argbuf = NULL;
-	gchar *str;
 
 	if (messages && recent && uid_next && uid_validity && unseen) {
 		*messages = *recent = *uid_next = *uid_validity = *unseen = 0;
@@ -3723,11 +4234,34 @@ static gint imap_status(IMAPSession *session, IMAPFolder *folder,
 		log_warning(_("error on imap command: STATUS\n"));
 	if (ok != IMAP_SUCCESS || !argbuf) THROW(ok);
 
-	str = search_array_str(argbuf, "STATUS");
-	if (!str) THROW(IMAP_ERROR);
+	ok = imap_parse_status(search_array_str(argbuf, "STATUS"), messages,
+			       recent, uid_next, uid_validity, unseen);
 
-	str = strrchr_with_skip_quote(str, '"', '(');
-	if (!str) THROW(IMAP_ERROR);
+catch:
+	g_free(real_path);
+	if (argbuf) {
+		ptr_array_free_strings(argbuf);
+		g_ptr_array_free(argbuf, TRUE);
+	}
+
+	return ok;
+}
+
+#undef THROW
+
+/* parses the attributes of a STATUS response line */
+static gint imap_parse_status(const gchar *status, gint *messages,
+			      gint *recent, guint32 *uid_next,
+			      guint32 *uid_validity, gint *unseen)
+{
+	gchar *str;
+
+	*messages = *recent = *uid_next = *uid_validity = *unseen = 0;
+
+	if (!status) return IMAP_ERROR;
+
+	str = strrchr_with_skip_quote(status, '"', '(');
+	if (!str) return IMAP_ERROR;
 	str++;
 	while (*str != '\0' && *str != ')') {
 		while (*str == ' ') str++;
@@ -3753,18 +4287,9 @@ static gint imap_status(IMAPSession *session, IMAPFolder *folder,
 		}
 	}
 
-catch:
-	g_free(real_path);
-	if (argbuf) {
-		ptr_array_free_strings(argbuf);
-		g_ptr_array_free(argbuf, TRUE);
-	}
-
-	return ok;
+	return IMAP_SUCCESS;
 }
 
-#undef THROW
-
 static gboolean imap_has_capability(IMAPSession	*session,
 				    const gchar *capability)
 {
@@ -3818,8 +4343,68 @@ catch:
 	return ok;
 }
 
+static gint imap_cmd_enable(IMAPSession *session, const gchar *capability)
+{
+	gint ok;
+	GPtrArray *argbuf;
+	gchar *enabled;
+
+	argbuf = g_ptr_array_new();
+
+	if ((ok = imap_cmd_gen_send(session, "ENABLE %s", capability))
+	    != IMAP_SUCCESS)
+		THROW(ok);
+	if ((ok = imap_cmd_ok(session, argbuf)) != IMAP_SUCCESS) THROW(ok);
+
+	enabled = search_array_str(argbuf, "ENABLED");
+	if (!enabled || !strcasestr(enabled, capability)) THROW(IMAP_ERROR);
+
+catch:
+	ptr_array_free_strings(argbuf);
+	g_ptr_array_free(argbuf, TRUE);
+
+	return ok;
+}
+
+/* CONDSTORE and QRESYNC are often advertised only after login */
+static void imap_enable_condstore(IMAPSession *session)
+{
+	if (!imap_has_capability(session, "CONDSTORE") &&
+	    !imap_has_capability(session, "QRESYNC") &&
+	    imap_cmd_capability(session) != IMAP_SUCCESS)
+		return;
+
+	if (imap_has_capability(session, "QRESYNC") &&
+	    imap_cmd_enable(session, "QRESYNC") == IMAP_SUCCESS) {
+		session->condstore = TRUE;
+		session->qresync = TRUE;
+	} else if (imap_has_capability(session, "CONDSTORE"))
+		session->condstore = TRUE;
+}
+
 #undef THROW
 
+#if USE_ZLIB
+/* RFC 4978. compression starts just after the tagged OK response */
+static gint imap_cmd_compress(IMAPSession *session)
+{
+	gint ok;
+
+	ok = imap_cmd_gen_send(session, "COMPRESS DEFLATE");
+	if (ok != IMAP_SUCCESS)
+		return ok;
+	ok = imap_cmd_ok(session, NULL);
+	if (ok != IMAP_SUCCESS)
+		return ok;
+
+	/* the server compresses everything after its OK */
+	if (sock_set_compress(SESSION(session)->sock) < 0)
+		return IMAP_SOCKET;
+
+	return IMAP_SUCCESS;
+}
+#endif
+
 static gint imap_cmd_auth_plain(IMAPSession *session, const gchar *user,
 				const gchar *pass)
 {
@@ -4022,6 +4607,7 @@ static gint imap_cmd_do_select(IMAPSession *session, const gchar *folder,
 	guint uid_validity_;
 
 	*exists = *recent = *unseen = *uid_validity = 0;
+	session->highest_modseq = 0;
 	argbuf = g_ptr_array_new();
 
 	if (examine)
@@ -4030,7 +4616,9 @@ static gint imap_cmd_do_select(IMAPSession *session, const gchar *folder,
 		select_cmd = "SELECT";
 
 	QUOTE_IF_REQUIRED(folder_, folder);
-	if ((ok = imap_cmd_gen_send(session, "%s %s", select_cmd, folder_)) != IMAP_SUCCESS)
+	if ((ok = imap_cmd_gen_send(session, "%s %s%s", select_cmd, folder_,
+				    session->condstore ? " (CONDSTORE)" : ""))
+	    != IMAP_SUCCESS)
 		THROW;
 
 	if ((ok = imap_cmd_ok(session, argbuf)) != IMAP_SUCCESS) THROW;
@@ -4069,6 +4657,13 @@ static gint imap_cmd_do_select(IMAPSession *session, const gchar *folder,
 		}
 	}
 
+	resp_str = search_array_contain_str(argbuf, "HIGHESTMODSEQ ");
+	if (resp_str) {
+		resp_str = strstr(resp_str, "HIGHESTMODSEQ ");
+		session->highest_modseq = g_ascii_strtoull
+			(resp_str + strlen("HIGHESTMODSEQ "), NULL, 10);
+	}
+
 catch:
 	ptr_array_free_strings(argbuf);
 	g_ptr_array_free(argbuf, TRUE);
@@ -4475,21 +5070,18 @@ static gint imap_cmd_close(IMAPSession *session)
 	return ok;
 }
 
-static gint imap_cmd_ok_real(IMAPSession *session, GPtrArray *argbuf)
+/* reads one response line, including the literals in it */
+static gint imap_cmd_gen_recv_response(IMAPSession *session, GString *str)
 {
 	gint ok;
 	gchar *buf;
-	gint cmd_num;
-	gchar cmd_status[IMAPBUFSIZE + 1];
-	GString *str;
 	gchar *p;
 	gchar obuf[32];
 	gint len;
 	gchar *literal;
 
-	str = g_string_sized_new(256);
+	g_string_truncate(str, 0);
 
-	//g_usleep(800000);
 	while ((ok = imap_cmd_gen_recv(session, &buf)) == IMAP_SUCCESS) {
 		g_string_append(str, buf);
 
@@ -4522,12 +5114,26 @@ static gint imap_cmd_ok_real(IMAPSession *session, GPtrArray *argbuf)
 		}
 
 		g_free(buf);
+		break;
+	}
+
+	return ok;
+}
 
+static gint imap_cmd_ok_real(IMAPSession *session, GPtrArray *argbuf)
+{
+	gint ok;
+	gint cmd_num;
+	gchar cmd_status[IMAPBUFSIZE + 1];
+	GString *str;
+
+	str = g_string_sized_new(256);
+
+	//g_usleep(800000);
+	while ((ok = imap_cmd_gen_recv_response(session, str)) == IMAP_SUCCESS) {
 		if (str->str[0] == '*' && str->str[1] == ' ') {
 			if (argbuf)
 				g_ptr_array_add(argbuf, g_strdup(str->str + 2));
-
-			g_string_truncate(str, 0);
 			continue;
 		} else if (sscanf(str->str, "%d %" Xstr(IMAPBUFSIZE) "s",
 			   &cmd_num, cmd_status) < 2) {
@@ -4567,6 +5173,149 @@ static gint imap_cmd_ok(IMAPSession *session, GPtrArray *argbuf)
 #endif
 }
 
+/* maximum number of commands sent before reading their responses.
+   keeps the server from blocking on its output while we are still
+   writing */
+#define IMAP_PIPELINE_DEPTH	64
+
+typedef struct _IMAPPipeline
+{
+	guint first_tag;
+	guint n_cmds;
+	GPtrArray **argbufs;
+	gint *results;
+	/* mailbox name -> index + 1 of the STATUS command */
+	GHashTable *mailbox_table;
+} IMAPPipeline;
+
+static gint imap_cmd_pipeline_recv_func(IMAPSession *session, gpointer data)
+{
+	IMAPPipeline *pipeline = (IMAPPipeline *)data;
+	gboolean *done;
+	guint n_done = 0, cur = 0, i, j;
+	gint cmd_num;
+	gchar cmd_status[IMAPBUFSIZE + 1];
+	GString *str;
+	gint ok = IMAP_SUCCESS;
+
+	done = g_new0(gboolean, pipeline->n_cmds);
+	for (i = 0; i < pipeline->n_cmds; i++)
+		pipeline->results[i] = IMAP_ERROR;
+
+	str = g_string_sized_new(256);
+
+	while (n_done < pipeline->n_cmds &&
+	       (ok = imap_cmd_gen_recv_response(session, str)) == IMAP_SUCCESS) {
+		if (str->str[0] == '*' && str->str[1] == ' ') {
+			gchar *name;
+
+			/* a STATUS response names its mailbox, and may come
+			   before the completion of an earlier command. other
+			   untagged data belongs to the oldest command still
+			   in progress */
+			i = cur;
+			if (pipeline->mailbox_table &&
+			    (name = imap_get_status_mailbox(str->str + 2))
+			    != NULL) {
+				j = GPOINTER_TO_UINT(g_hash_table_lookup
+					(pipeline->mailbox_table, name));
+				if (j > 0)
+					i = j - 1;
+				g_free(name);
+			}
+			if (i < pipeline->n_cmds && pipeline->argbufs &&
+			    pipeline->argbufs[i])
+				g_ptr_array_add(pipeline->argbufs[i],
+						g_strdup(str->str + 2));
+			continue;
+		}
+
+		if (sscanf(str->str, "%d %" Xstr(IMAPBUFSIZE) "s",
+			   &cmd_num, cmd_status) < 2 || cmd_num < 0 ||
+		    (guint)cmd_num < pipeline->first_tag ||
+		    (guint)cmd_num - pipeline->first_tag >= pipeline->n_cmds ||
+		    done[cmd_num - pipeline->first_tag]) {
+			ok = IMAP_ERROR;
+			break;
+		}
+
+		i = cmd_num - pipeline->first_tag;
+		done[i] = TRUE;
+		n_done++;
+		if (!strcmp(cmd_status, "OK")) {
+			pipeline->results[i] = IMAP_SUCCESS;
+			if (pipeline->argbufs && pipeline->argbufs[i])
+				g_ptr_array_add(pipeline->argbufs[i],
+						g_strdup(str->str));
+		}
+
+		while (cur < pipeline->n_cmds && done[cur])
+			cur++;
+	}
+
+	g_string_free(str, TRUE);
+	g_free(done);
+
+	return ok;
+}
+
+/* Sends the commands without waiting for each response, and then
+   collects all the responses. The untagged responses of cmds[i] go to
+   argbufs[i] and its completion status to results[i]. If mailboxes is
+   not NULL, cmds[i] is a STATUS command for mailboxes[i], and the STATUS
+   responses are assigned by their mailbox names. The return value is
+   not IMAP_SUCCESS only if the connection or the protocol failed. */
+static gint imap_cmd_pipeline(IMAPSession *session, gchar **cmds,
+			      gchar **mailboxes, guint n_cmds,
+			      GPtrArray **argbufs, gint *results)
+{
+	IMAPPipeline pipeline;
+	guint i, j, n;
+	gint ok = IMAP_SUCCESS;
+
+	for (i = 0; i < n_cmds; i += n) {
+		n = MIN(n_cmds - i, IMAP_PIPELINE_DEPTH);
+
+		pipeline.first_tag = session->cmd_count + 1;
+		pipeline.n_cmds = n;
+		pipeline.argbufs = argbufs ? argbufs + i : NULL;
+		pipeline.results = results + i;
+		pipeline.mailbox_table = NULL;
+		if (mailboxes) {
+			pipeline.mailbox_table =
+				g_hash_table_new(g_str_hash, g_str_equal);
+			for (j = 0; j < n; j++)
+				g_hash_table_insert(pipeline.mailbox_table,
+						    mailboxes[i + j],
+						    GUINT_TO_POINTER(j + 1));
+		}
+
+		for (j = 0; j < n; j++) {
+			ok = imap_cmd_gen_send(session, "%s", cmds[i + j]);
+			if (ok != IMAP_SUCCESS)
+				break;
+		}
+		if (ok != IMAP_SUCCESS) {
+			if (pipeline.mailbox_table)
+				g_hash_table_destroy(pipeline.mailbox_table);
+			return ok;
+		}
+
+#if USE_THREADS
+		ok = imap_thread_run(session, imap_cmd_pipeline_recv_func,
+				     &pipeline);
+#else
+		ok = imap_cmd_pipeline_recv_func(session, &pipeline);
+#endif
+		if (pipeline.mailbox_table)
+			g_hash_table_destroy(pipeline.mailbox_table);
+		if (ok != IMAP_SUCCESS)
+			break;
+	}
+
+	return ok;
+}
+
 static gint imap_cmd_gen_send(IMAPSession *session, const gchar *format, ...)
 {
 	IMAPRealSession *real = (IMAPRealSession *)session;
@@ -5193,3 +5942,336 @@ gboolean imap_is_session_active(IMAPFolder *folder)
 	return FALSE;
 #endif
 }
+
+/* IDLE support: a dedicated session is kept on INBOX, and the changes
+   reported by the server are notified with the "remote-folder-changed"
+   signal. Servers without IDLE are polled with NOOP instead. */
+
+/* untagged responses are collected for this period before notifying */
+#define IMAP_IDLE_DELAY		500
+/* IDLE is restarted (or NOOP is sent) at this interval (sec) */
+#define IMAP_IDLE_INTERVAL	SESSION_TIMEOUT_INTERVAL
+
+struct _IMAPIdle
+{
+	IMAPSession *session;
+	gboolean use_idle;
+	gboolean idling;
+
+	gboolean new_msgs;
+	gboolean changed;
+
+	guint io_tag;
+	guint timeout_tag;
+	guint notify_tag;
+};
+
+gint imap_idle_start(Folder *folder)
+{
+	IMAPIdle *idle;
+
+	g_return_val_if_fail(folder != NULL, -1);
+	g_return_val_if_fail(FOLDER_TYPE(folder) == F_IMAP, -1);
+
+	if (IMAP_FOLDER(folder)->idle)
+		return 0;
+
+	debug_print("imap_idle_start: %s\n", folder->name);
+
+	idle = g_new0(IMAPIdle, 1);
+	IMAP_FOLDER(folder)->idle = idle;
+
+	/* also retries the connection if it fails */
+	idle->timeout_tag = g_timeout_add_full
+		(G_PRIORITY_LOW, IMAP_IDLE_INTERVAL * 1000,
+		 imap_idle_timeout_func, folder, NULL);
+
+	imap_idle_connect(folder);
+
+	return 0;
+}
+
+void imap_idle_stop(Folder *folder)
+{
+	IMAPIdle *idle;
+
+	g_return_if_fail(folder != NULL);
+	g_return_if_fail(FOLDER_TYPE(folder) == F_IMAP);
+
+	idle = IMAP_FOLDER(folder)->idle;
+	if (!idle)
+		return;
+
+	debug_print("imap_idle_stop: %s\n", folder->name);
+
+	imap_idle_disconnect(folder);
+	if (idle->timeout_tag > 0)
+		g_source_remove(idle->timeout_tag);
+	if (idle->notify_tag > 0)
+		g_source_remove(idle->notify_tag);
+	g_free(idle);
+	IMAP_FOLDER(folder)->idle = NULL;
+	IMAP_FOLDER(folder)->idle_gen++;
+}
+
+gboolean imap_idle_is_active(Folder *folder)
+{
+	g_return_val_if_fail(folder != NULL, FALSE);
+	g_return_val_if_fail(FOLDER_TYPE(folder) == F_IMAP, FALSE);
+
+	return IMAP_FOLDER(folder)->idle != NULL &&
+		IMAP_FOLDER(folder)->idle->session != NULL;
+}
+
+static gint imap_idle_connect(Folder *folder)
+{
+	IMAPIdle *idle = IMAP_FOLDER(folder)->idle;
+	guint idle_gen = IMAP_FOLDER(folder)->idle_gen;
+	PrefsAccount *account = folder->account;
+	Session *session;
+	gint ok, exists, recent, unseen;
+	guint32 uid_validity;
+
+	if (!prefs_common.online_mode || !folder->inbox || !account)
+		return IMAP_ERROR;
+	/* don't ask for the password in the background */
+	if (!account->passwd && !account->tmp_pass)
+		return IMAP_AUTHFAIL;
+
+	/* the main loop runs while connecting, and IDLE may be stopped (or
+	   restarted) meanwhile. a new IMAPIdle may have the same address,
+	   so the generation is compared */
+	session = imap_session_new(account);
+	if (IMAP_FOLDER(folder)->idle_gen != idle_gen) {
+		if (session)
+			session_destroy(session);
+		return IMAP_ERROR;
+	}
+	if (!session)
+		return IMAP_SOCKET;
+
+	ok = imap_select(IMAP_SESSION(session), IMAP_FOLDER(folder),
+			 folder->inbox->path,
+			 &exists, &recent, &unseen, &uid_validity);
+	if (IMAP_FOLDER(folder)->idle_gen != idle_gen) {
+		session_destroy(session);
+		return IMAP_ERROR;
+	}
+	if (ok != IMAP_SUCCESS) {
+		session_destroy(session);
+		return ok;
+	}
+
+	idle->session = IMAP_SESSION(session);
+	idle->use_idle = imap_has_capability(idle->session, "IDLE");
+	idle->idling = FALSE;
+
+	return imap_idle_enter(folder);
+}
+
+static void imap_idle_disconnect(Folder *folder)
+{
+	IMAPIdle *idle = IMAP_FOLDER(folder)->idle;
+
+	if (idle->io_tag > 0) {
+		g_source_remove(idle->io_tag);
+		idle->io_tag = 0;
+	}
+	if (idle->session) {
+		session_destroy(SESSION(idle->session));
+		idle->session = NULL;
+	}
+	idle->idling = FALSE;
+}
+
+static gint imap_idle_enter(Folder *folder)
+{
+	IMAPIdle *idle = IMAP_FOLDER(folder)->idle;
+	gchar *buf;
+	gint ok;
+
+	if (!idle->use_idle)
+		return IMAP_SUCCESS;
+
+	if ((ok = imap_cmd_gen_send(idle->session, "IDLE")) != IMAP_SUCCESS)
+		return ok;
+
+	while ((ok = imap_cmd_gen_recv(idle->session, &buf)) == IMAP_SUCCESS) {
+		if (buf[0] == '*' && buf[1] == ' ') {
+			imap_idle_parse_untagged(idle, buf + 2);
+			g_free(buf);
+			continue;
+		}
+
+		if (buf[0] == '+') {
+			idle->idling = TRUE;
+			idle->io_tag = sock_add_watch_persistent
+				(SESSION(idle->session)->sock,
+				 G_IO_IN | G_IO_ERR | G_IO_HUP,
+				 imap_idle_recv_func, folder);
+		} else {
+			debug_print("imap_idle_enter: IDLE rejected. "
+				    "using NOOP instead.\n");
+			idle->use_idle = FALSE;
+		}
+		g_free(buf);
+		break;
+	}
+
+	return ok;
+}
+
+/* terminates IDLE (or sends NOOP) to collect the pending responses and
+   keep the connection alive, and then enters IDLE again */
+static gint imap_idle_cycle(Folder *folder)
+{
+	IMAPIdle *idle = IMAP_FOLDER(folder)->idle;
+	GPtrArray *argbuf;
+	gint ok;
+	guint i;
+
+	if (idle->io_tag > 0) {
+		g_source_remove(idle->io_tag);
+		idle->io_tag = 0;
+	}
+
+	if (idle->idling) {
+		idle->idling = FALSE;
+		log_print("IMAP4> DONE\n");
+		if (sock_puts(SESSION(idle->session)->sock, "DONE") < 0)
+			return IMAP_SOCKET;
+	} else if ((ok = imap_cmd_gen_send(idle->session, "NOOP"))
+		   != IMAP_SUCCESS)
+		return ok;
+
+	/* the responses are short; don't run the main loop meanwhile */
+	argbuf = g_ptr_array_new();
+	ok = imap_cmd_ok_real(idle->session, argbuf);
+	for (i = 0; i < argbuf->len; i++)
+		imap_idle_parse_untagged(idle, g_ptr_array_index(argbuf, i));
+	ptr_array_free_strings(argbuf);
+	g_ptr_array_free(argbuf, TRUE);
+
+	if (ok == IMAP_SUCCESS)
+		ok = imap_idle_enter(folder);
+
+	return ok;
+}
+
+static void imap_idle_parse_untagged(IMAPIdle *idle, const gchar *str)
+{
+	gint num;
+	gchar resp[16];
+
+	if (!strncmp(str, "VANISHED ", 9)) {
+		idle->changed = TRUE;
+		return;
+	}
+
+	if (sscanf(str, "%d %15s", &num, resp) != 2)
+		return;
+
+	if (!strcmp(resp, "EXISTS"))
+		idle->new_msgs = TRUE;
+	else if (!strcmp(resp, "EXPUNGE") || !strcmp(resp, "FETCH"))
+		idle->changed = TRUE;
+}
+
+static void imap_idle_queue_notify(Folder *folder)
+{
+	IMAPIdle *idle = IMAP_FOLDER(folder)->idle;
+
+	if ((idle->new_msgs || idle->changed) && idle->notify_tag == 0)
+		idle->notify_tag = g_timeout_add(IMAP_IDLE_DELAY,
+						 imap_idle_notify_func, folder);
+}
+
+static gboolean imap_idle_recv_func(SockInfo *sock, GIOCondition condition,
+				    gpointer data)
+{
+	Folder *folder = (Folder *)data;
+	IMAPIdle *idle = IMAP_FOLDER(folder)->idle;
+	gchar *buf;
+
+	if (imap_cmd_gen_recv(idle->session, &buf) != IMAP_SUCCESS) {
+		log_warning(_("IMAP4 connection to %s has been"
+			      " disconnected. Reconnecting...\n"),
+			    folder->account->recv_server);
+		/* reconnected by imap_idle_timeout_func() */
+		idle->io_tag = 0;
+		imap_idle_disconnect(folder);
+		return FALSE;
+	}
+
+	if (buf[0] == '*' && buf[1] == ' ')
+		imap_idle_parse_untagged(idle, buf + 2);
+	else if (buf[0] != '+') {
+		/* IDLE has been terminated by the server. it is entered
+		   again by imap_idle_timeout_func() */
+		idle->idling = FALSE;
+		idle->io_tag = 0;
+		g_free(buf);
+		return FALSE;
+	}
+	g_free(buf);
+
+	imap_idle_queue_notify(folder);
+
+	return TRUE;
+}
+
+static gboolean imap_idle_timeout_func(gpointer data)
+{
+	Folder *folder = (Folder *)data;
+	IMAPIdle *idle = IMAP_FOLDER(folder)->idle;
+	guint idle_gen = IMAP_FOLDER(folder)->idle_gen;
+	gint ok;
+
+	if (!prefs_common.online_mode)
+		return TRUE;
+
+	if (idle->session && imap_idle_cycle(folder) != IMAP_SUCCESS) {
+		log_warning(_("IMAP4 connection to %s has been"
+			      " disconnected. Reconnecting...\n"),
+			    folder->account->recv_server);
+		imap_idle_disconnect(folder);
+	}
+
+	/* changes may have been missed while disconnected */
+	if (!idle->session) {
+		ok = imap_idle_connect(folder);
+		/* stopped while connecting */
+		if (IMAP_FOLDER(folder)->idle_gen != idle_gen)
+			return FALSE;
+		if (ok == IMAP_SUCCESS)
+			idle->changed = TRUE;
+	}
+
+	imap_idle_queue_notify(folder);
+
+	return TRUE;
+}
+
+static gboolean imap_idle_notify_func(gpointer data)
+{
+	Folder *folder = (Folder *)data;
+	IMAPIdle *idle = IMAP_FOLDER(folder)->idle;
+	FolderItem *inbox = folder->inbox;
+	gboolean notify;
+
+	/* changes in the opened folder are mostly made by ourselves, and
+	   are reflected by the summary */
+	notify = idle->new_msgs || (idle->changed && inbox && !inbox->opened);
+	idle->new_msgs = idle->changed = FALSE;
+	idle->notify_tag = 0;
+
+	/* the handler may stop IDLE */
+	if (notify && inbox && syl_app_get()) {
+		debug_print("imap_idle_notify_func: %s changed\n",
+			    inbox->path);
+		g_signal_emit_by_name(syl_app_get(), "remote-folder-changed",
+				      inbox);
+	}
+
+	return FALSE;
+}
@@ -34,6 +34,7 @@
 typedef struct _IMAPFolder	IMAPFolder;
 typedef struct _IMAPSession	IMAPSession;
 typedef struct _IMAPNameSpace	IMAPNameSpace;
+typedef struct _IMAPIdle	IMAPIdle;
 
 #define IMAP_FOLDER(obj)	((IMAPFolder *)obj)
 #define IMAP_SESSION(obj)	((IMAPSession *)obj)
@@ -55,6 +56,11 @@ struct _IMAPFolder
 	GList *ns_personal;
 	GList *ns_others;
 	GList *ns_shared;
+
+	/* dedicated session waiting for changes in INBOX */
+	IMAPIdle *idle;
+	/* incremented whenever IDLE is stopped */
+	guint idle_gen;
 };
 
 struct _IMAPSession
@@ -65,8 +71,12 @@ struct _IMAPSession
 
 	gchar **capability;
 	gboolean uidplus;
+	gboolean condstore;
+	gboolean qresync;
 
 	gchar *mbox;
+	/* HIGHESTMODSEQ of the selected mailbox, 0 if not available */
+	guint64 highest_modseq;
 	guint cmd_count;
 };
 
@@ -127,4 +137,11 @@ gint imap_msg_list_set_colorlabel_flags	(GSList		*msglist,
 
 gboolean imap_is_session_active		(IMAPFolder	*folder);
 
+gint imap_scan_folder_list		(Folder		*folder,
+					 GSList		*item_list);
+
+gint imap_idle_start			(Folder		*folder);
+void imap_idle_stop			(Folder		*folder);
+gboolean imap_idle_is_active		(Folder		*folder);
+
 #endif /* __IMAP_H__ */
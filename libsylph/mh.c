@@ -31,11 +31,23 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #ifdef G_OS_WIN32
 #  include <windows.h>
 #endif
 
+#if defined(HAVE_OPENAT) && defined(HAVE_FSTATAT) && \
+    defined(HAVE_RENAMEAT) && defined(HAVE_LINKAT) && \
+    defined(HAVE_UNLINKAT) && defined(HAVE_FDOPENDIR) && !defined(G_OS_WIN32)
+#  define USE_AT_FUNCS	1
+#endif
+
+#if defined(HAVE_SYS_INOTIFY_H) && defined(HAVE_INOTIFY_INIT)
+#  include <sys/inotify.h>
+#  define USE_INOTIFY	1
+#endif
+
 #undef MEASURE_TIME
 
 #include "sylmain.h"
@@ -136,17 +148,43 @@ static gint    mh_move_folder		(Folder		*folder,
 static gint    mh_remove_folder		(Folder		*folder,
 					 FolderItem	*item);
 
-static gchar   *mh_get_new_msg_filename		(FolderItem	*dest);
+static gchar   *mh_get_msg_path			(FolderItem	*item,
+						 gint		 num);
+static gint	mh_stat_msg			(FolderItem	*item,
+						 gint		 num,
+						 GStatBuf	*s);
+static gboolean mh_msg_entry_exist		(FolderItem	*item,
+						 gint		 num);
+static gint	mh_link_msg			(const gchar	*file,
+						 FolderItem	*dest,
+						 gint		 num);
+static gint	mh_rename_msg			(FolderItem	*src,
+						 gint		 srcnum,
+						 FolderItem	*dest,
+						 gint		 destnum);
+static gint	mh_unlink_msg			(FolderItem	*item,
+						 gint		 num);
+static gint	mh_open_msg			(FolderItem	*item,
+						 gint		 num);
+#ifndef G_OS_WIN32
+static DIR     *mh_opendir			(FolderItem	*item,
+						 gint		*dfd);
+static gboolean mh_dirent_is_regular_file	(FolderItem	*item,
+						 gint		 dfd,
+						 struct dirent	*d);
+#endif
+static gint	mh_get_new_msg_num		(FolderItem	*dest);
 
 static gint	mh_do_move_msgs			(Folder		*folder,
 						 FolderItem	*dest,
 						 GSList		*msglist);
 
 static time_t  mh_get_mtime			(FolderItem	*item);
+static gboolean mh_is_dir_unchanged		(FolderItem	*item);
 static GSList  *mh_get_uncached_msgs		(GHashTable	*msg_table,
 						 FolderItem	*item);
-static MsgInfo *mh_parse_msg			(const gchar	*file,
-						 FolderItem	*item);
+static MsgInfo *mh_parse_msg			(FolderItem	*item,
+						 gint		 num);
 static void	mh_remove_missing_folder_items	(Folder		*folder);
 static void	mh_scan_tree_recursive		(FolderItem	*item);
 
@@ -228,8 +266,6 @@ static GSList *mh_get_msg_list_full(Folder *folder, FolderItem *item,
 
 	g_return_val_if_fail(item != NULL, NULL);
 
-	S_LOCK(mh);
-
 #ifdef MEASURE_TIME
 	timer = g_timer_new();
 #endif
@@ -312,27 +348,21 @@ static GSList *mh_get_msg_list_full(Folder *folder, FolderItem *item,
 
 		if (newlist == NULL) {
 			procmsg_msg_list_free(mlist);
-			S_UNLOCK(mh);
 			return NULL;
 		}
-		if (mlist == newlist) {
-			S_UNLOCK(mh);
+		if (mlist == newlist)
 			return newlist;
-		}
 		for (cur = mlist; cur != NULL; cur = cur->next) {
 			if (cur->next == newlist) {
 				cur->next = NULL;
 				procmsg_msg_list_free(mlist);
-				S_UNLOCK(mh);
 				return newlist;
 			}
 		}
 		procmsg_msg_list_free(mlist);
-		S_UNLOCK(mh);
 		return NULL;
 	}
 
-	S_UNLOCK(mh);
 	return mlist;
 }
 
@@ -349,9 +379,7 @@ static GSList *mh_get_uncached_msg_list(Folder *folder, FolderItem *item)
 
 static gchar *mh_fetch_msg(Folder *folder, FolderItem *item, gint num)
 {
-	gchar *path;
-	gchar *file;
-	gchar buf[16];
+	GStatBuf s;
 
 	g_return_val_if_fail(item != NULL, NULL);
 	g_return_val_if_fail(num > 0, NULL);
@@ -364,15 +392,10 @@ static gchar *mh_fetch_msg(Folder *folder, FolderItem *item, gint num)
 	if (num > item->last_num)
 		return NULL;
 
-	path = folder_item_get_path(item);
-	file = g_strconcat(path, G_DIR_SEPARATOR_S, utos_buf(buf, num), NULL);
-	g_free(path);
-	if (!is_file_exist(file)) {
-		g_free(file);
+	if (mh_stat_msg(item, num, &s) < 0 || !S_ISREG(s.st_mode))
 		return NULL;
-	}
 
-	return file;
+	return mh_get_msg_path(item, num);
 }
 
 static MsgInfo *mh_get_msginfo(Folder *folder, FolderItem *item, gint num)
@@ -385,40 +408,295 @@ static MsgInfo *mh_get_msginfo(Folder *folder, FolderItem *item, gint num)
 
 	file = mh_fetch_msg(folder, item, num);
 	if (!file) return NULL;
+	g_free(file);
 
-	msginfo = mh_parse_msg(file, item);
+	msginfo = mh_parse_msg(item, num);
 	if (msginfo)
-		msginfo->msgnum = num;
+		procmsg_msginfo_intern(msginfo);
+
+	return msginfo;
+}
+
+static gchar *mh_get_msg_path(FolderItem *item, gint num)
+{
+	gchar *path;
+	gchar *file;
+
+	path = folder_item_get_path(item);
+	g_return_val_if_fail(path != NULL, NULL);
+	file = g_strdup_printf("%s%c%d", path, G_DIR_SEPARATOR, num);
+	g_free(path);
+
+	return file;
+}
+
+/* The following functions operate on the messages relative to the
+   directory descriptor of the folder if it is available, so that the
+   kernel does not have to resolve the whole path on each access. */
+
+static gint mh_stat_msg(FolderItem *item, gint num, GStatBuf *s)
+{
+	gchar *file;
+	gint ret;
+#ifdef USE_AT_FUNCS
+	gchar buf[16];
+	gint dfd;
+
+	if ((dfd = folder_item_get_dir_fd(item)) >= 0) {
+		ret = fstatat(dfd, utos_buf(buf, num), s, 0);
+		folder_item_release_dir_fd(item, dfd);
+		return ret;
+	}
+#endif
 
+	file = mh_get_msg_path(item, num);
+	if (!file)
+		return -1;
+	ret = g_stat(file, s);
 	g_free(file);
 
-	return msginfo;
+	return ret;
+}
+
+static gboolean mh_msg_entry_exist(FolderItem *item, gint num)
+{
+	gchar *file;
+	gboolean ret;
+#ifdef USE_AT_FUNCS
+	struct stat s;
+	gchar buf[16];
+	gint dfd;
+
+	if ((dfd = folder_item_get_dir_fd(item)) >= 0) {
+		ret = fstatat(dfd, utos_buf(buf, num), &s,
+			      AT_SYMLINK_NOFOLLOW) == 0;
+		folder_item_release_dir_fd(item, dfd);
+		return ret;
+	}
+#endif
+
+	file = mh_get_msg_path(item, num);
+	if (!file)
+		return FALSE;
+	ret = is_file_entry_exist(file);
+	g_free(file);
+
+	return ret;
 }
 
-static gchar *mh_get_new_msg_filename(FolderItem *dest)
+static gint mh_link_msg(const gchar *file, FolderItem *dest, gint num)
 {
 	gchar *destfile;
-	gchar *destpath;
+	gint ret = 0;
+#ifdef USE_AT_FUNCS
+	gchar buf[16];
+	gint dfd;
+	gboolean linked;
+
+	if ((dfd = folder_item_get_dir_fd(dest)) >= 0) {
+		linked = (linkat(AT_FDCWD, file, dfd, utos_buf(buf, num), 0)
+			  == 0);
+		folder_item_release_dir_fd(dest, dfd);
+		if (linked)
+			return 0;
+	}
+#endif
 
-	destpath = folder_item_get_path(dest);
-	g_return_val_if_fail(destpath != NULL, NULL);
+	destfile = mh_get_msg_path(dest, num);
+	if (!destfile)
+		return -1;
+	if (syl_link(file, destfile) < 0) {
+		if (copy_file(file, destfile, TRUE) < 0) {
+			g_warning(_("can't copy message %s to %s\n"),
+				  file, destfile);
+			ret = -1;
+		}
+	}
+	g_free(destfile);
 
-	if (!is_dir_exist(destpath))
-		make_dir_hier(destpath);
+	return ret;
+}
 
-	for (;;) {
-		destfile = g_strdup_printf("%s%c%d", destpath, G_DIR_SEPARATOR,
-					   dest->last_num + 1);
-		if (is_file_entry_exist(destfile)) {
-			dest->last_num++;
-			g_free(destfile);
-		} else
-			break;
+static gint mh_rename_msg(FolderItem *src, gint srcnum, FolderItem *dest,
+			  gint destnum)
+{
+	gchar *srcfile;
+	gchar *destfile;
+	gint ret;
+#ifdef USE_AT_FUNCS
+	gchar srcbuf[16], destbuf[16];
+	gint srcfd, destfd;
+	gboolean fallback = TRUE;
+
+	srcfd = folder_item_get_dir_fd(src);
+	destfd = folder_item_get_dir_fd(dest);
+	if (srcfd >= 0 && destfd >= 0) {
+		ret = renameat(srcfd, utos_buf(srcbuf, srcnum),
+			       destfd, utos_buf(destbuf, destnum));
+		/* fall back to copying between different file systems */
+		if (ret == 0 || errno != EXDEV) {
+			if (ret < 0)
+				FILE_OP_ERROR(srcbuf, "renameat");
+			fallback = FALSE;
+		}
 	}
+	folder_item_release_dir_fd(dest, destfd);
+	folder_item_release_dir_fd(src, srcfd);
+	if (!fallback)
+		return ret;
+#endif
 
-	g_free(destpath);
+	srcfile = mh_get_msg_path(src, srcnum);
+	destfile = mh_get_msg_path(dest, destnum);
+	ret = (srcfile && destfile) ? move_file(srcfile, destfile, FALSE) : -1;
+	g_free(destfile);
+	g_free(srcfile);
 
-	return destfile;
+	return ret;
+}
+
+static gint mh_unlink_msg(FolderItem *item, gint num)
+{
+	gchar *file;
+	gint ret;
+#ifdef USE_AT_FUNCS
+	gchar buf[16];
+	gint dfd;
+
+	if ((dfd = folder_item_get_dir_fd(item)) >= 0) {
+		if ((ret = unlinkat(dfd, utos_buf(buf, num), 0)) < 0)
+			FILE_OP_ERROR(buf, "unlinkat");
+		folder_item_release_dir_fd(item, dfd);
+		return ret;
+	}
+#endif
+
+	file = mh_get_msg_path(item, num);
+	if (!file)
+		return -1;
+	if ((ret = g_unlink(file)) < 0)
+		FILE_OP_ERROR(file, "unlink");
+	g_free(file);
+
+	return ret;
+}
+
+static gint mh_open_msg(FolderItem *item, gint num)
+{
+	gchar *file;
+	gint fd;
+#ifdef USE_AT_FUNCS
+	gchar buf[16];
+	gint dfd;
+
+	if ((dfd = folder_item_get_dir_fd(item)) >= 0) {
+		if ((fd = openat(dfd, utos_buf(buf, num), O_RDONLY)) < 0)
+			FILE_OP_ERROR(buf, "openat");
+		folder_item_release_dir_fd(item, dfd);
+		return fd;
+	}
+#endif
+
+	file = mh_get_msg_path(item, num);
+	if (!file)
+		return -1;
+	if ((fd = g_open(file, O_RDONLY, 0)) < 0)
+		FILE_OP_ERROR(file, "open");
+	g_free(file);
+
+	return fd;
+}
+
+#ifndef G_OS_WIN32
+/* *dfd is set to the directory descriptor of the folder, or -1 if the
+   directory was opened by its path. *dfd must be released with
+   folder_item_release_dir_fd() after closedir() */
+static DIR *mh_opendir(FolderItem *item, gint *dfd)
+{
+	gchar *path;
+	DIR *dp;
+#ifdef USE_AT_FUNCS
+	gint fd;
+
+	if ((*dfd = folder_item_get_dir_fd(item)) >= 0) {
+		/* use a separate open file description, since the directory
+		   offset is shared between duplicated descriptors */
+		if ((fd = openat(*dfd, ".", O_RDONLY)) < 0) {
+			FILE_OP_ERROR(item->path, "openat");
+			dp = NULL;
+		} else if ((dp = fdopendir(fd)) == NULL) {
+			FILE_OP_ERROR(item->path, "fdopendir");
+			close(fd);
+		}
+		if (!dp) {
+			folder_item_release_dir_fd(item, *dfd);
+			*dfd = -1;
+		}
+		return dp;
+	}
+#else
+	*dfd = -1;
+#endif
+
+	path = folder_item_get_path(item);
+	if (!path)
+		return NULL;
+	if ((dp = opendir(path)) == NULL)
+		FILE_OP_ERROR(path, "opendir");
+	g_free(path);
+
+	return dp;
+}
+
+static gboolean mh_dirent_is_regular_file(FolderItem *item, gint dfd,
+					  struct dirent *d)
+{
+	GStatBuf s;
+	gchar *path;
+	gchar *file;
+	gint ret;
+
+#ifdef HAVE_DIRENT_D_TYPE
+	if (d->d_type == DT_REG)
+		return TRUE;
+	else if (d->d_type != DT_UNKNOWN)
+		return FALSE;
+#endif
+
+#ifdef USE_AT_FUNCS
+	if (dfd >= 0)
+		return fstatat(dfd, d->d_name, &s, 0) == 0 &&
+			S_ISREG(s.st_mode);
+#endif
+
+	path = folder_item_get_path(item);
+	file = g_strconcat(path, G_DIR_SEPARATOR_S, d->d_name, NULL);
+	ret = g_stat(file, &s);
+	g_free(file);
+	g_free(path);
+
+	return ret == 0 && S_ISREG(s.st_mode);
+}
+#endif /* G_OS_WIN32 */
+
+static gint mh_get_new_msg_num(FolderItem *dest)
+{
+	gchar *destpath;
+	gint dfd;
+
+	if ((dfd = folder_item_get_dir_fd(dest)) < 0) {
+		destpath = folder_item_get_path(dest);
+		g_return_val_if_fail(destpath != NULL, -1);
+		if (!is_dir_exist(destpath))
+			make_dir_hier(destpath);
+		g_free(destpath);
+	}
+	folder_item_release_dir_fd(dest, dfd);
+
+	while (mh_msg_entry_exist(dest, dest->last_num + 1))
+		dest->last_num++;
+
+	return dest->last_num + 1;
 }
 
 #define SET_DEST_MSG_FLAGS(fp, dest, n, fl)				\
@@ -458,15 +736,139 @@ static gint mh_add_msg(Folder *folder, FolderItem *dest, const gchar *file,
 	return mh_add_msgs(folder, dest, &file_list, remove_source, NULL);
 }
 
+/* Flushes the newly written messages to the disk before they are
+   registered to the cache, so that the cache never refers to a message
+   lost by a crash. Only the written files and the directory are synced;
+   the directory entries of a batch are made persistent by one fsync() */
+static gint mh_sync_msgs(FolderItem *dest, GArray *nums)
+{
+#if defined(HAVE_FSYNC) && !defined(G_OS_WIN32)
+	gchar *path;
+	gint dfd, fd;
+	guint i;
+	gint ret = 0;
+
+	if (!prefs_common.fsync_messages || nums->len == 0)
+		return 0;
+
+	dfd = folder_item_get_dir_fd(dest);
+
+	for (i = 0; i < nums->len; i++) {
+		if ((fd = mh_open_msg(dest, g_array_index(nums, gint, i)))
+		    < 0) {
+			ret = -1;
+			continue;
+		}
+		if (fsync(fd) < 0) {
+			FILE_OP_ERROR(dest->path, "fsync");
+			ret = -1;
+		}
+		close(fd);
+	}
+
+	/* make the new directory entries persistent */
+	if (dfd >= 0) {
+		if (fsync(dfd) < 0) {
+			FILE_OP_ERROR(dest->path, "fsync");
+			ret = -1;
+		}
+		folder_item_release_dir_fd(dest, dfd);
+	} else {
+		path = folder_item_get_path(dest);
+		if (path && (fd = g_open(path, O_RDONLY, 0)) >= 0) {
+			if (fsync(fd) < 0) {
+				FILE_OP_ERROR(path, "fsync");
+				ret = -1;
+			}
+			close(fd);
+		}
+		g_free(path);
+	}
+
+	return ret;
+#else
+	return 0;
+#endif
+}
+
+/* registers the messages written by mh_add_msgs() and
+   mh_add_msgs_msginfo() to the folder once they are on the disk */
+static gint mh_add_msgs_commit(FolderItem *dest, GArray *nums,
+			       GPtrArray *msgs)
+{
+	MsgInfo *msginfo;
+	gchar *destfile;
+	FILE *fp = NULL;
+	gint num;
+	guint i;
+
+	if (nums->len == 0)
+		return 0;
+
+	if (mh_sync_msgs(dest, nums) < 0) {
+		/* remove them, since they may not survive a crash */
+		g_warning("mh_add_msgs: failed to sync messages in %s",
+			  dest->path);
+		for (i = 0; i < nums->len; i++)
+			mh_unlink_msg(dest, g_array_index(nums, gint, i));
+		return -1;
+	}
+
+	if (!dest->opened) {
+		if ((fp = procmsg_open_mark_file(dest, DATA_APPEND)) == NULL)
+			g_warning("mh_add_msgs: can't open mark file.");
+	}
+
+	for (i = 0; i < nums->len; i++) {
+		num = g_array_index(nums, gint, i);
+		msginfo = (MsgInfo *)g_ptr_array_index(msgs, i);
+
+		if (syl_app_get()) {
+			destfile = mh_get_msg_path(dest, num);
+			g_signal_emit_by_name(syl_app_get(), "add-msg", dest, destfile, num);
+			g_free(destfile);
+		}
+
+		dest->total++;
+		dest->updated = TRUE;
+		dest->mtime = 0;
+
+		if (MSG_IS_RECEIVED(msginfo->flags)) {
+			/* resets new flags of existing messages on
+			   received mode */
+			if (dest->unmarked_num == 0)
+				dest->new = 0;
+			dest->unmarked_num++;
+			procmsg_add_mark_queue(dest, num, msginfo->flags);
+		} else {
+			SET_DEST_MSG_FLAGS(fp, dest, num, msginfo->flags);
+		}
+		procmsg_add_cache_queue(dest, num, msginfo);
+		if (MSG_IS_NEW(msginfo->flags))
+			dest->new++;
+		if (MSG_IS_UNREAD(msginfo->flags))
+			dest->unread++;
+	}
+
+	if (fp)
+		fclose(fp);
+
+	return 0;
+}
+
 static gint mh_add_msgs(Folder *folder, FolderItem *dest, GSList *file_list,
 			gboolean remove_source, gint *first)
 {
-	gchar *destfile;
 	GSList *cur;
 	MsgFileInfo *fileinfo;
 	MsgInfo *msginfo;
+	GArray *nums;
+	GPtrArray *msgs;
+	gint destnum;
+	gint last_num;
 	gint first_ = 0;
-	FILE *fp = NULL;
+	gboolean err = FALSE;
+	guint i;
 
 	g_return_val_if_fail(dest != NULL, -1);
 	g_return_val_if_fail(file_list != NULL, -1);
@@ -478,11 +880,12 @@ static gint mh_add_msgs(Folder *folder, FolderItem *dest, GSList *file_list,
 
 	S_LOCK(mh);
 
-	if (!dest->opened) {
-		if ((fp = procmsg_open_mark_file(dest, DATA_APPEND)) == NULL)
-			g_warning("mh_add_msgs: can't open mark file.");
-	}
+	nums = g_array_new(FALSE, FALSE, sizeof(gint));
+	msgs = g_ptr_array_new();
+	last_num = dest->last_num;
 
+	/* write all the messages first, and register them after they are
+	   synced as a group */
 	for (cur = file_list; cur != NULL; cur = cur->next) {
 		MsgFlags flags = {MSG_NEW|MSG_UNREAD, 0};
 
@@ -491,58 +894,39 @@ static gint mh_add_msgs(Folder *folder, FolderItem *dest, GSList *file_list,
 			flags = *fileinfo->flags;
 		msginfo = procheader_parse_file(fileinfo->file, flags, 0);
 		if (!msginfo) {
-			if (fp) fclose(fp);
-			S_UNLOCK(mh);
-			return -1;
+			err = TRUE;
+			break;
 		}
 
-		destfile = mh_get_new_msg_filename(dest);
-		if (destfile == NULL) {
-			S_UNLOCK(mh);
-			return -1;
-		}
-		if (first_ == 0 || first_ > dest->last_num + 1)
-			first_ = dest->last_num + 1;
-
-		if (syl_link(fileinfo->file, destfile) < 0) {
-			if (copy_file(fileinfo->file, destfile, TRUE) < 0) {
-				g_warning(_("can't copy message %s to %s\n"),
-					  fileinfo->file, destfile);
-				g_free(destfile);
-				if (fp) fclose(fp);
-				S_UNLOCK(mh);
-				return -1;
-			}
+		destnum = mh_get_new_msg_num(dest);
+		if (destnum < 0 ||
+		    mh_link_msg(fileinfo->file, dest, destnum) < 0) {
+			procmsg_msginfo_free(msginfo);
+			err = TRUE;
+			break;
 		}
+		if (first_ == 0 || first_ > destnum)
+			first_ = destnum;
+		dest->last_num = destnum;
 
-		if (syl_app_get())
-			g_signal_emit_by_name(syl_app_get(), "add-msg", dest, destfile, dest->last_num + 1);
-
-		g_free(destfile);
-		dest->last_num++;
-		dest->total++;
-		dest->updated = TRUE;
-		dest->mtime = 0;
+		g_array_append_val(nums, destnum);
+		g_ptr_array_add(msgs, msginfo);
+	}
 
-		if (MSG_IS_RECEIVED(flags)) {
-			/* resets new flags of existing messages on
-			   received mode */
-			if (dest->unmarked_num == 0)
-				dest->new = 0;
-			dest->unmarked_num++;
-			procmsg_add_mark_queue(dest, dest->last_num, flags);
-		} else {
-			SET_DEST_MSG_FLAGS(fp, dest, dest->last_num, flags);
-		}
-		procmsg_add_cache_queue(dest, dest->last_num, msginfo);
-		if (MSG_IS_NEW(flags))
-			dest->new++;
-		if (MSG_IS_UNREAD(flags))
-			dest->unread++;
+	if (mh_add_msgs_commit(dest, nums, msgs) < 0) {
+		dest->last_num = last_num;
+		err = TRUE;
 	}
 
-	if (fp)
-		fclose(fp);
+	for (i = 0; i < msgs->len; i++)
+		procmsg_msginfo_free((MsgInfo *)g_ptr_array_index(msgs, i));
+	g_ptr_array_free(msgs, TRUE);
+	g_array_free(nums, TRUE);
+
+	if (err) {
+		S_UNLOCK(mh);
+		return -1;
+	}
 
 	if (first)
 		*first = first_;
@@ -580,9 +964,12 @@ static gint mh_add_msgs_msginfo(Folder *folder, FolderItem *dest,
 	GSList *cur;
 	MsgInfo *msginfo;
 	gchar *srcfile;
-	gchar *destfile;
+	GArray *nums;
+	GPtrArray *msgs;
+	gint destnum;
+	gint last_num;
 	gint first_ = 0;
-	FILE *fp = NULL;
+	gboolean err = FALSE;
 
 	g_return_val_if_fail(dest != NULL, -1);
 	g_return_val_if_fail(msglist != NULL, -1);
@@ -594,72 +981,45 @@ static gint mh_add_msgs_msginfo(Folder *folder, FolderItem *dest,
 
 	S_LOCK(mh);
 
-	if (!dest->opened) {
-		if ((fp = procmsg_open_mark_file(dest, DATA_APPEND)) == NULL)
-			g_warning("mh_add_msgs_msginfo: can't open mark file.");
-	}
+	nums = g_array_new(FALSE, FALSE, sizeof(gint));
+	msgs = g_ptr_array_new();
+	last_num = dest->last_num;
 
 	for (cur = msglist; cur != NULL; cur = cur->next) {
 		msginfo = (MsgInfo *)cur->data;
 
-		destfile = mh_get_new_msg_filename(dest);
-		if (!destfile) {
-			if (fp) fclose(fp);
-			S_UNLOCK(mh);
-			return -1;
-		}
-		if (first_ == 0 || first_ > dest->last_num + 1)
-			first_ = dest->last_num + 1;
-
 		srcfile = procmsg_get_message_file(msginfo);
 		if (!srcfile) {
-			if (fp) fclose(fp);
-			g_free(destfile);
-			S_UNLOCK(mh);
-			return -1;
+			err = TRUE;
+			break;
 		}
-		if (syl_link(srcfile, destfile) < 0) {
-			if (copy_file(srcfile, destfile, TRUE) < 0) {
-				g_warning("mh_add_msgs_msginfo: can't copy message %s to %s", srcfile, destfile);
-				g_free(srcfile);
-				g_free(destfile);
-				if (fp) fclose(fp);
-				S_UNLOCK(mh);
-				return -1;
-			}
+		destnum = mh_get_new_msg_num(dest);
+		if (destnum < 0 || mh_link_msg(srcfile, dest, destnum) < 0) {
+			g_free(srcfile);
+			err = TRUE;
+			break;
 		}
-
-		if (syl_app_get())
-			g_signal_emit_by_name(syl_app_get(), "add-msg", dest, destfile, dest->last_num + 1);
-
 		g_free(srcfile);
-		g_free(destfile);
-		dest->last_num++;
-		dest->total++;
-		dest->updated = TRUE;
-		dest->mtime = 0;
+		if (first_ == 0 || first_ > destnum)
+			first_ = destnum;
+		dest->last_num = destnum;
 
-		if (MSG_IS_RECEIVED(msginfo->flags)) {
-			/* resets new flags of existing messages on
-			   received mode */
-			if (dest->unmarked_num == 0)
-				dest->new = 0;
-			dest->unmarked_num++;
-			procmsg_add_mark_queue(dest, dest->last_num,
-					       msginfo->flags);
-		} else {
-			SET_DEST_MSG_FLAGS(fp, dest, dest->last_num,
-					   msginfo->flags);
-		}
-		procmsg_add_cache_queue(dest, dest->last_num, msginfo);
-		if (MSG_IS_NEW(msginfo->flags))
-			dest->new++;
-		if (MSG_IS_UNREAD(msginfo->flags))
-			dest->unread++;
+		g_array_append_val(nums, destnum);
+		g_ptr_array_add(msgs, msginfo);
 	}
 
-	if (fp)
-		fclose(fp);
+	if (mh_add_msgs_commit(dest, nums, msgs) < 0) {
+		dest->last_num = last_num;
+		err = TRUE;
+	}
+
+	g_ptr_array_free(msgs, TRUE);
+	g_array_free(nums, TRUE);
+
+	if (err) {
+		S_UNLOCK(mh);
+		return -1;
+	}
 
 	if (first)
 		*first = first_;
@@ -686,6 +1046,7 @@ static gint mh_do_move_msgs(Folder *folder, FolderItem *dest, GSList *msglist)
 	gchar *destfile;
 	GSList *cur;
 	MsgInfo *msginfo;
+	gint destnum;
 
 	g_return_val_if_fail(dest != NULL, -1);
 	g_return_val_if_fail(msglist != NULL, -1);
@@ -708,25 +1069,23 @@ static gint mh_do_move_msgs(Folder *folder, FolderItem *dest, GSList *msglist)
 		debug_print("Moving message %s/%d to %s ...\n",
 			    src->path, msginfo->msgnum, dest->path);
 
-		destfile = mh_get_new_msg_filename(dest);
-		if (!destfile) break;
-		srcfile = procmsg_get_message_file(msginfo);
+		destnum = mh_get_new_msg_num(dest);
+		if (destnum < 0) break;
 
 		/* g_signal_emit_by_name(syl_app_get(), "remove-msg", src, srcfile, msginfo->msgnum); */
 
-		if (move_file(srcfile, destfile, FALSE) < 0) {
-			g_free(srcfile);
-			g_free(destfile);
+		if (mh_rename_msg(src, msginfo->msgnum, dest, destnum) < 0)
 			break;
-		}
 
 		if (syl_app_get()) {
-			g_signal_emit_by_name(syl_app_get(), "add-msg", dest, destfile, dest->last_num + 1);
+			srcfile = mh_get_msg_path(src, msginfo->msgnum);
+			destfile = mh_get_msg_path(dest, destnum);
+			g_signal_emit_by_name(syl_app_get(), "add-msg", dest, destfile, destnum);
 			g_signal_emit_by_name(syl_app_get(), "remove-msg", src, srcfile, msginfo->msgnum);
+			g_free(destfile);
+			g_free(srcfile);
 		}
 
-		g_free(srcfile);
-		g_free(destfile);
 		src->total--;
 		src->updated = TRUE;
 		src->mtime = 0;
@@ -807,6 +1166,7 @@ static gint mh_copy_msgs(Folder *folder, FolderItem *dest, GSList *msglist)
 	gchar *destfile;
 	GSList *cur;
 	MsgInfo *msginfo;
+	gint destnum;
 
 	g_return_val_if_fail(dest != NULL, -1);
 	g_return_val_if_fail(msglist != NULL, -1);
@@ -828,8 +1188,9 @@ static gint mh_copy_msgs(Folder *folder, FolderItem *dest, GSList *msglist)
 		debug_print(_("Copying message %s/%d to %s ...\n"),
 			    msginfo->folder->path, msginfo->msgnum, dest->path);
 
-		destfile = mh_get_new_msg_filename(dest);
-		if (!destfile) break;
+		destnum = mh_get_new_msg_num(dest);
+		if (destnum < 0) break;
+		destfile = mh_get_msg_path(dest, destnum);
 		srcfile = procmsg_get_message_file(msginfo);
 
 		if (copy_file(srcfile, destfile, TRUE) < 0) {
@@ -840,7 +1201,7 @@ static gint mh_copy_msgs(Folder *folder, FolderItem *dest, GSList *msglist)
 		}
 
 		if (syl_app_get())
-			g_signal_emit_by_name(syl_app_get(), "add-msg", dest, destfile, dest->last_num + 1);
+			g_signal_emit_by_name(syl_app_get(), "add-msg", dest, destfile, destnum);
 
 		g_free(srcfile);
 		g_free(destfile);
@@ -878,16 +1239,14 @@ static gint mh_remove_msg(Folder *folder, FolderItem *item, MsgInfo *msginfo)
 
 	if (syl_app_get())
 		g_signal_emit_by_name(syl_app_get(), "remove-msg", item, file, msginfo->msgnum);
+	g_free(file);
 
 	S_LOCK(mh);
 
-	if (g_unlink(file) < 0) {
-		FILE_OP_ERROR(file, "unlink");
-		g_free(file);
+	if (mh_unlink_msg(item, msginfo->msgnum) < 0) {
 		S_UNLOCK(mh);
 		return -1;
 	}
-	g_free(file);
 
 	item->total--;
 	item->updated = TRUE;
@@ -938,9 +1297,8 @@ static gboolean mh_is_msg_changed(Folder *folder, FolderItem *item,
 				  MsgInfo *msginfo)
 {
 	GStatBuf s;
-	gchar buf[16];
 
-	if (g_stat(utos_buf(buf, msginfo->msgnum), &s) < 0 ||
+	if (mh_stat_msg(item, msginfo->msgnum, &s) < 0 ||
 	    msginfo->size  != s.st_size ||
 	    msginfo->mtime != s.st_mtime)
 		return TRUE;
@@ -1041,14 +1399,17 @@ static BOOL find_next_file(HANDLE hfind, struct wfddata *wfd)
 static gint mh_scan_folder_full(Folder *folder, FolderItem *item,
 				gboolean count_sum)
 {
-	gchar *path;
 #ifdef G_OS_WIN32
+	gchar *path;
 	struct wfddata wfd;
 	HANDLE hfind;
 #else
 	DIR *dp;
 	struct dirent *d;
+	gint dfd;
 #endif
+	GStatBuf s;
+	gchar *dir;
 	gint max = 0;
 	gint num;
 	gint n_msg = 0;
@@ -1057,30 +1418,31 @@ static gint mh_scan_folder_full(Folder *folder, FolderItem *item,
 
 	debug_print("mh_scan_folder(): Scanning %s ...\n", item->path);
 
-	S_LOCK(mh);
+	/* reopen the directory in case it was replaced behind us */
+	folder_item_close_dir_fd(item);
 
+	/* take the snapshot before reading, so that a change during the
+	   scan is caught by the next one */
+	item->dir_mtime = 0;
+	dir = folder_item_get_path(item);
+	if (!dir || g_stat(dir, &s) < 0)
+		s.st_mtime = 0;
+	g_free(dir);
+
+#ifdef G_OS_WIN32
 	path = folder_item_get_path(item);
-	if (!path) {
-		S_UNLOCK(mh);
-		return -1;
-	}
-	if (change_dir(path) < 0) {
-		g_free(path);
-		S_UNLOCK(mh);
+	if (!path)
 		return -1;
-	}
+	hfind = find_first_file(path, &wfd);
 	g_free(path);
-
-#ifdef G_OS_WIN32
-	if ((hfind = find_first_file(NULL, &wfd)) == INVALID_HANDLE_VALUE) {
+	if (hfind == INVALID_HANDLE_VALUE) {
 		g_warning("failed to open directory\n");
-#else
-	if ((dp = opendir(".")) == NULL) {
-		FILE_OP_ERROR(item->path, "opendir");
-#endif
-		S_UNLOCK(mh);
 		return -1;
 	}
+#else
+	if ((dp = mh_opendir(item, &dfd)) == NULL)
+		return -1;
+#endif
 
 	if (folder->ui_func)
 		folder->ui_func(folder, item, folder->ui_func_data);
@@ -1108,7 +1470,7 @@ static gint mh_scan_folder_full(Folder *folder, FolderItem *item,
 #else
 	while ((d = readdir(dp)) != NULL) {
 		if ((num = to_number(d->d_name)) > 0 &&
-		    dirent_is_regular_file(d)) {
+		    mh_dirent_is_regular_file(item, dfd, d)) {
 			n_msg++;
 			if (max < num)
 				max = num;
@@ -1116,6 +1478,7 @@ static gint mh_scan_folder_full(Folder *folder, FolderItem *item,
 	}
 
 	closedir(dp);
+	folder_item_release_dir_fd(item, dfd);
 #endif
 
 	if (n_msg == 0)
@@ -1147,12 +1510,25 @@ static gint mh_scan_folder_full(Folder *folder, FolderItem *item,
 	debug_print("Last number in dir %s = %d\n", item->path, max);
 	item->last_num = max;
 
-	S_UNLOCK(mh);
+	/* a directory modified in the current second may still change
+	   without updating its mtime */
+	if (s.st_mtime != 0 && s.st_mtime < time(NULL)) {
+		item->dir_mtime = s.st_mtime;
+		item->dir_ino = s.st_ino;
+		item->dir_size = s.st_size;
+	}
+
 	return 0;
 }
 
 static gint mh_scan_folder(Folder *folder, FolderItem *item)
 {
+	if (mh_is_dir_unchanged(item)) {
+		debug_print("mh_scan_folder(): %s is not modified.\n",
+			    item->path);
+		return 0;
+	}
+
 	return mh_scan_folder_full(folder, item, TRUE);
 }
 
@@ -1163,8 +1539,6 @@ static gint mh_scan_tree(Folder *folder)
 
 	g_return_val_if_fail(folder != NULL, -1);
 
-	S_LOCK(mh);
-
 	if (!folder->node) {
 		item = folder_item_new(folder->name, NULL);
 		item->folder = folder;
@@ -1173,9 +1547,9 @@ static gint mh_scan_tree(Folder *folder)
 		item = FOLDER_ITEM(folder->node->data);
 
 	rootpath = folder_item_get_path(item);
-	if (change_dir(rootpath) < 0) {
+	if (!is_dir_exist(rootpath)) {
+		g_warning("mh_scan_tree(): %s not found\n", rootpath);
 		g_free(rootpath);
-		S_UNLOCK(mh);
 		return -1;
 	}
 	g_free(rootpath);
@@ -1184,59 +1558,55 @@ static gint mh_scan_tree(Folder *folder)
 	mh_remove_missing_folder_items(folder);
 	mh_scan_tree_recursive(item);
 
-	S_UNLOCK(mh);
 	return 0;
 }
 
-#define MAKE_DIR_IF_NOT_EXIST(dir) \
-{ \
-	if (!is_dir_exist(dir)) { \
-		if (is_file_exist(dir)) { \
-			g_warning(_("File `%s' already exists.\n" \
-				    "Can't create folder."), dir); \
-			return -1; \
-		} \
-		if (make_dir(dir) < 0) \
-			return -1; \
-	} \
-}
-
-#define MAKE_DIR_HIER_IF_NOT_EXIST(dir) \
-{ \
-	if (!is_dir_exist(dir)) { \
-		if (is_file_exist(dir)) { \
-			g_warning(_("File `%s' already exists.\n" \
-				    "Can't create folder."), dir); \
-			return -1; \
-		} \
-		if (make_dir_hier(dir) < 0) \
-			return -1; \
-	} \
+static gint mh_make_dir_if_not_exist(const gchar *dir, gboolean hier)
+{
+	if (!is_dir_exist(dir)) {
+		if (is_file_exist(dir)) {
+			g_warning(_("File `%s' already exists.\n"
+				    "Can't create folder."), dir);
+			return -1;
+		}
+		if ((hier ? make_dir_hier(dir) : make_dir(dir)) < 0)
+			return -1;
+	}
+
+	return 0;
 }
 
 static gint mh_create_tree(Folder *folder)
 {
+	static const gchar *dirs[] = {INBOX_DIR, OUTBOX_DIR, QUEUE_DIR,
+				      DRAFT_DIR, TRASH_DIR, JUNK_DIR};
 	gchar *rootpath;
+	gchar *path;
+	gint i;
 
 	g_return_val_if_fail(folder != NULL, -1);
 
-	CHDIR_RETURN_VAL_IF_FAIL(get_mail_base_dir(), -1);
-	rootpath = LOCAL_FOLDER(folder)->rootpath;
-	MAKE_DIR_HIER_IF_NOT_EXIST(rootpath);
-	CHDIR_RETURN_VAL_IF_FAIL(rootpath, -1);
-	MAKE_DIR_IF_NOT_EXIST(INBOX_DIR);
-	MAKE_DIR_IF_NOT_EXIST(OUTBOX_DIR);
-	MAKE_DIR_IF_NOT_EXIST(QUEUE_DIR);
-	MAKE_DIR_IF_NOT_EXIST(DRAFT_DIR);
-	MAKE_DIR_IF_NOT_EXIST(TRASH_DIR);
-	MAKE_DIR_IF_NOT_EXIST(JUNK_DIR);
+	rootpath = folder_get_path(folder);
+	g_return_val_if_fail(rootpath != NULL, -1);
+	if (mh_make_dir_if_not_exist(rootpath, TRUE) < 0) {
+		g_free(rootpath);
+		return -1;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(dirs); i++) {
+		path = g_strconcat(rootpath, G_DIR_SEPARATOR_S, dirs[i], NULL);
+		if (mh_make_dir_if_not_exist(path, FALSE) < 0) {
+			g_free(path);
+			g_free(rootpath);
+			return -1;
+		}
+		g_free(path);
+	}
 
+	g_free(rootpath);
 	return 0;
 }
 
-#undef MAKE_DIR_IF_NOT_EXIST
-#undef MAKE_DIR_HIER_IF_NOT_EXIST
-
 static FolderItem *mh_create_folder(Folder *folder, FolderItem *parent,
 				    const gchar *name)
 {
@@ -1282,7 +1652,6 @@ static FolderItem *mh_create_folder(Folder *folder, FolderItem *parent,
 static gint mh_move_folder_real(Folder *folder, FolderItem *item,
 				FolderItem *new_parent, const gchar *name)
 {
-	gchar *rootpath;
 	gchar *oldpath;
 	gchar *newpath;
 	gchar *dirname;
@@ -1346,17 +1715,6 @@ static gint mh_move_folder_real(Folder *folder, FolderItem *item,
 		return -1;
 	}
 
-	rootpath = folder_get_path(folder);
-	if (change_dir(rootpath) < 0) {
-		g_free(rootpath);
-		g_free(oldpath);
-		g_free(newpath);
-		g_free(utf8_name);
-		S_UNLOCK(mh);
-		return -1;
-	}
-	g_free(rootpath);
-
 	debug_print("mh_move_folder: rename(%s, %s)\n", oldpath, newpath);
 
 	if (g_rename(oldpath, newpath) < 0) {
@@ -1473,16 +1831,122 @@ static time_t mh_get_mtime(FolderItem *item)
 	}
 }
 
+static gboolean mh_is_dir_unchanged(FolderItem *item)
+{
+	gchar *path;
+	GStatBuf s;
+	gint ret;
+
+	if (item->dir_mtime == 0 || item->last_num < 0)
+		return FALSE;
+
+	path = folder_item_get_path(item);
+	if (!path)
+		return FALSE;
+	ret = g_stat(path, &s);
+	g_free(path);
+
+	if (ret == 0 &&
+	    s.st_mtime == item->dir_mtime &&
+	    (gint64)s.st_ino == item->dir_ino &&
+	    (gint64)s.st_size == item->dir_size)
+		return TRUE;
+
+	item->dir_mtime = 0;
+	return FALSE;
+}
+
+#if USE_THREADS
+/* uncached messages are parsed in parallel if there are at least this
+   number of them */
+#define MH_PARSE_THREAD_MIN_MSGS	64
+#define MH_PARSE_THREAD_MAX		8
+
+typedef struct _MHParseData
+{
+	FolderItem *item;
+	const gint *nums;
+	MsgInfo **msgs;
+	gint done;
+} MHParseData;
+
+static gint mh_get_parse_threads(void)
+{
+	glong n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return CLAMP(n, 1, MH_PARSE_THREAD_MAX);
+}
+
+static void mh_parse_msg_func(gpointer task, gpointer user_data)
+{
+	MHParseData *data = (MHParseData *)user_data;
+	guint i = GPOINTER_TO_UINT(task) - 1;
+
+	data->msgs[i] = mh_parse_msg(data->item, data->nums[i]);
+
+	g_atomic_int_inc(&data->done);
+	g_main_context_wakeup(NULL);
+}
+
+static gboolean mh_parse_msgs_parallel(FolderItem *item, const gint *nums,
+				       guint n_msgs, MsgInfo **msgs)
+{
+	Folder *folder = item->folder;
+	MHParseData data = {item, nums, msgs, 0};
+	GThreadPool *pool;
+	gint n_threads;
+	gint done, prev_done = 0;
+	guint i;
+
+	n_threads = mh_get_parse_threads();
+	if (n_threads < 2 || !g_thread_supported())
+		return FALSE;
+
+	pool = g_thread_pool_new(mh_parse_msg_func, &data, n_threads, FALSE,
+				 NULL);
+	if (!pool)
+		return FALSE;
+
+	debug_print("Parsing %u messages with %d threads...\n",
+		    n_msgs, n_threads);
+
+	for (i = 0; i < n_msgs; i++)
+		g_thread_pool_push(pool, GUINT_TO_POINTER(i + 1), NULL);
+
+	while ((done = g_atomic_int_get(&data.done)) < n_msgs) {
+		if (done != prev_done && folder->ui_func)
+			folder->ui_func(folder, item, folder->ui_func_data ? folder->ui_func_data : GINT_TO_POINTER(done));
+		prev_done = done;
+		event_loop_iterate();
+	}
+
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	return TRUE;
+}
+#endif /* USE_THREADS */
+
+static gint mh_cmp_num(gconstpointer a, gconstpointer b)
+{
+	return *(const gint *)a - *(const gint *)b;
+}
+
 static GSList *mh_get_uncached_msgs(GHashTable *msg_table, FolderItem *item)
 {
 	gchar *path;
 	GDir *dp;
 	const gchar *dir_name;
 	GSList *newlist = NULL;
-	GSList *last = NULL;
+	GArray *nums;
+	MsgInfo **msgs;
 	MsgInfo *msginfo;
 	gint n_newmsg = 0;
 	gint num;
+	guint i;
+	gboolean parsed = FALSE;
 	Folder *folder;
 
 	g_return_val_if_fail(item != NULL, NULL);
@@ -1492,94 +1956,90 @@ static GSList *mh_get_uncached_msgs(GHashTable *msg_table, FolderItem *item)
 
 	path = folder_item_get_path(item);
 	g_return_val_if_fail(path != NULL, NULL);
-	if (change_dir(path) < 0) {
-		g_free(path);
-		return NULL;
-	}
-	g_free(path);
 
-	if ((dp = g_dir_open(".", 0, NULL)) == NULL) {
-		FILE_OP_ERROR(item->path, "opendir");
+	if ((dp = g_dir_open(path, 0, NULL)) == NULL) {
+		FILE_OP_ERROR(path, "opendir");
+		g_free(path);
 		return NULL;
 	}
 
 	debug_print("Searching uncached messages...\n");
 
-	if (msg_table) {
-		gint count = 0;
+	nums = g_array_new(FALSE, FALSE, sizeof(gint));
 
-		while ((dir_name = g_dir_read_name(dp)) != NULL) {
-			if ((num = to_number(dir_name)) <= 0) continue;
+	while ((dir_name = g_dir_read_name(dp)) != NULL) {
+		if ((num = to_number(dir_name)) <= 0) continue;
 
+		if (msg_table) {
 			msginfo = g_hash_table_lookup
 				(msg_table, GUINT_TO_POINTER(num));
-
 			if (msginfo) {
 				MSG_SET_TMP_FLAGS(msginfo->flags, MSG_CACHED);
-			} else {
-				/* not found in the cache (uncached message) */
-				msginfo = mh_parse_msg(dir_name, item);
-				if (!msginfo) continue;
-
-				if (!newlist)
-					last = newlist =
-						g_slist_append(NULL, msginfo);
-				else {
-					last = g_slist_append(last, msginfo);
-					last = last->next;
-				}
-				n_newmsg++;
-			}
-
-			count++;
-			if (folder->ui_func)
-				folder->ui_func(folder, item, folder->ui_func_data ? folder->ui_func_data : GINT_TO_POINTER(count));
-		}
-	} else {
-		/* discard all previous cache */
-		while ((dir_name = g_dir_read_name(dp)) != NULL) {
-			if (to_number(dir_name) <= 0) continue;
-
-			msginfo = mh_parse_msg(dir_name, item);
-			if (!msginfo) continue;
-
-			if (!newlist)
-				last = newlist = g_slist_append(NULL, msginfo);
-			else {
-				last = g_slist_append(last, msginfo);
-				last = last->next;
+				continue;
 			}
-			n_newmsg++;
-			if (folder->ui_func)
-				folder->ui_func(folder, item, folder->ui_func_data ? folder->ui_func_data : GINT_TO_POINTER(n_newmsg));
 		}
+
+		/* not found in the cache (uncached message) */
+		g_array_append_val(nums, num);
 	}
 
 	g_dir_close(dp);
 
+	/* parse in numerical order, so the result needs no sorting */
+	g_array_sort(nums, mh_cmp_num);
+	msgs = g_new0(MsgInfo *, nums->len);
+
+#if USE_THREADS
+	if (nums->len >= MH_PARSE_THREAD_MIN_MSGS)
+		parsed = mh_parse_msgs_parallel(item, (gint *)nums->data,
+						nums->len, msgs);
+#endif
+	for (i = 0; !parsed && i < nums->len; i++) {
+		num = g_array_index(nums, gint, i);
+		msgs[i] = mh_parse_msg(item, num);
+
+		if (folder->ui_func)
+			folder->ui_func(folder, item, folder->ui_func_data ? folder->ui_func_data : GINT_TO_POINTER(i + 1));
+	}
+
+	/* merge the results. the string table is not thread-safe, so
+	   they are interned here */
+	for (i = nums->len; i > 0; i--) {
+		msginfo = msgs[i - 1];
+		if (!msginfo) continue;
+
+		procmsg_msginfo_intern(msginfo);
+		newlist = g_slist_prepend(newlist, msginfo);
+		n_newmsg++;
+	}
+
+	g_free(msgs);
+	g_array_free(nums, TRUE);
+	g_free(path);
+
 	if (n_newmsg)
 		debug_print("%d uncached message(s) found.\n", n_newmsg);
 	else
 		debug_print("done.\n");
 
-	/* sort new messages in numerical order */
-	if (newlist && item->sort_key == SORT_BY_NONE) {
-		debug_print("Sorting uncached messages in numerical order...\n");
-		newlist = g_slist_sort
-			(newlist, (GCompareFunc)procmsg_cmp_msgnum_for_sort);
-		debug_print("done.\n");
-	}
-
 	return newlist;
 }
 
-static MsgInfo *mh_parse_msg(const gchar *file, FolderItem *item)
+/* this may be called from the parser threads, so the result is not
+   interned */
+static MsgInfo *mh_parse_msg(FolderItem *item, gint num)
 {
 	MsgInfo *msginfo;
 	MsgFlags flags;
+	gchar *file;
+#ifdef USE_AT_FUNCS
+	struct stat s;
+	gchar buf[16];
+	gint dfd, fd;
+	FILE *fp;
+#endif
 
 	g_return_val_if_fail(item != NULL, NULL);
-	g_return_val_if_fail(file != NULL, NULL);
 
 	flags.perm_flags = MSG_NEW|MSG_UNREAD;
 	flags.tmp_flags = 0;
@@ -1590,10 +2050,33 @@ static MsgInfo *mh_parse_msg(const gchar *file, FolderItem *item)
 		MSG_SET_TMP_FLAGS(flags, MSG_DRAFT);
 	}
 
-	msginfo = procheader_parse_file(file, flags, FALSE);
-	if (!msginfo) return NULL;
+#ifdef USE_AT_FUNCS
+	if ((dfd = folder_item_get_dir_fd(item)) >= 0) {
+		folder_item_release_dir_fd(item, dfd);
+		if ((fd = mh_open_msg(item, num)) < 0)
+			return NULL;
+		if (fstat(fd, &s) < 0 || !S_ISREG(s.st_mode) ||
+		    (fp = fdopen(fd, "rb")) == NULL) {
+			close(fd);
+			return NULL;
+		}
+		msginfo = procheader_parse_stream(fp, flags, FALSE);
+		fclose(fp);
+		if (!msginfo) return NULL;
+
+		msginfo->size = s.st_size;
+		msginfo->mtime = s.st_mtime;
+	} else
+#endif
+	{
+		file = mh_get_msg_path(item, num);
+		g_return_val_if_fail(file != NULL, NULL);
+		msginfo = procheader_parse_file(file, flags, FALSE);
+		g_free(file);
+		if (!msginfo) return NULL;
+	}
 
-	msginfo->msgnum = atoi(file);
+	msginfo->msgnum = num;
 	msginfo->folder = item;
 
 	return msginfo;
@@ -1703,11 +2186,8 @@ static void mh_scan_tree_recursive(FolderItem *item)
 	if (folder->ui_func)
 		folder->ui_func(folder, item, folder->ui_func_data);
 
-	fs_path = item->path ?
-		g_filename_from_utf8(item->path, -1, NULL, NULL, NULL)
-		: g_strdup(".");
-	if (!fs_path)
-		fs_path = g_strdup(item->path);
+	fs_path = folder_item_get_path(item);
+	g_return_if_fail(fs_path != NULL);
 #ifdef G_OS_WIN32
 	hfind = find_first_file(fs_path, &wfd);
 	if (hfind == INVALID_HANDLE_VALUE) {
@@ -1723,7 +2203,6 @@ static void mh_scan_tree_recursive(FolderItem *item)
 		return;
 	}
 #endif
-	g_free(fs_path);
 
 #ifdef G_OS_WIN32
 	do {
@@ -1750,12 +2229,8 @@ static void mh_scan_tree_recursive(FolderItem *item)
 						NULL);
 		} else
 			utf8entry = g_strdup(utf8name);
-		entry = g_filename_from_utf8(utf8entry, -1, NULL, NULL, NULL);
-		if (!entry)
-			entry = g_strdup(utf8entry);
-#ifdef G_OS_WIN32
-		subst_char(entry, '/', G_DIR_SEPARATOR);
-#endif
+		entry = g_strconcat(fs_path, G_DIR_SEPARATOR_S, dir_name,
+				    NULL);
 
 		if (
 #ifdef G_OS_WIN32
@@ -1851,6 +2326,7 @@ static void mh_scan_tree_recursive(FolderItem *item)
 #else
 	closedir(dp);
 #endif
+	g_free(fs_path);
 
 	if (item->path) {
 		gint new, unread, total, min, max;
@@ -1896,3 +2372,385 @@ static gboolean mh_rename_folder_func(GNode *node, gpointer data)
 
 	return FALSE;
 }
+
+#ifdef USE_INOTIFY
+
+/* a message being written is not complete until IN_CLOSE_WRITE (or
+   IN_MOVED_TO if it is renamed into place). IN_CREATE is needed for the
+   messages delivered with link(), which don't generate other events */
+#define MH_WATCH_MASK	(IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | \
+			 IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | \
+			 IN_MOVE_SELF | IN_DONT_FOLLOW | IN_ONLYDIR)
+
+/* events are collected for this period before they are processed */
+#define MH_WATCH_DELAY	500
+
+typedef struct _MHWatchItem
+{
+	gchar *id;
+	GHashTable *added;
+	gboolean need_scan;
+} MHWatchItem;
+
+static gint watch_fd = -1;
+static GIOChannel *watch_ch = NULL;
+static guint watch_io_tag = 0;
+static guint watch_timeout_tag = 0;
+static gulong watch_folderlist_handler = 0;
+
+/* watch descriptor -> folder identifier */
+static GHashTable *watch_table = NULL;
+/* folder identifier -> MHWatchItem */
+static GHashTable *watch_pending = NULL;
+
+static void mh_watch_item_free(gpointer data)
+{
+	MHWatchItem *witem = (MHWatchItem *)data;
+
+	g_free(witem->id);
+	g_hash_table_destroy(witem->added);
+	g_free(witem);
+}
+
+static MHWatchItem *mh_watch_get_pending(const gchar *id)
+{
+	MHWatchItem *witem;
+
+	witem = g_hash_table_lookup(watch_pending, id);
+	if (!witem) {
+		witem = g_new0(MHWatchItem, 1);
+		witem->id = g_strdup(id);
+		witem->added = g_hash_table_new(NULL, NULL);
+		g_hash_table_insert(watch_pending, witem->id, witem);
+	}
+
+	return witem;
+}
+
+static void mh_watch_overflow_func(gpointer key, gpointer value,
+				   gpointer data)
+{
+	mh_watch_get_pending((const gchar *)value)->need_scan = TRUE;
+}
+
+static void mh_watch_get_nums_func(gpointer key, gpointer value,
+				   gpointer data)
+{
+	GSList **nums = (GSList **)data;
+
+	*nums = g_slist_prepend(*nums, key);
+}
+
+static gint mh_watch_cmp_num(gconstpointer a, gconstpointer b)
+{
+	return GPOINTER_TO_INT(a) - GPOINTER_TO_INT(b);
+}
+
+static gboolean mh_watch_add_func(GNode *node, gpointer data)
+{
+	FolderItem *item = FOLDER_ITEM(node->data);
+	gchar *path;
+	gint wd;
+
+	if (!item->path || item->stype == F_VIRTUAL)
+		return FALSE;
+
+	path = folder_item_get_path(item);
+	if (!path)
+		return FALSE;
+	wd = inotify_add_watch(watch_fd, path, MH_WATCH_MASK);
+	if (wd < 0) {
+		FILE_OP_ERROR(path, "inotify_add_watch");
+		g_free(path);
+		/* stop on ENOSPC (too many watches) */
+		return errno == ENOSPC;
+	}
+	g_free(path);
+
+	g_hash_table_replace(watch_table, GINT_TO_POINTER(wd),
+			     folder_item_get_identifier(item));
+
+	return FALSE;
+}
+
+static gboolean mh_watch_remove_func(gpointer key, gpointer value,
+				     gpointer data)
+{
+	inotify_rm_watch(watch_fd, GPOINTER_TO_INT(key));
+	return TRUE;
+}
+
+static void mh_watch_sync(void)
+{
+	GList *list;
+	Folder *folder;
+
+	g_hash_table_foreach_remove(watch_table, mh_watch_remove_func, NULL);
+
+	for (list = folder_get_list(); list != NULL; list = list->next) {
+		folder = FOLDER(list->data);
+		if (FOLDER_TYPE(folder) != F_MH || !folder->node)
+			continue;
+		g_node_traverse(folder->node, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+				mh_watch_add_func, NULL);
+	}
+
+	debug_print("mh_watch_sync: watching %u folders\n",
+		    g_hash_table_size(watch_table));
+}
+
+static void mh_watch_folderlist_updated_cb(GObject *obj, gpointer data)
+{
+	mh_watch_sync();
+}
+
+static void mh_watch_process_added(FolderItem *item, GHashTable *added)
+{
+	GSList *nums = NULL, *cur;
+	MsgInfo *msginfo;
+	gint num;
+
+	g_hash_table_foreach(added, mh_watch_get_nums_func, &nums);
+	nums = g_slist_sort(nums, mh_watch_cmp_num);
+
+	for (cur = nums; cur != NULL; cur = cur->next) {
+		num = GPOINTER_TO_INT(cur->data);
+		/* added by ourselves, or already processed */
+		if (num <= item->last_num)
+			continue;
+
+		msginfo = mh_parse_msg(item, num);
+		if (!msginfo)
+			continue;
+		procmsg_msginfo_intern(msginfo);
+
+		debug_print("mh_watch: new message %s/%d\n", item->path, num);
+
+		procmsg_add_cache_queue(item, num, msginfo);
+		procmsg_msginfo_free(msginfo);
+
+		item->last_num = num;
+		item->total++;
+		item->new++;
+		item->unread++;
+		item->unmarked_num++;
+		item->updated = TRUE;
+		item->mtime = 0;
+
+		if (syl_app_get()) {
+			gchar *file;
+
+			file = mh_get_msg_path(item, num);
+			g_signal_emit_by_name(syl_app_get(), "add-msg", item,
+					      file, num);
+			g_free(file);
+		}
+	}
+
+	g_slist_free(nums);
+
+	if (item->cache_queue && !item->opened)
+		procmsg_flush_cache_queue(item, NULL);
+}
+
+static gboolean mh_watch_process_func(gpointer key, gpointer value,
+				      gpointer data)
+{
+	MHWatchItem *witem = (MHWatchItem *)value;
+	FolderItem *item;
+	gint last_num, new, unread, total;
+
+	item = folder_find_item_from_identifier(witem->id);
+	if (!item || !item->folder || FOLDER_TYPE(item->folder) != F_MH)
+		return TRUE;
+
+	last_num = item->last_num;
+	new = item->new;
+	unread = item->unread;
+	total = item->total;
+
+	if (witem->need_scan || item->last_num < 0)
+		mh_scan_folder(item->folder, item);
+	else
+		mh_watch_process_added(item, witem->added);
+
+	/* changes made by ourselves are already reflected */
+	if (item->last_num == last_num && item->new == new &&
+	    item->unread == unread && item->total == total)
+		return TRUE;
+
+	if (syl_app_get())
+		g_signal_emit_by_name(syl_app_get(), "update-folder", item);
+
+	return TRUE;
+}
+
+static gboolean mh_watch_timeout_func(gpointer data)
+{
+	watch_timeout_tag = 0;
+	g_hash_table_foreach_remove(watch_pending, mh_watch_process_func,
+				    NULL);
+	return FALSE;
+}
+
+/* returns TRUE if the created message is a hard link to a complete file */
+static gboolean mh_watch_is_linked(const gchar *id, gint num)
+{
+	FolderItem *item;
+	GStatBuf s;
+
+	item = folder_find_item_from_identifier(id);
+	if (!item)
+		return FALSE;
+
+	return mh_stat_msg(item, num, &s) == 0 && S_ISREG(s.st_mode) &&
+		s.st_nlink > 1;
+}
+
+static void mh_watch_queue_event(const gchar *id, struct inotify_event *ev)
+{
+	MHWatchItem *witem;
+	gint num = 0;
+
+	witem = mh_watch_get_pending(id);
+
+	if (ev->len > 0)
+		num = to_number(ev->name);
+
+	if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		/* the flags of the removed message are not known here */
+		if (num > 0)
+			witem->need_scan = TRUE;
+	} else if (num > 0 && !(ev->mask & IN_ISDIR)) {
+		/* a plain create may be half-written; wait for
+		   IN_CLOSE_WRITE */
+		if ((ev->mask & IN_CREATE) && !mh_watch_is_linked(id, num))
+			return;
+		g_hash_table_insert(witem->added, GINT_TO_POINTER(num),
+				    GINT_TO_POINTER(1));
+	}
+}
+
+static gboolean mh_watch_input_cb(GIOChannel *source, GIOCondition condition,
+				  gpointer data)
+{
+	union {
+		struct inotify_event ev;
+		gchar buf[4096];
+	} u;
+	struct inotify_event *ev;
+	const gchar *id;
+	gssize len;
+	gchar *p;
+
+	len = read(watch_fd, u.buf, sizeof(u.buf));
+	if (len <= 0)
+		return len < 0 && (errno == EAGAIN || errno == EINTR);
+
+	for (p = u.buf; p < u.buf + len;
+	     p += sizeof(struct inotify_event) + ev->len) {
+		ev = (struct inotify_event *)p;
+
+		if (ev->mask & IN_Q_OVERFLOW) {
+			/* events were lost; rescan all watched folders */
+			g_warning("mh_watch: inotify event queue overflowed\n");
+			g_hash_table_foreach(watch_table,
+					     mh_watch_overflow_func, NULL);
+			continue;
+		}
+
+		id = g_hash_table_lookup(watch_table,
+					 GINT_TO_POINTER(ev->wd));
+		if (!id)
+			continue;
+
+		if (ev->mask & IN_IGNORED) {
+			g_hash_table_remove(watch_table,
+					    GINT_TO_POINTER(ev->wd));
+			continue;
+		}
+		if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+			continue;
+
+		mh_watch_queue_event(id, ev);
+	}
+
+	if (g_hash_table_size(watch_pending) > 0 && watch_timeout_tag == 0)
+		watch_timeout_tag = g_timeout_add(MH_WATCH_DELAY,
+						  mh_watch_timeout_func, NULL);
+
+	return TRUE;
+}
+
+gint mh_watch_start(void)
+{
+	if (watch_fd >= 0)
+		return 0;
+
+	if ((watch_fd = inotify_init()) < 0) {
+		perror("inotify_init");
+		return -1;
+	}
+	fcntl(watch_fd, F_SETFD, FD_CLOEXEC);
+	fcntl(watch_fd, F_SETFL, fcntl(watch_fd, F_GETFL) | O_NONBLOCK);
+
+	watch_table = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+	watch_pending = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+					      mh_watch_item_free);
+
+	watch_ch = g_io_channel_unix_new(watch_fd);
+	watch_io_tag = g_io_add_watch(watch_ch, G_IO_IN | G_IO_PRI | G_IO_ERR,
+				      mh_watch_input_cb, NULL);
+
+	if (syl_app_get())
+		watch_folderlist_handler = g_signal_connect
+			(syl_app_get(), "folderlist-updated",
+			 G_CALLBACK(mh_watch_folderlist_updated_cb), NULL);
+
+	mh_watch_sync();
+
+	return 0;
+}
+
+void mh_watch_stop(void)
+{
+	if (watch_fd < 0)
+		return;
+
+	debug_print("mh_watch_stop\n");
+
+	if (watch_folderlist_handler > 0) {
+		g_signal_handler_disconnect(syl_app_get(),
+					    watch_folderlist_handler);
+		watch_folderlist_handler = 0;
+	}
+	if (watch_timeout_tag > 0) {
+		g_source_remove(watch_timeout_tag);
+		watch_timeout_tag = 0;
+	}
+	g_source_remove(watch_io_tag);
+	watch_io_tag = 0;
+	g_io_channel_unref(watch_ch);
+	watch_ch = NULL;
+
+	g_hash_table_destroy(watch_pending);
+	watch_pending = NULL;
+	g_hash_table_destroy(watch_table);
+	watch_table = NULL;
+
+	close(watch_fd);
+	watch_fd = -1;
+}
+
+#else /* USE_INOTIFY */
+
+gint mh_watch_start(void)
+{
+	return -1;
+}
+
+void mh_watch_stop(void)
+{
+}
+
+#endif /* USE_INOTIFY */
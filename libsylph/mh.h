@@ -35,4 +35,7 @@ struct _MHFolder
 
 FolderClass *mh_get_class	(void);
 
+gint mh_watch_start		(void);
+void mh_watch_stop		(void);
+
 #endif /* __MH_H__ */
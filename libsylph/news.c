@@ -449,6 +449,11 @@ static MsgInfo *news_get_msginfo(Folder *folder, FolderItem *item, gint num)
 	g_return_val_if_fail(folder != NULL, NULL);
 	g_return_val_if_fail(item != NULL, NULL);
 
+	/* avoid fetching the whole article if it is cached */
+	msginfo = procmsg_get_cached_msginfo(item, num);
+	if (msginfo)
+		return msginfo;
+
 	file = news_fetch_msg(folder, item, num);
 	if (!file) return NULL;
 
@@ -801,6 +806,7 @@ static GSList *news_get_uncached_articles(NNTPSession *session,
 	GSList *newlist = NULL;
 	GSList *llast = NULL;
 	MsgInfo *msginfo;
+	gchar *xhdr;
 	gint max_articles;
 
 	if (rfirst) *rfirst = -1;
@@ -878,6 +884,7 @@ static GSList *news_get_uncached_articles(NNTPSession *session,
 		msginfo->flags.perm_flags = MSG_NEW|MSG_UNREAD;
 		msginfo->flags.tmp_flags = MSG_NEWS;
 		msginfo->newsgroups = g_strdup(item->path);
+		procmsg_msginfo_intern(msginfo);
 
 		if (!newlist)
 			llast = newlist = g_slist_append(newlist, msginfo);
@@ -914,7 +921,10 @@ static GSList *news_get_uncached_articles(NNTPSession *session,
 		}
 
 		msginfo = (MsgInfo *)llast->data;
-		msginfo->to = news_parse_xhdr(buf, msginfo);
+		xhdr = news_parse_xhdr(buf, msginfo);
+		procmsg_msginfo_set_str(msginfo, &msginfo->to, xhdr);
+		g_free(xhdr);
+		procmsg_msginfo_intern(msginfo);
 
 		llast = llast->next;
 	}
@@ -946,7 +956,10 @@ static GSList *news_get_uncached_articles(NNTPSession *session,
 		}
 
 		msginfo = (MsgInfo *)llast->data;
-		msginfo->cc = news_parse_xhdr(buf, msginfo);
+		xhdr = news_parse_xhdr(buf, msginfo);
+		procmsg_msginfo_set_str(msginfo, &msginfo->cc, xhdr);
+		g_free(xhdr);
+		procmsg_msginfo_intern(msginfo);
 
 		llast = llast->next;
 	}
@@ -65,6 +65,7 @@ static PrefParam param[] = {
 	 P_BOOL},
 	{"imap_filter_inbox_on_receive", "FALSE",
 	 &tmp_ac_prefs.imap_filter_inbox_on_recv, P_BOOL},
+	{"imap_use_idle", "FALSE", &tmp_ac_prefs.imap_use_idle, P_BOOL},
 	{"imap_auth_method", "0", &tmp_ac_prefs.imap_auth_type, P_ENUM},
 	{"max_nntp_articles", "300", &tmp_ac_prefs.max_nntp_articles, P_INT},
 	{"receive_at_get_all", "TRUE", &tmp_ac_prefs.recv_at_getall, P_BOOL},
@@ -183,6 +183,9 @@ struct _PrefsAccount
 
 	/* Privacy */
 	gboolean encrypt_to_self;
+
+	/* Receive (IMAP4) */
+	gboolean imap_use_idle;
 };
 
 PrefsAccount *prefs_account_new		(void);
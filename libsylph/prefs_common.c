@@ -43,6 +43,8 @@ static PrefParam param[] = {
 	{"check_on_startup", "FALSE", &prefs_common.chk_on_startup, P_BOOL},
 	{"scan_all_after_inc", "FALSE", &prefs_common.scan_all_after_inc,
 	 P_BOOL},
+	{"watch_local_folders", "FALSE", &prefs_common.watch_local_folders,
+	 P_BOOL},
 	{"enable_newmsg_notify", "FALSE", &prefs_common.enable_newmsg_notify,
 	 P_BOOL},
 	{"newmsg_notify_command", NULL, &prefs_common.newmsg_notify_cmd,
@@ -146,6 +148,8 @@ static PrefParam param[] = {
 	{"date_format", "%y/%m/%d(%a) %H:%M", &prefs_common.date_format,
 	 P_STRING},
 	{"expand_thread", "TRUE", &prefs_common.expand_thread, P_BOOL},
+	{"thread_by_subject", "FALSE", &prefs_common.thread_by_subject,
+	 P_BOOL},
 
 	{"enable_rules_hint", "TRUE", &prefs_common.enable_rules_hint, P_BOOL},
 	{"bold_unread", "TRUE", &prefs_common.bold_unread, P_BOOL},
@@ -515,6 +519,9 @@ static PrefParam param[] = {
 	{"strict_cache_check", "FALSE", &prefs_common.strict_cache_check,
 	 P_BOOL},
 	{"io_timeout_secs", "60", &prefs_common.io_timeout_secs, P_INT},
+	{"zero_copy_cache", "TRUE", &prefs_common.zero_copy_cache, P_BOOL},
+	{"fsync_messages", "TRUE", &prefs_common.fsync_messages, P_BOOL},
+	{"use_body_index", "TRUE", &prefs_common.use_body_index, P_BOOL},
 
 	/* File selector */
 	{"filesel_prev_open_dir", NULL, &prefs_common.prev_open_dir, P_STRING},
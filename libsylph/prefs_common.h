@@ -353,6 +353,15 @@ struct _PrefsCommon
 	gint notify_window_period;           /* Receive */
 
 	gint startup_online_mode;            /* Online */
+
+	gboolean zero_copy_cache;            /* Advanced */
+
+	gboolean watch_local_folders;        /* Receive */
+	gboolean fsync_messages;             /* Advanced */
+
+	gboolean thread_by_subject;          /* Display */
+
+	gboolean use_body_index;             /* Advanced */
 };
 
 extern PrefsCommon prefs_common;
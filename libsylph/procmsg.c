@@ -23,11 +23,15 @@
 #include <glib/gi18n.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <errno.h>
 
 #include "utils.h"
 #include "procmsg.h"
 #include "procheader.h"
+#include "procthread.h"
+#include "bodyindex.h"
 #include "account.h"
 #include "procmime.h"
 #include "prefs_common.h"
@@ -39,6 +43,80 @@ typedef struct _MsgFlagInfo {
 	MsgFlags flags;
 } MsgFlagInfo;
 
+struct _MsgCacheMap {
+	GMappedFile *mapfile;
+	const gchar *start;
+	const gchar *end;
+	gint ref_count;
+};
+
+/* MsgInfo read from the summary cache are allocated in blocks. The
+   blocks are released at once when the last MsgInfo is freed */
+struct _MsgArena {
+	GSList *blocks;
+	MsgInfo *block;
+	guint block_size;
+	guint used;
+	gint ref_count;
+};
+
+#define MSG_ARENA_BLOCK_SIZE	256
+
+#define CACHE_MAP_CONTAINS(map, str)				\
+	((map) != NULL && (const gchar *)(str) >= (map)->start &&	\
+	 (const gchar *)(str) < (map)->end)
+
+/* Summary cache layout (CACHE_VERSION):
+ *
+ *   guint32 version
+ *   guint32 number of messages (n)
+ *   guint32 number of references (r)
+ *   guint32 size of the string heap
+ *   guint32 column[CACHE_COL_N][n]	sorted by message number
+ *   guint32 reference[r]		heap offsets of references
+ *   gchar   heap[]			NUL-terminated strings
+ *   records appended by procmsg_flush_cache_queue()
+ *
+ * String columns hold heap offsets, where offset 0 means NULL.
+ * Appended records have the stream format of OLD_CACHE_VERSION.
+ */
+
+enum
+{
+	CACHE_COL_MSGNUM,
+	CACHE_COL_SIZE,
+	CACHE_COL_MTIME,
+	CACHE_COL_DATE_T,
+	CACHE_COL_FLAGS,
+	CACHE_COL_FROMNAME,
+	CACHE_COL_DATE,
+	CACHE_COL_FROM,
+	CACHE_COL_TO,
+	CACHE_COL_NEWSGROUPS,
+	CACHE_COL_SUBJECT,
+	CACHE_COL_MSGID,
+	CACHE_COL_INREPLYTO,
+	CACHE_COL_REF_INDEX,
+	CACHE_COL_REF_NUM,
+
+	CACHE_COL_N
+};
+
+#define CACHE_HEADER_SIZE	(sizeof(guint32) * 4)
+
+typedef struct _CacheIndex {
+	guint32 n_msgs;
+	guint32 n_refs;
+	guint32 heap_size;
+	const guint32 *cols;
+	const guint32 *refs;
+	const gchar *heap;
+	const gchar *tail;
+} CacheIndex;
+
+#define CACHE_INDEX_COL(index, col, i) \
+	((index)->cols[(gsize)(col) * (index)->n_msgs + (i)])
+
 static GSList *procmsg_read_cache_queue		(FolderItem	*item,
 						 gboolean	 scan_file);
 
@@ -46,34 +124,28 @@ static void mark_sum_func			(gpointer	 key,
 						 gpointer	 value,
 						 gpointer	 data);
 
-static GHashTable *procmsg_read_mark_file	(FolderItem	*item);
-static void procmsg_write_mark_file		(FolderItem	*item,
-						 GHashTable	*mark_table);
+static GHashTable *procmsg_read_mark_file	(FolderItem	*item,
+						 guint		*n_records);
+static gboolean procmsg_mark_file_need_compact	(guint		 n_records,
+						 guint		 n_live);
 
 static GMappedFile *procmsg_open_cache_file_mmap(FolderItem	*item,
-						 DataOpenMode	 mode);
-
-static gint procmsg_cmp_by_mark			(gconstpointer	 a,
-						 gconstpointer	 b);
-static gint procmsg_cmp_by_unread		(gconstpointer	 a,
-						 gconstpointer	 b);
-static gint procmsg_cmp_by_mime			(gconstpointer	 a,
-						 gconstpointer	 b);
-static gint procmsg_cmp_by_label		(gconstpointer	 a,
-						 gconstpointer	 b);
-static gint procmsg_cmp_by_number		(gconstpointer	 a,
-						 gconstpointer	 b);
-static gint procmsg_cmp_by_size			(gconstpointer	 a,
-						 gconstpointer	 b);
-static gint procmsg_cmp_by_date			(gconstpointer	 a,
-						 gconstpointer	 b);
-static gint procmsg_cmp_by_from			(gconstpointer	 a,
-						 gconstpointer	 b);
-static gint procmsg_cmp_by_to			(gconstpointer	 a,
-						 gconstpointer	 b);
-static gint procmsg_cmp_by_subject		(gconstpointer	 a,
-						 gconstpointer	 b);
+						 DataOpenMode	 mode,
+						 guint32	*version,
+						 gboolean	*zero_copy);
+static void procmsg_write_cache_index		(GSList		*mlist,
+						 FILE		*fp);
+
+static gchar *procmsg_get_thread_file		(FolderItem	*item);
 
+static MsgCacheMap *procmsg_cache_map_new	(GMappedFile	*mapfile);
+static MsgCacheMap *procmsg_cache_map_ref	(MsgCacheMap	*map);
+static void procmsg_cache_map_unref		(MsgCacheMap	*map);
+
+static MsgArena *procmsg_arena_new		(void);
+static MsgInfo *procmsg_arena_alloc_msginfo	(MsgArena	*arena,
+						 guint		 hint);
+static void procmsg_arena_unref			(MsgArena	*arena);
 
 GHashTable *procmsg_msg_hash_table_create(GSList *mlist)
 {
@@ -157,8 +229,10 @@ gint procmsg_read_cache_data_str(FILE *fp, gchar **str)
 	return 0;
 }
 
-static gint procmsg_read_cache_data_str_mem(const gchar **p, const gchar *endp, gchar **str)
+static gint procmsg_read_cache_data_str_mem(gchar **p, const gchar *endp,
+					    gchar **str, gboolean in_place)
 {
+	gchar *lenp = *p;
 	guint32 len;
 
 	if (endp - *p < sizeof(len))
@@ -170,53 +244,278 @@ static gint procmsg_read_cache_data_str_mem(const gchar **p, const gchar *endp,
 		return -1;
 
 	if (len > 0) {
-		*str = g_strndup(*p, len);
+		if (in_place) {
+			/* the length field is not needed anymore. move the
+			   string onto it to make room for the terminator
+			   (the mapping is private, so the file is intact) */
+			memmove(lenp, *p, len);
+			lenp[len] = '\0';
+			*str = lenp;
+		} else
+			*str = g_strndup(*p, len);
 		*p += len;
 	}
 
 	return 0;
 }
 
+static MsgCacheMap *procmsg_cache_map_new(GMappedFile *mapfile)
+{
+	MsgCacheMap *map;
+
+	map = g_new(MsgCacheMap, 1);
+	map->mapfile = mapfile;
+	map->start = g_mapped_file_get_contents(mapfile);
+	map->end = map->start + g_mapped_file_get_length(mapfile);
+	map->ref_count = 1;
+
+	return map;
+}
+
+static MsgCacheMap *procmsg_cache_map_ref(MsgCacheMap *map)
+{
+	g_atomic_int_inc(&map->ref_count);
+	return map;
+}
+
+static void procmsg_cache_map_unref(MsgCacheMap *map)
+{
+	if (g_atomic_int_dec_and_test(&map->ref_count)) {
+		g_mapped_file_free(map->mapfile);
+		g_free(map);
+	}
+}
+
+static MsgArena *procmsg_arena_new(void)
+{
+	MsgArena *arena;
+
+	arena = g_new0(MsgArena, 1);
+	arena->ref_count = 1;
+
+	return arena;
+}
+
+/* hint: the number of MsgInfo which will be allocated at least */
+static MsgInfo *procmsg_arena_alloc_msginfo(MsgArena *arena, guint hint)
+{
+	MsgInfo *msginfo;
+
+	if (!arena->block || arena->used == arena->block_size) {
+		arena->block_size = MAX(hint, MSG_ARENA_BLOCK_SIZE);
+		arena->block = g_new0(MsgInfo, arena->block_size);
+		arena->blocks = g_slist_prepend(arena->blocks, arena->block);
+		arena->used = 0;
+	}
+
+	msginfo = &arena->block[arena->used++];
+	msginfo->arena = arena;
+	g_atomic_int_inc(&arena->ref_count);
+
+	return msginfo;
+}
+
+static void procmsg_arena_unref(MsgArena *arena)
+{
+	GSList *cur;
+
+	if (g_atomic_int_dec_and_test(&arena->ref_count)) {
+		for (cur = arena->blocks; cur != NULL; cur = cur->next)
+			g_free(cur->data);
+		g_slist_free(arena->blocks);
+		g_free(arena);
+	}
+}
+
+static gboolean procmsg_cache_index_parse(CacheIndex *index,
+					  const gchar *filep, gsize file_len)
+{
+	guint32 hdr[3];
+	guint64 size;
+
+	if (file_len < CACHE_HEADER_SIZE)
+		return FALSE;
+
+	memcpy(hdr, filep + sizeof(guint32), sizeof(hdr));
+	index->n_msgs = hdr[0];
+	index->n_refs = hdr[1];
+	index->heap_size = hdr[2];
+
+	size = CACHE_HEADER_SIZE +
+		((guint64)index->n_msgs * CACHE_COL_N + index->n_refs) *
+		sizeof(guint32) + index->heap_size;
+	/* the heap always ends with the terminator of its last string */
+	if (size > file_len || index->heap_size == 0 ||
+	    filep[size - 1] != '\0')
+		return FALSE;
+
+	index->cols = (const guint32 *)(filep + CACHE_HEADER_SIZE);
+	index->refs = index->cols + (gsize)index->n_msgs * CACHE_COL_N;
+	index->heap = (const gchar *)(index->refs + index->n_refs);
+	index->tail = index->heap + index->heap_size;
+
+	return TRUE;
+}
+
+static gchar *procmsg_cache_index_get_str(const CacheIndex *index,
+					  guint32 offset, gboolean zero_copy)
+{
+	if (offset == 0 || offset >= index->heap_size)
+		return NULL;
+
+	if (zero_copy)
+		return (gchar *)index->heap + offset;
+	else
+		return g_strdup(index->heap + offset);
+}
+
+static gboolean procmsg_cache_index_read_msginfo(const CacheIndex *index,
+						 guint i, MsgInfo *msginfo,
+						 gboolean zero_copy)
+{
+	guint32 ref_index, ref_num;
+
+#define GET_COL(col)	CACHE_INDEX_COL(index, col, i)
+#define GET_STR(col)	procmsg_cache_index_get_str(index, GET_COL(col), \
+						    zero_copy)
+
+	msginfo->msgnum = GET_COL(CACHE_COL_MSGNUM);
+	msginfo->size = GET_COL(CACHE_COL_SIZE);
+	msginfo->mtime = GET_COL(CACHE_COL_MTIME);
+	msginfo->date_t = GET_COL(CACHE_COL_DATE_T);
+	msginfo->flags.tmp_flags = GET_COL(CACHE_COL_FLAGS);
+
+	msginfo->fromname = GET_STR(CACHE_COL_FROMNAME);
+
+	msginfo->date = GET_STR(CACHE_COL_DATE);
+	msginfo->from = GET_STR(CACHE_COL_FROM);
+	msginfo->to = GET_STR(CACHE_COL_TO);
+	msginfo->newsgroups = GET_STR(CACHE_COL_NEWSGROUPS);
+	msginfo->subject = GET_STR(CACHE_COL_SUBJECT);
+	msginfo->msgid = GET_STR(CACHE_COL_MSGID);
+	msginfo->inreplyto = GET_STR(CACHE_COL_INREPLYTO);
+
+	ref_index = GET_COL(CACHE_COL_REF_INDEX);
+	ref_num = GET_COL(CACHE_COL_REF_NUM);
+	if ((guint64)ref_index + ref_num > index->n_refs)
+		return FALSE;
+
+	for (; ref_num != 0; ref_num--) {
+		gchar *ref;
+
+		ref = procmsg_cache_index_get_str
+			(index, index->refs[ref_index + ref_num - 1], zero_copy);
+		if (ref)
+			msginfo->references =
+				g_slist_prepend(msginfo->references, ref);
+	}
+
+#undef GET_STR
+#undef GET_COL
+
+	return TRUE;
+}
+
 #define READ_CACHE_DATA(data)						\
 {									\
-	if (procmsg_read_cache_data_str_mem(&p, endp, &data) < 0) {	\
-		g_warning("Cache data is corrupted\n");			\
-		procmsg_msginfo_free(msginfo);				\
-		procmsg_msg_list_free(mlist);				\
-		g_mapped_file_free(mapfile);				\
-		return NULL;						\
-	}								\
+	if (procmsg_read_cache_data_str_mem(p, endp, &data, in_place) < 0) \
+		return -1;						\
 }
 
 #define READ_CACHE_DATA_INT(n)					\
 {								\
-	if (endp - p < sizeof(guint32)) {			\
-		g_warning("Cache data is corrupted\n");		\
-		procmsg_msginfo_free(msginfo);			\
-		procmsg_msg_list_free(mlist);			\
-		g_mapped_file_free(mapfile);			\
-		return NULL;					\
+	if (endp - *p < sizeof(guint32)) {			\
+		return -1;					\
 	} else {						\
 		guint32 idata;					\
-		memcpy(&idata, p, sizeof(idata));		\
+		memcpy(&idata, *p, sizeof(idata));		\
 		n = idata;					\
-		p += sizeof(guint32);				\
+		*p += sizeof(guint32);				\
 	}							\
 }
 
+/* read a record of the stream format (OLD_CACHE_VERSION) */
+static gint procmsg_read_cache_record(gchar **p, const gchar *endp,
+				      MsgInfo *msginfo, gboolean in_place)
+{
+	guint refnum;
+
+	READ_CACHE_DATA_INT(msginfo->msgnum);
+
+	READ_CACHE_DATA_INT(msginfo->size);
+	READ_CACHE_DATA_INT(msginfo->mtime);
+	READ_CACHE_DATA_INT(msginfo->date_t);
+	READ_CACHE_DATA_INT(msginfo->flags.tmp_flags);
+
+	READ_CACHE_DATA(msginfo->fromname);
+
+	READ_CACHE_DATA(msginfo->date);
+	READ_CACHE_DATA(msginfo->from);
+	READ_CACHE_DATA(msginfo->to);
+	READ_CACHE_DATA(msginfo->newsgroups);
+	READ_CACHE_DATA(msginfo->subject);
+	READ_CACHE_DATA(msginfo->msgid);
+	READ_CACHE_DATA(msginfo->inreplyto);
+
+	READ_CACHE_DATA_INT(refnum);
+	for (; refnum != 0; refnum--) {
+		gchar *ref = NULL;
+
+		READ_CACHE_DATA(ref);
+		msginfo->references =
+			g_slist_prepend(msginfo->references, ref);
+	}
+	if (msginfo->references)
+		msginfo->references = g_slist_reverse(msginfo->references);
+
+	return 0;
+}
+
+#undef READ_CACHE_DATA
+#undef READ_CACHE_DATA_INT
+
+static GSList *procmsg_read_cache_prepend(GSList *mlist, FolderItem *item,
+					  MsgInfo *msginfo,
+					  MsgFlags *default_flags,
+					  gboolean scan_file)
+{
+	MSG_SET_PERM_FLAGS(msginfo->flags, default_flags->perm_flags);
+	MSG_SET_TMP_FLAGS(msginfo->flags, default_flags->tmp_flags);
+
+	/* if the message file doesn't exist or is changed,
+	   don't add the data */
+	if ((FOLDER_TYPE(item->folder) == F_MH && scan_file &&
+	     folder_item_is_msg_changed(item, msginfo)) ||
+	     msginfo->msgnum == 0) {
+		procmsg_msginfo_free(msginfo);
+		item->cache_dirty = TRUE;
+		return mlist;
+	}
+
+	msginfo->folder = item;
+	procmsg_msginfo_intern(msginfo);
+	return g_slist_prepend(mlist, msginfo);
+}
+
 GSList *procmsg_read_cache(FolderItem *item, gboolean scan_file)
 {
 	GSList *mlist = NULL;
-	GSList *last = NULL;
 	GMappedFile *mapfile;
-	const gchar *filep;
+	MsgCacheMap *cache_map = NULL;
+	MsgArena *arena;
+	guint32 version;
+	gboolean zero_copy;
+	gboolean in_place;
+	gboolean corrupted = FALSE;
+	CacheIndex index;
+	gchar *filep;
 	gsize file_len;
-	const gchar *p, *endp;
+	gchar *p;
+	const gchar *endp;
 	MsgInfo *msginfo;
 	MsgFlags default_flags;
-	guint32 num;
-	guint refnum;
 	FolderType type;
+	guint i;
 
 	g_return_val_if_fail(item != NULL, NULL);
 	g_return_val_if_fail(item->folder != NULL, NULL);
@@ -237,85 +536,101 @@ GSList *procmsg_read_cache(FolderItem *item, gboolean scan_file)
 		MSG_SET_TMP_FLAGS(default_flags, MSG_NEWS);
 	}
 
-	if (type == F_MH) {
-		gchar *path;
-
-		path = folder_item_get_path(item);
-		if (change_dir(path) < 0) {
-			g_free(path);
-			return NULL;
-		}
-		g_free(path);
-	}
-
-	mapfile = procmsg_open_cache_file_mmap(item, DATA_READ);
+#ifdef G_OS_WIN32
+	/* a mapped file can't be renamed or removed on Win32, so the
+	   cache could not be rewritten while the summary holds the map */
+	zero_copy = FALSE;
+#else
+	zero_copy = prefs_common.zero_copy_cache;
+#endif
+	mapfile = procmsg_open_cache_file_mmap(item, DATA_READ, &version,
+					       &zero_copy);
 	if (!mapfile) {
 		item->cache_dirty = TRUE;
 		return NULL;
 	}
 
-	debug_print("Reading summary cache...\n");
+	debug_print("Reading summary cache%s...\n",
+		    zero_copy ? " (zero-copy)" : "");
+
+	/* in zero-copy mode, the string members of MsgInfo point into
+	   the mapping, which lives until the last one is freed */
+	if (zero_copy)
+		cache_map = procmsg_cache_map_new(mapfile);
+	arena = procmsg_arena_new();
 
 	filep = g_mapped_file_get_contents(mapfile);
 	file_len = g_mapped_file_get_length(mapfile);
 	endp = filep + file_len;
 	p = filep + sizeof(guint32); /* version */
 
-	while (endp - p >= sizeof(num)) {
-		msginfo = g_new0(MsgInfo, 1);
-
-		READ_CACHE_DATA_INT(msginfo->msgnum);
-
-		READ_CACHE_DATA_INT(msginfo->size);
-		READ_CACHE_DATA_INT(msginfo->mtime);
-		READ_CACHE_DATA_INT(msginfo->date_t);
-		READ_CACHE_DATA_INT(msginfo->flags.tmp_flags);
-
-		READ_CACHE_DATA(msginfo->fromname);
-
-		READ_CACHE_DATA(msginfo->date);
-		READ_CACHE_DATA(msginfo->from);
-		READ_CACHE_DATA(msginfo->to);
-		READ_CACHE_DATA(msginfo->newsgroups);
-		READ_CACHE_DATA(msginfo->subject);
-		READ_CACHE_DATA(msginfo->msgid);
-		READ_CACHE_DATA(msginfo->inreplyto);
-
-		READ_CACHE_DATA_INT(refnum);
-		for (; refnum != 0; refnum--) {
-			gchar *ref;
+	if (version == CACHE_VERSION) {
+		if (!procmsg_cache_index_parse(&index, filep, file_len)) {
+			g_warning("Cache index is corrupted\n");
+			corrupted = TRUE;
+			index.n_msgs = 0;
+			index.tail = endp;
+		}
 
-			READ_CACHE_DATA(ref);
-			msginfo->references =
-				g_slist_prepend(msginfo->references, ref);
+		for (i = 0; i < index.n_msgs; i++) {
+			msginfo = procmsg_arena_alloc_msginfo
+				(arena, index.n_msgs);
+			if (cache_map)
+				msginfo->cache_map =
+					procmsg_cache_map_ref(cache_map);
+			if (!procmsg_cache_index_read_msginfo
+				(&index, i, msginfo, cache_map != NULL)) {
+				g_warning("Cache index is corrupted\n");
+				procmsg_msginfo_free(msginfo);
+				corrupted = TRUE;
+				break;
+			}
+			mlist = procmsg_read_cache_prepend
+				(mlist, item, msginfo, &default_flags,
+				 scan_file);
 		}
-		if (msginfo->references)
-			msginfo->references =
-				g_slist_reverse(msginfo->references);
 
-		MSG_SET_PERM_FLAGS(msginfo->flags, default_flags.perm_flags);
-		MSG_SET_TMP_FLAGS(msginfo->flags, default_flags.tmp_flags);
+		/* the mapping is read-only, so the appended records must
+		   be copied */
+		p = (gchar *)index.tail;
+		in_place = FALSE;
+	} else {
+		/* old stream format. it will be migrated to the new format
+		   on the next write */
+		item->cache_dirty = TRUE;
+		in_place = (cache_map != NULL);
+	}
 
-		/* if the message file doesn't exist or is changed,
-		   don't add the data */
-		if ((type == F_MH && scan_file &&
-		     folder_item_is_msg_changed(item, msginfo)) ||
-		     msginfo->msgnum == 0) {
+	while (!corrupted && endp - p >= sizeof(guint32)) {
+		msginfo = procmsg_arena_alloc_msginfo(arena, 0);
+		if (cache_map)
+			msginfo->cache_map = procmsg_cache_map_ref(cache_map);
+		if (procmsg_read_cache_record(&p, endp, msginfo,
+					      in_place) < 0) {
+			g_warning("Cache data is corrupted\n");
 			procmsg_msginfo_free(msginfo);
-			item->cache_dirty = TRUE;
-		} else {
-			msginfo->folder = item;
-
-			if (!mlist)
-				last = mlist = g_slist_append(NULL, msginfo);
-			else {
-				last = g_slist_append(last, msginfo);
-				last = last->next;
-			}
+			corrupted = TRUE;
+			break;
 		}
+		mlist = procmsg_read_cache_prepend(mlist, item, msginfo,
+						   &default_flags, scan_file);
 	}
 
-	g_mapped_file_free(mapfile);
+	if (corrupted) {
+		procmsg_msg_list_free(mlist);
+		mlist = NULL;
+	}
+
+	if (cache_map)
+		procmsg_cache_map_unref(cache_map);
+	else
+		g_mapped_file_free(mapfile);
+	procmsg_arena_unref(arena);
+
+	if (corrupted)
+		return NULL;
+
+	mlist = g_slist_reverse(mlist);
 
 	if (item->cache_queue) {
 		GSList *qlist;
@@ -324,12 +639,92 @@ GSList *procmsg_read_cache(FolderItem *item, gboolean scan_file)
 	}
 
 	debug_print("done.\n");
+	if (get_debug_mode())
+		string_table_get_stats(folder_get_string_table(item->folder));
 
 	return mlist;
 }
 
-#undef READ_CACHE_DATA
-#undef READ_CACHE_DATA_INT
+MsgInfo *procmsg_get_cached_msginfo(FolderItem *item, guint num)
+{
+	GMappedFile *mapfile;
+	guint32 version;
+	gboolean zero_copy = FALSE;
+	CacheIndex index;
+	MsgInfo *msginfo = NULL;
+	gchar *filep;
+	gchar *p;
+	const gchar *endp;
+	guint lo, hi, mid;
+	GSList *cur;
+
+	g_return_val_if_fail(item != NULL, NULL);
+
+	for (cur = item->cache_queue; cur != NULL; cur = cur->next) {
+		msginfo = (MsgInfo *)cur->data;
+		if (msginfo->msgnum == num)
+			return procmsg_msginfo_copy(msginfo);
+	}
+
+	mapfile = procmsg_open_cache_file_mmap(item, DATA_READ, &version,
+					       &zero_copy);
+	if (!mapfile)
+		return NULL;
+
+	filep = g_mapped_file_get_contents(mapfile);
+	endp = filep + g_mapped_file_get_length(mapfile);
+
+	if (version != CACHE_VERSION ||
+	    !procmsg_cache_index_parse(&index, filep, endp - filep)) {
+		g_mapped_file_free(mapfile);
+		return NULL;
+	}
+
+	/* binary search on the message number column */
+	lo = 0;
+	hi = index.n_msgs;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (CACHE_INDEX_COL(&index, CACHE_COL_MSGNUM, mid) < num)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	msginfo = NULL;
+	if (lo < index.n_msgs &&
+	    CACHE_INDEX_COL(&index, CACHE_COL_MSGNUM, lo) == num) {
+		msginfo = g_new0(MsgInfo, 1);
+		if (!procmsg_cache_index_read_msginfo(&index, lo, msginfo,
+						      FALSE)) {
+			procmsg_msginfo_free(msginfo);
+			msginfo = NULL;
+		}
+	}
+
+	/* the appended records are not sorted */
+	p = (gchar *)index.tail;
+	while (!msginfo && endp - p >= sizeof(guint32)) {
+		MsgInfo *tmp;
+
+		tmp = g_new0(MsgInfo, 1);
+		if (procmsg_read_cache_record(&p, endp, tmp, FALSE) < 0) {
+			procmsg_msginfo_free(tmp);
+			break;
+		}
+		if (tmp->msgnum == num)
+			msginfo = tmp;
+		else
+			procmsg_msginfo_free(tmp);
+	}
+
+	g_mapped_file_free(mapfile);
+
+	if (msginfo)
+		msginfo->folder = item;
+
+	return msginfo;
+}
 
 static GSList *procmsg_read_cache_queue(FolderItem *item, gboolean scan_file)
 {
@@ -389,6 +784,8 @@ void procmsg_set_flags(GSList *mlist, FolderItem *item)
 	gint lastnum = 0;
 	gint unflagged = 0;
 	gboolean mark_queue_exist;
+	gboolean table_modified = FALSE;
+	guint n_records = 0;
 	MsgInfo *msginfo;
 	GHashTable *mark_table;
 	MsgFlags *flags;
@@ -399,7 +796,7 @@ void procmsg_set_flags(GSList *mlist, FolderItem *item)
 	debug_print("Marking the messages...\n");
 
 	mark_queue_exist = (item->mark_queue != NULL);
-	mark_table = procmsg_read_mark_file(item);
+	mark_table = procmsg_read_mark_file(item, &n_records);
 	if (!mark_table) {
 		item->new = item->unread = item->total = g_slist_length(mlist);
 		item->updated = TRUE;
@@ -417,10 +814,12 @@ void procmsg_set_flags(GSList *mlist, FolderItem *item)
 				g_hash_table_foreach(mark_table,
 						     mark_unset_new_func, NULL);
 				item->mark_dirty = TRUE;
+				table_modified = TRUE;
 				break;
 			}
 		}
-	}
+	} else
+		table_modified = TRUE;
 
 	for (cur = mlist; cur != NULL; cur = cur->next) {
 		msginfo = (MsgInfo *)cur->data;
@@ -449,6 +848,10 @@ void procmsg_set_flags(GSList *mlist, FolderItem *item)
 			++unread;
 		}
 
+		/* journal the flags which differ from the mark file */
+		if (!flags || table_modified)
+			MSG_SET_TMP_FLAGS(msginfo->flags, MSG_FLAG_CHANGED);
+
 		++total;
 	}
 
@@ -465,25 +868,66 @@ void procmsg_set_flags(GSList *mlist, FolderItem *item)
 	debug_print("new: %d unread: %d unflagged: %d total: %d\n",
 		    new, unread, unflagged, total);
 
+	/* the records of removed messages are dropped here, where the
+	   live messages are known */
+	if (procmsg_mark_file_need_compact(n_records, (guint)total)) {
+		debug_print("compacting mark file: %s (%u records, "
+			    "%d messages)\n", item->path, n_records, total);
+		procmsg_write_flags_list(item, mlist);
+		for (cur = mlist; cur != NULL; cur = cur->next) {
+			msginfo = (MsgInfo *)cur->data;
+			MSG_UNSET_TMP_FLAGS(msginfo->flags, MSG_FLAG_CHANGED);
+		}
+	}
+
 	hash_free_value_mem(mark_table);
 	g_hash_table_destroy(mark_table);
 }
 
+typedef struct _MarkAllReadData
+{
+	FILE *fp;
+	guint n_records;
+} MarkAllReadData;
+
 static void mark_all_read_func(gpointer key, gpointer value, gpointer data)
 {
-	MSG_UNSET_PERM_FLAGS(*((MsgFlags *)value), MSG_NEW|MSG_UNREAD);
+	MsgFlags *flags = (MsgFlags *)value;
+	MarkAllReadData *mdata = (MarkAllReadData *)data;
+	MsgInfo msginfo;
+
+	if ((flags->perm_flags & (MSG_NEW|MSG_UNREAD)) == 0)
+		return;
+
+	MSG_UNSET_PERM_FLAGS(*flags, MSG_NEW|MSG_UNREAD);
+	msginfo.msgnum = GPOINTER_TO_UINT(key);
+	msginfo.flags.perm_flags = flags->perm_flags;
+	procmsg_write_flags(&msginfo, mdata->fp);
+	mdata->n_records++;
 }
 
 void procmsg_mark_all_read(FolderItem *item)
 {
 	GHashTable *mark_table;
+	FILE *fp;
 
 	debug_print("Marking all messages as read\n");
 
-	mark_table = procmsg_read_mark_file(item);
+	mark_table = procmsg_read_mark_file(item, NULL);
 	if (mark_table) {
-		g_hash_table_foreach(mark_table, mark_all_read_func, NULL);
-		procmsg_write_mark_file(item, mark_table);
+		/* only the messages which were unread are journaled. the
+		   file is compacted when the folder is opened next time */
+		if ((fp = procmsg_open_mark_file(item, DATA_APPEND)) != NULL) {
+			MarkAllReadData data;
+
+			data.fp = fp;
+			data.n_records = 0;
+			g_hash_table_foreach(mark_table, mark_all_read_func,
+					     &data);
+			fclose(fp);
+			item->mark_records += data.n_records;
+		} else
+			g_warning("procmsg_mark_all_read: cannot open mark file.");
 		hash_free_value_mem(mark_table);
 		g_hash_table_destroy(mark_table);
 	}
@@ -503,41 +947,316 @@ void procmsg_mark_all_read(FolderItem *item)
 	item->new = item->unread = 0;
 }
 
-static FolderSortType cmp_func_sort_type;
+/* sort keys are compared either as a number followed by the date, as a
+   number alone, or as a normalized string followed by the date */
+typedef enum
+{
+	SORT_KEY_VAL_DATE,
+	SORT_KEY_VAL,
+	SORT_KEY_STR
+} MsgSortKeyType;
+
+typedef struct _MsgSortKey
+{
+	MsgInfo *msginfo;
+	const gchar *str;
+	gint64 val;
+	stime_t date_t;
+} MsgSortKey;
+
+typedef struct _MsgSortData
+{
+	MsgSortKeyType type;
+	gint dir;
+	MsgSortKey **keys;
+	MsgSortKey **tmp;
+	guint n;
+} MsgSortData;
+
+#if USE_THREADS
+/* lists are split and sorted in parallel if they have at least this
+   number of messages */
+#define PROCMSG_SORT_THREAD_MIN_MSGS	16384
+#define PROCMSG_SORT_THREAD_MAX		8
+#endif
+
+static gint procmsg_sort_key_cmp(const MsgSortKey *key1,
+				 const MsgSortKey *key2, MsgSortKeyType type)
+{
+	gint ret = 0;
+
+	switch (type) {
+	case SORT_KEY_STR:
+		if (!key1->str)
+			return key2->str != NULL ? -1 : 0;
+		if (!key2->str)
+			return 1;
+		ret = strcmp(key1->str, key2->str);
+		break;
+	case SORT_KEY_VAL_DATE:
+	case SORT_KEY_VAL:
+		if (key1->val != key2->val)
+			return key1->val < key2->val ? -1 : 1;
+		if (type == SORT_KEY_VAL)
+			return 0;
+		break;
+	}
+
+	if (ret == 0 && key1->date_t != key2->date_t)
+		ret = key1->date_t < key2->date_t ? -1 : 1;
+
+	return ret;
+}
+
+/* stable merge of the sorted runs src[0..mid) and src[mid..n) into dest */
+static void procmsg_sort_merge(MsgSortKey **dest, MsgSortKey **src,
+			       guint mid, guint n, MsgSortKeyType type,
+			       gint dir)
+{
+	guint i = 0, j = mid, k = 0;
+
+	while (i < mid && j < n) {
+		if (procmsg_sort_key_cmp(src[j], src[i], type) * dir < 0)
+			dest[k++] = src[j++];
+		else
+			dest[k++] = src[i++];
+	}
+	while (i < mid)
+		dest[k++] = src[i++];
+	while (j < n)
+		dest[k++] = src[j++];
+}
+
+/* bottom-up merge sort of data->keys; data->tmp must have the same size */
+static void procmsg_sort_keys(MsgSortData *data)
+{
+	MsgSortKey **src = data->keys, **dest = data->tmp, **swap;
+	guint width, i;
+
+	for (width = 1; width < data->n; width *= 2) {
+		for (i = 0; i < data->n; i += width * 2) {
+			guint mid = MIN(i + width, data->n);
+			guint end = MIN(i + width * 2, data->n);
+
+			procmsg_sort_merge(dest + i, src + i, mid - i, end - i,
+					   data->type, data->dir);
+		}
+		swap = src;
+		src = dest;
+		dest = swap;
+	}
+
+	if (src != data->keys)
+		memcpy(data->keys, src, data->n * sizeof(MsgSortKey *));
+}
+
+#if USE_THREADS
+static gpointer procmsg_sort_keys_func(gpointer data)
+{
+	procmsg_sort_keys((MsgSortData *)data);
+	return NULL;
+}
+
+static gint procmsg_get_sort_threads(guint n)
+{
+	glong n_threads = 1;
+
+	if (n < PROCMSG_SORT_THREAD_MIN_MSGS || !g_thread_supported())
+		return 1;
+#ifdef _SC_NPROCESSORS_ONLN
+	n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return CLAMP(n_threads, 1, PROCMSG_SORT_THREAD_MAX);
+}
+
+/* sort the chunks in separate threads, then merge them pairwise */
+static void procmsg_sort_keys_parallel(MsgSortData *data, gint n_threads)
+{
+	MsgSortData chunks[PROCMSG_SORT_THREAD_MAX];
+	GThread *threads[PROCMSG_SORT_THREAD_MAX];
+	guint bounds[PROCMSG_SORT_THREAD_MAX + 1];
+	MsgSortKey **src = data->keys, **dest = data->tmp, **swap;
+	gint n_chunks = n_threads;
+	gint i;
+
+	for (i = 0; i <= n_threads; i++)
+		bounds[i] = (guint)((guint64)data->n * i / n_threads);
+
+	for (i = 0; i < n_threads; i++) {
+		chunks[i] = *data;
+		chunks[i].keys = data->keys + bounds[i];
+		chunks[i].tmp = data->tmp + bounds[i];
+		chunks[i].n = bounds[i + 1] - bounds[i];
+		threads[i] = g_thread_create(procmsg_sort_keys_func,
+					     &chunks[i], TRUE, NULL);
+		if (!threads[i])
+			procmsg_sort_keys(&chunks[i]);
+	}
+	for (i = 0; i < n_threads; i++) {
+		if (threads[i])
+			g_thread_join(threads[i]);
+	}
+
+	while (n_chunks > 1) {
+		gint j = 0;
+
+		for (i = 0; i < n_chunks; i += 2, j++) {
+			guint start = bounds[i];
+			guint mid = bounds[MIN(i + 1, n_chunks)];
+			guint end = bounds[MIN(i + 2, n_chunks)];
+
+			procmsg_sort_merge(dest + start, src + start,
+					   mid - start, end - start,
+					   data->type, data->dir);
+			bounds[j] = start;
+		}
+		bounds[j] = data->n;
+		n_chunks = j;
+		swap = src;
+		src = dest;
+		dest = swap;
+	}
+
+	if (src != data->keys)
+		memcpy(data->keys, src, data->n * sizeof(MsgSortKey *));
+}
+#endif /* USE_THREADS */
+
+/* append the lowercased string to the heap and return its offset + 1,
+   or 0 if the string is NULL */
+static gsize procmsg_sort_heap_add(GString *heap, const gchar *str,
+				   gboolean is_subject)
+{
+	gsize offset;
+	gchar *p;
+
+	if (!str)
+		return 0;
+
+	offset = heap->len;
+	g_string_append(heap, str);
+	g_string_append_c(heap, '\0');
+
+	p = heap->str + offset;
+	if (is_subject)
+		trim_subject_for_sort(p);
+	for (; *p != '\0'; p++)
+		*p = g_ascii_tolower(*p);
+
+	return offset + 1;
+}
 
 GSList *procmsg_sort_msg_list(GSList *mlist, FolderSortKey sort_key,
 			      FolderSortType sort_type)
 {
-	GCompareFunc cmp_func;
+	MsgSortData data;
+	MsgSortKey *keys;
+	GString *heap = NULL;
+	GSList *cur;
+	guint i;
 
 	switch (sort_key) {
 	case SORT_BY_MARK:
-		cmp_func = procmsg_cmp_by_mark; break;
 	case SORT_BY_UNREAD:
-		cmp_func = procmsg_cmp_by_unread; break;
 	case SORT_BY_MIME:
-		cmp_func = procmsg_cmp_by_mime; break;
 	case SORT_BY_LABEL:
-		cmp_func = procmsg_cmp_by_label; break;
-	case SORT_BY_NUMBER:
-		cmp_func = procmsg_cmp_by_number; break;
 	case SORT_BY_SIZE:
-		cmp_func = procmsg_cmp_by_size; break;
+		data.type = SORT_KEY_VAL_DATE; break;
+	case SORT_BY_NUMBER:
 	case SORT_BY_DATE:
-		cmp_func = procmsg_cmp_by_date; break;
+		data.type = SORT_KEY_VAL; break;
 	case SORT_BY_FROM:
-		cmp_func = procmsg_cmp_by_from; break;
 	case SORT_BY_SUBJECT:
-		cmp_func = procmsg_cmp_by_subject; break;
 	case SORT_BY_TO:
-		cmp_func = procmsg_cmp_by_to; break;
+		data.type = SORT_KEY_STR; break;
 	default:
 		return mlist;
 	}
 
-	cmp_func_sort_type = sort_type;
+	data.n = g_slist_length(mlist);
+	if (data.n < 2)
+		return mlist;
+	data.dir = (sort_type == SORT_ASCENDING) ? 1 : -1;
+
+	/* normalize every key once instead of on each comparison */
+	keys = g_new(MsgSortKey, data.n);
+	if (data.type == SORT_KEY_STR)
+		heap = g_string_sized_new(data.n * 32);
+
+	for (cur = mlist, i = 0; cur != NULL; cur = cur->next, i++) {
+		MsgInfo *msginfo = (MsgInfo *)cur->data;
+		MsgSortKey *key = &keys[i];
+
+		key->msginfo = msginfo;
+		key->str = NULL;
+		key->val = 0;
+		key->date_t = msginfo->date_t;
+
+		switch (sort_key) {
+		case SORT_BY_MARK:
+			key->val = MSG_IS_MARKED(msginfo->flags) != 0; break;
+		case SORT_BY_UNREAD:
+			key->val = MSG_IS_UNREAD(msginfo->flags) != 0; break;
+		case SORT_BY_MIME:
+			key->val = MSG_IS_MIME(msginfo->flags) != 0; break;
+		case SORT_BY_LABEL:
+			key->val = MSG_GET_COLORLABEL(msginfo->flags); break;
+		case SORT_BY_SIZE:
+			key->val = msginfo->size; break;
+		case SORT_BY_NUMBER:
+			key->val = msginfo->msgnum; break;
+		case SORT_BY_DATE:
+			key->val = msginfo->date_t; break;
+		case SORT_BY_FROM:
+			key->str = (const gchar *)procmsg_sort_heap_add
+				(heap, msginfo->fromname, FALSE); break;
+		case SORT_BY_SUBJECT:
+			key->str = (const gchar *)procmsg_sort_heap_add
+				(heap, msginfo->subject, TRUE); break;
+		case SORT_BY_TO:
+			key->str = (const gchar *)procmsg_sort_heap_add
+				(heap, msginfo->to, FALSE); break;
+		default:
+			break;
+		}
+	}
+
+	/* the heap may have been moved while growing */
+	if (heap) {
+		for (i = 0; i < data.n; i++) {
+			gsize offset = (gsize)keys[i].str;
+
+			keys[i].str = offset ? heap->str + offset - 1 : NULL;
+		}
+	}
 
-	mlist = g_slist_sort(mlist, cmp_func);
+	data.keys = g_new(MsgSortKey *, data.n);
+	data.tmp = g_new(MsgSortKey *, data.n);
+	for (i = 0; i < data.n; i++)
+		data.keys[i] = &keys[i];
+
+#if USE_THREADS
+	{
+		gint n_threads = procmsg_get_sort_threads(data.n);
+
+		if (n_threads > 1)
+			procmsg_sort_keys_parallel(&data, n_threads);
+		else
+			procmsg_sort_keys(&data);
+	}
+#else
+	procmsg_sort_keys(&data);
+#endif
+
+	/* reorder the list in place */
+	for (cur = mlist, i = 0; cur != NULL; cur = cur->next, i++)
+		cur->data = data.keys[i]->msginfo;
+
+	g_free(data.tmp);
+	g_free(data.keys);
+	g_free(keys);
+	if (heap)
+		g_string_free(heap, TRUE);
 
 	return mlist;
 }
@@ -596,6 +1315,114 @@ void procmsg_write_cache(MsgInfo *msginfo, FILE *fp)
 	}
 }
 
+static guint32 procmsg_cache_heap_add(GString *heap, GHashTable *heap_table,
+				      const gchar *str)
+{
+	gpointer offset;
+
+	if (!str || *str == '\0')
+		return 0;
+
+	if ((offset = g_hash_table_lookup(heap_table, str)) != NULL)
+		return GPOINTER_TO_UINT(offset);
+
+	offset = GUINT_TO_POINTER(heap->len);
+	g_string_append_len(heap, str, strlen(str) + 1);
+	g_hash_table_insert(heap_table, (gpointer)str, offset);
+
+	return GPOINTER_TO_UINT(offset);
+}
+
+static int procmsg_cmp_msgnum_ptr(const void *a, const void *b)
+{
+	const MsgInfo *msginfo1 = *(const MsgInfo **)a;
+	const MsgInfo *msginfo2 = *(const MsgInfo **)b;
+
+	if (msginfo1->msgnum < msginfo2->msgnum)
+		return -1;
+	return msginfo1->msgnum > msginfo2->msgnum;
+}
+
+static void procmsg_write_cache_index(GSList *mlist, FILE *fp)
+{
+	MsgInfo **msgs;
+	guint32 *cols;
+	GArray *refs;
+	GString *heap;
+	GHashTable *heap_table;
+	guint32 hdr[3];
+	guint n, i;
+	GSList *cur;
+
+	n = g_slist_length(mlist);
+	msgs = g_new(MsgInfo *, n);
+	for (cur = mlist, i = 0; cur != NULL; cur = cur->next, i++)
+		msgs[i] = (MsgInfo *)cur->data;
+	qsort(msgs, n, sizeof(MsgInfo *), procmsg_cmp_msgnum_ptr);
+
+	cols = g_new(guint32, (gsize)n * CACHE_COL_N);
+	refs = g_array_new(FALSE, FALSE, sizeof(guint32));
+	heap = g_string_sized_new(n * 128 + 1);
+	/* offset 0 means NULL */
+	g_string_append_c(heap, '\0');
+	/* identical strings (e.g. on mailing lists) are stored once */
+	heap_table = g_hash_table_new(g_str_hash, g_str_equal);
+
+#define SET_COL(col, val)	cols[(gsize)(col) * n + i] = (val)
+#define SET_STR(col, str)	\
+	SET_COL(col, procmsg_cache_heap_add(heap, heap_table, str))
+
+	for (i = 0; i < n; i++) {
+		MsgInfo *msginfo = msgs[i];
+		guint32 ref;
+
+		SET_COL(CACHE_COL_MSGNUM, msginfo->msgnum);
+		SET_COL(CACHE_COL_SIZE, msginfo->size);
+		SET_COL(CACHE_COL_MTIME, msginfo->mtime);
+		SET_COL(CACHE_COL_DATE_T, msginfo->date_t);
+		SET_COL(CACHE_COL_FLAGS,
+			msginfo->flags.tmp_flags & MSG_CACHED_FLAG_MASK);
+
+		SET_STR(CACHE_COL_FROMNAME, msginfo->fromname);
+
+		SET_STR(CACHE_COL_DATE, msginfo->date);
+		SET_STR(CACHE_COL_FROM, msginfo->from);
+		SET_STR(CACHE_COL_TO, msginfo->to);
+		SET_STR(CACHE_COL_NEWSGROUPS, msginfo->newsgroups);
+		SET_STR(CACHE_COL_SUBJECT, msginfo->subject);
+		SET_STR(CACHE_COL_MSGID, msginfo->msgid);
+		SET_STR(CACHE_COL_INREPLYTO, msginfo->inreplyto);
+
+		SET_COL(CACHE_COL_REF_INDEX, refs->len);
+		for (cur = msginfo->references; cur != NULL; cur = cur->next) {
+			ref = procmsg_cache_heap_add(heap, heap_table,
+						     (gchar *)cur->data);
+			g_array_append_val(refs, ref);
+		}
+		SET_COL(CACHE_COL_REF_NUM,
+			refs->len - cols[(gsize)CACHE_COL_REF_INDEX * n + i]);
+	}
+
+#undef SET_STR
+#undef SET_COL
+
+	hdr[0] = n;
+	hdr[1] = refs->len;
+	hdr[2] = heap->len;
+	fwrite(hdr, sizeof(hdr), 1, fp);
+	if (n > 0)
+		fwrite(cols, sizeof(guint32), (gsize)n * CACHE_COL_N, fp);
+	if (refs->len > 0)
+		fwrite(refs->data, sizeof(guint32), refs->len, fp);
+	fwrite(heap->str, heap->len, 1, fp);
+
+	g_hash_table_destroy(heap_table);
+	g_string_free(heap, TRUE);
+	g_array_free(refs, TRUE);
+	g_free(cols);
+	g_free(msgs);
+}
+
 void procmsg_write_flags(MsgInfo *msginfo, FILE *fp)
 {
 	MsgPermFlags flags = msginfo->flags.perm_flags;
@@ -606,27 +1433,43 @@ void procmsg_write_flags(MsgInfo *msginfo, FILE *fp)
 
 void procmsg_write_cache_list(FolderItem *item, GSList *mlist)
 {
+	gchar *cachefile;
+	gchar *tmpfile;
 	FILE *fp;
-	GSList *cur;
 
 	g_return_if_fail(item != NULL);
 
 	debug_print("Writing summary cache (%s)\n", item->path);
 
-	fp = procmsg_open_cache_file(item, DATA_WRITE);
-	if (fp == NULL)
+	/* the strings of mlist may point into a mapping of the current
+	   cache file, so the new one is written aside and renamed over it.
+	   the mapping keeps the old inode */
+	cachefile = folder_item_get_cache_file(item);
+	tmpfile = g_strconcat(cachefile, ".tmp", NULL);
+	fp = procmsg_open_data_file(tmpfile, CACHE_VERSION, DATA_WRITE,
+				    NULL, 0);
+	if (fp == NULL) {
+		g_free(tmpfile);
+		g_free(cachefile);
 		return;
-
-	for (cur = mlist; cur != NULL; cur = cur->next) {
-		MsgInfo *msginfo = (MsgInfo *)cur->data;
-		procmsg_write_cache(msginfo, fp);
 	}
 
+	procmsg_write_cache_index(mlist, fp);
+
 	if (item->cache_queue)
 		procmsg_flush_cache_queue(item, fp);
 
-	fclose(fp);
-	item->cache_dirty = FALSE;
+	if (fclose(fp) == EOF) {
+		FILE_OP_ERROR(tmpfile, "fclose");
+		g_unlink(tmpfile);
+	} else if (rename_force(tmpfile, cachefile) < 0) {
+		FILE_OP_ERROR(tmpfile, "rename");
+		g_unlink(tmpfile);
+	} else
+		item->cache_dirty = FALSE;
+
+	g_free(tmpfile);
+	g_free(cachefile);
 }
 
 void procmsg_write_flags_list(FolderItem *item, GSList *mlist)
@@ -642,16 +1485,78 @@ void procmsg_write_flags_list(FolderItem *item, GSList *mlist)
 	if (fp == NULL)
 		return;
 
+	item->mark_records = 0;
+	for (cur = mlist; cur != NULL; cur = cur->next) {
+		MsgInfo *msginfo = (MsgInfo *)cur->data;
+		procmsg_write_flags(msginfo, fp);
+		item->mark_records++;
+	}
+
+	if (item->mark_queue)
+		procmsg_flush_mark_queue(item, fp);
+
+	fclose(fp);
+	item->mark_dirty = FALSE;
+}
+
+/* appends the flags changed since they were last written, without
+   reading the mark file */
+void procmsg_append_flags_list(FolderItem *item, GSList *mlist)
+{
+	GSList *changed = NULL, *cur;
+	guint n_live = 0, n_changed = 0;
+	FILE *fp;
+
+	g_return_if_fail(item != NULL);
+
+	/* the number of records is unknown, or the file is empty */
+	if (item->mark_records == 0) {
+		procmsg_write_flags_list(item, mlist);
+		return;
+	}
+
 	for (cur = mlist; cur != NULL; cur = cur->next) {
 		MsgInfo *msginfo = (MsgInfo *)cur->data;
-		procmsg_write_flags(msginfo, fp);
+
+		n_live++;
+		if (MSG_IS_FLAG_CHANGED(msginfo->flags)) {
+			changed = g_slist_prepend(changed, msginfo);
+			n_changed++;
+		}
 	}
 
-	if (item->mark_queue)
-		procmsg_flush_mark_queue(item, fp);
+	if (procmsg_mark_file_need_compact
+		(item->mark_records + n_changed +
+		 g_slist_length(item->mark_queue), n_live)) {
+		debug_print("compacting mark file: %s (%u records, "
+			    "%u messages)\n", item->path, item->mark_records,
+			    n_live);
+		procmsg_write_flags_list(item, mlist);
+	} else if (changed || item->mark_queue) {
+		debug_print("Appending %u changed flags (%s)\n",
+			    n_changed, item->path);
 
-	fclose(fp);
-	item->mark_dirty = FALSE;
+		fp = procmsg_open_mark_file(item, DATA_APPEND);
+		if (!fp) {
+			g_slist_free(changed);
+			return;
+		}
+		changed = g_slist_reverse(changed);
+		for (cur = changed; cur != NULL; cur = cur->next)
+			procmsg_write_flags((MsgInfo *)cur->data, fp);
+		item->mark_records += n_changed;
+		if (item->mark_queue)
+			procmsg_flush_mark_queue(item, fp);
+		fclose(fp);
+		item->mark_dirty = FALSE;
+	} else
+		item->mark_dirty = FALSE;
+
+	for (cur = changed; cur != NULL; cur = cur->next) {
+		MsgInfo *msginfo = (MsgInfo *)cur->data;
+		MSG_UNSET_TMP_FLAGS(msginfo->flags, MSG_FLAG_CHANGED);
+	}
+	g_slist_free(changed);
 }
 
 static gint cmp_by_item(gconstpointer a, gconstpointer b)
@@ -692,6 +1597,9 @@ void procmsg_write_flags_for_multiple_folders(GSList *mlist)
 			item->updated = TRUE;
 		}
 		procmsg_write_flags(msginfo, fp);
+		/* 0 means the number of records is unknown */
+		if (item->mark_records > 0)
+			item->mark_records++;
 		prev_item = item;
 	}
 
@@ -729,6 +1637,7 @@ void procmsg_flush_mark_queue(FolderItem *item, FILE *fp)
 		msginfo.msgnum = flaginfo->msgnum;
 		msginfo.flags = flaginfo->flags;
 		procmsg_write_flags(&msginfo, fp);
+		item->mark_records++;
 		g_free(flaginfo);
 	}
 
@@ -927,7 +1836,7 @@ void procmsg_get_mark_sum(FolderItem *item,
 	marksum.max    = max;
 	marksum.first  = first;
 
-	mark_table = procmsg_read_mark_file(item);
+	mark_table = procmsg_read_mark_file(item, NULL);
 
 	if (mark_table) {
 		g_hash_table_foreach(mark_table, mark_sum_func, &marksum);
@@ -935,12 +1844,38 @@ void procmsg_get_mark_sum(FolderItem *item,
 	}
 }
 
-static GHashTable *procmsg_read_mark_file(FolderItem *item)
+/* The mark file is a journal: records are appended whenever flags change,
+   and the last record of each message wins. It is compacted when stale
+   records outnumber the live ones. */
+#define MARK_COMPACT_MIN_RECORDS	1024
+
+static gboolean procmsg_mark_file_need_compact(guint n_records, guint n_live)
+{
+	return n_records > MARK_COMPACT_MIN_RECORDS && n_records > n_live * 2;
+}
+
+static void mark_unset_new_write_func(gpointer key, gpointer value,
+				      gpointer data)
+{
+	MsgFlags *flags = (MsgFlags *)value;
+	MsgInfo msginfo;
+
+	if (!MSG_IS_NEW(*flags))
+		return;
+
+	MSG_UNSET_PERM_FLAGS(*flags, MSG_NEW);
+	msginfo.msgnum = GPOINTER_TO_UINT(key);
+	msginfo.flags.perm_flags = flags->perm_flags;
+	procmsg_write_flags(&msginfo, (FILE *)data);
+}
+
+static GHashTable *procmsg_read_mark_file(FolderItem *item, guint *n_records)
 {
 	FILE *fp;
 	GHashTable *mark_table = NULL;
 	guint32 idata;
 	guint num;
+	guint n = 0;
 	MsgFlags *flags;
 	MsgPermFlags perm_flags;
 	GSList *cur;
@@ -954,6 +1889,7 @@ static GHashTable *procmsg_read_mark_file(FolderItem *item)
 		num = idata;
 		if (fread(&idata, sizeof(idata), 1, fp) != 1) break;
 		perm_flags = idata;
+		n++;
 
 		flags = g_hash_table_lookup(mark_table, GUINT_TO_POINTER(num));
 		if (flags != NULL)
@@ -967,8 +1903,18 @@ static GHashTable *procmsg_read_mark_file(FolderItem *item)
 
 	fclose(fp);
 
+	fp = NULL;
 	if (item->mark_queue) {
-		g_hash_table_foreach(mark_table, mark_unset_new_func, NULL);
+		/* the queue is journaled with the unset new flags when the
+		   folder is not opened */
+		if (!item->opened)
+			fp = procmsg_open_mark_file(item, DATA_APPEND);
+		if (fp)
+			g_hash_table_foreach(mark_table,
+					     mark_unset_new_write_func, fp);
+		else
+			g_hash_table_foreach(mark_table, mark_unset_new_func,
+					     NULL);
 		item->mark_dirty = TRUE;
 	}
 
@@ -988,35 +1934,17 @@ static GHashTable *procmsg_read_mark_file(FolderItem *item)
 				    
 	}
 
-	if (item->mark_queue && !item->opened) {
-		procmsg_write_mark_file(item, mark_table);
-		procmsg_flaginfo_list_free(item->mark_queue);
-		item->mark_queue = NULL;
+	item->mark_records = n;
+	if (fp) {
+		procmsg_flush_mark_queue(item, fp);
+		fclose(fp);
 		item->mark_dirty = FALSE;
 	}
 
-	return mark_table;
-}
-
-static void write_mark_func(gpointer key, gpointer value, gpointer data)
-{
-	MsgInfo msginfo;
-
-	msginfo.msgnum = GPOINTER_TO_UINT(key);
-	msginfo.flags.perm_flags = ((MsgFlags *)value)->perm_flags;
-	procmsg_write_flags(&msginfo, (FILE *)data);
-}
-
-static void procmsg_write_mark_file(FolderItem *item, GHashTable *mark_table)
-{
-	FILE *fp;
+	if (n_records)
+		*n_records = item->mark_records;
 
-	if ((fp = procmsg_open_mark_file(item, DATA_WRITE)) == NULL) {
-		g_warning("procmsg_write_mark_file: cannot open mark file.");
-		return;
-	}
-	g_hash_table_foreach(mark_table, write_mark_func, fp);
-	fclose(fp);
+	return mark_table;
 }
 
 FILE *procmsg_open_data_file(const gchar *file, guint version,
@@ -1101,7 +2029,9 @@ FILE *procmsg_open_data_file(const gchar *file, guint version,
 }
 
 static GMappedFile *procmsg_open_cache_file_mmap(FolderItem *item,
-						 DataOpenMode mode)
+						 DataOpenMode mode,
+						 guint32 *version,
+						 gboolean *zero_copy)
 {
 	gchar *cachefile;
 	GMappedFile *map = NULL;
@@ -1137,7 +2067,20 @@ static GMappedFile *procmsg_open_cache_file_mmap(FolderItem *item,
 		}
 		p = g_mapped_file_get_contents(map);
 		data_ver = *(guint32 *)p;
-		if (CACHE_VERSION != data_ver) {
+		if (data_ver == OLD_CACHE_VERSION && *zero_copy) {
+			GMappedFile *wmap;
+
+			/* strings of the old format are not terminated.
+			   a private (copy-on-write) mapping is required to
+			   use them in place */
+			wmap = g_mapped_file_new(cachefile, TRUE, NULL);
+			if (wmap) {
+				g_mapped_file_free(map);
+				map = wmap;
+			} else
+				*zero_copy = FALSE;
+		} else if (CACHE_VERSION != data_ver &&
+			   OLD_CACHE_VERSION != data_ver) {
 			g_message("%s: Mark/Cache version is different (%u != %u). Discarding it.\n",
 				  cachefile, data_ver, CACHE_VERSION);
 			g_mapped_file_free(map);
@@ -1147,6 +2090,7 @@ static GMappedFile *procmsg_open_cache_file_mmap(FolderItem *item,
 		g_free(cachefile);
 	}
 
+	*version = data_ver;
 	return map;
 }
 
@@ -1156,12 +2100,29 @@ FILE *procmsg_open_cache_file(FolderItem *item, DataOpenMode mode)
 	FILE *fp;
 
 	cachefile = folder_item_get_cache_file(item);
+
+	/* records can be appended only after a valid index */
+	if (mode == DATA_APPEND) {
+		fp = procmsg_open_data_file(cachefile, CACHE_VERSION,
+					    DATA_READ, NULL, 0);
+		if (fp)
+			fclose(fp);
+		else
+			mode = DATA_WRITE;
+	}
+
+	/* the old file may be mapped by the zero-copy reader. creating a
+	   new inode leaves the mapping valid */
+	if (mode == DATA_WRITE && is_file_exist(cachefile))
+		g_unlink(cachefile);
+
 	fp = procmsg_open_data_file(cachefile, CACHE_VERSION, mode, NULL, 0);
+	if (fp && mode == DATA_WRITE)
+		procmsg_write_cache_index(NULL, fp);
 	g_free(cachefile);
 
 	return fp;
 }
-
 FILE *procmsg_open_mark_file(FolderItem *item, DataOpenMode mode)
 {
 	gchar *markfile;
@@ -1174,6 +2135,16 @@ FILE *procmsg_open_mark_file(FolderItem *item, DataOpenMode mode)
 	return fp;
 }
 
+static void procmsg_clear_thread_index(FolderItem *item)
+{
+	gchar *file;
+
+	file = procmsg_get_thread_file(item);
+	if (file && is_file_exist(file))
+		g_unlink(file);
+	g_free(file);
+}
+
 void procmsg_clear_cache(FolderItem *item)
 {
 	FILE *fp;
@@ -1181,6 +2152,9 @@ void procmsg_clear_cache(FolderItem *item)
 	fp = procmsg_open_cache_file(item, DATA_WRITE);
 	if (fp)
 		fclose(fp);
+	procmsg_clear_thread_index(item);
+	body_index_clear(item);
+	item->highest_modseq = 0;
 }
 
 void procmsg_clear_mark(FolderItem *item)
@@ -1190,69 +2164,425 @@ void procmsg_clear_mark(FolderItem *item)
 	fp = procmsg_open_mark_file(item, DATA_WRITE);
 	if (fp)
 		fclose(fp);
+	item->mark_records = 0;
 }
 
 /* return the reversed thread tree */
 GNode *procmsg_get_thread_tree(GSList *mlist)
 {
-	GNode *root, *parent, *node, *next;
-	GHashTable *table;
-	MsgInfo *msginfo;
-	const gchar *msgid;
-	GSList *reflist;
+	MsgThreader *threader;
+	GNode *root;
 
-	root = g_node_new(NULL);
-	table = g_hash_table_new(g_str_hash, g_str_equal);
+	threader = procthread_new(prefs_common.thread_by_subject);
 
-	for (; mlist != NULL; mlist = mlist->next) {
-		msginfo = (MsgInfo *)mlist->data;
-		parent = root;
+	for (; mlist != NULL; mlist = mlist->next)
+		procthread_insert(threader, (MsgInfo *)mlist->data);
+
+	root = procthread_get_tree(threader);
+	procthread_free(threader);
+
+	return root;
+}
+
+/* thread index: flags, number of entries, and (msgnum, parent msgnum,
+   msgid hash) for each message */
+#define THREAD_ENTRY_SIZE	3
+
+/* the index is discarded if it was built with other settings */
+#define THREAD_INDEX_BY_SUBJECT	(1 << 0)
+
+static guint32 procmsg_thread_index_flags(void)
+{
+	return prefs_common.thread_by_subject ? THREAD_INDEX_BY_SUBJECT : 0;
+}
+
+static gchar *procmsg_get_thread_file(FolderItem *item)
+{
+	gchar *path;
+	gchar *file;
+
+	path = folder_item_get_path(item);
+	g_return_val_if_fail(path != NULL, NULL);
+	if (!is_dir_exist(path))
+		make_dir_hier(path);
+	file = g_strconcat(path, G_DIR_SEPARATOR_S, THREAD_FILE, NULL);
+	g_free(path);
+
+	return file;
+}
+
+static guint32 procmsg_thread_id_hash(const MsgInfo *msginfo)
+{
+	return msginfo->msgid ? g_str_hash(msginfo->msgid) : 0;
+}
+
+static guint32 *procmsg_read_thread_index(FolderItem *item, guint *n_entries)
+{
+	gchar *file;
+	FILE *fp;
+	guint32 flags, n;
+	guint32 *entries;
+
+	file = procmsg_get_thread_file(item);
+	if (!file)
+		return NULL;
+	fp = procmsg_open_data_file(file, THREAD_VERSION, DATA_READ, NULL, 0);
+	g_free(file);
+	if (!fp)
+		return NULL;
 
-		/* only look for the real parent first */
-		if (msginfo->inreplyto) {
-			parent = g_hash_table_lookup(table, msginfo->inreplyto);
-			if (parent == NULL)
-				parent = root;
+	if (fread(&flags, sizeof(flags), 1, fp) != 1 ||
+	    fread(&n, sizeof(n), 1, fp) != 1) {
+		fclose(fp);
+		return NULL;
+	}
+	if (flags != procmsg_thread_index_flags()) {
+		debug_print("%s: thread settings changed\n", item->path);
+		fclose(fp);
+		return NULL;
+	}
+	entries = g_new(guint32, (gsize)n * THREAD_ENTRY_SIZE + 1);
+	if (fread(entries, sizeof(guint32) * THREAD_ENTRY_SIZE, n, fp) != n) {
+		g_warning("%s: thread index is corrupted\n", item->path);
+		g_free(entries);
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+
+	*n_entries = n;
+	return entries;
+}
+
+static gboolean procmsg_write_thread_entry(GNode *node, gpointer data)
+{
+	FILE *fp = (FILE *)data;
+	MsgInfo *msginfo = (MsgInfo *)node->data;
+	MsgInfo *parent;
+	guint parent_num = 0;
+
+	if (!msginfo)
+		return FALSE;
+
+	parent = (MsgInfo *)node->parent->data;
+	if (parent)
+		parent_num = parent->msgnum;
+	WRITE_CACHE_DATA_INT(msginfo->msgnum, fp);
+	WRITE_CACHE_DATA_INT(parent_num, fp);
+	WRITE_CACHE_DATA_INT(procmsg_thread_id_hash(msginfo), fp);
+
+	return FALSE;
+}
+
+static void procmsg_write_thread_index(FolderItem *item, GNode *root)
+{
+	gchar *file;
+	FILE *fp;
+	guint n;
+
+	file = procmsg_get_thread_file(item);
+	if (!file)
+		return;
+
+	debug_print("Writing thread index: %s\n", file);
+
+	if ((fp = procmsg_open_data_file(file, THREAD_VERSION, DATA_WRITE,
+					 NULL, 0)) != NULL) {
+		n = g_node_n_nodes(root, G_TRAVERSE_ALL) - 1;
+		WRITE_CACHE_DATA_INT(procmsg_thread_index_flags(), fp);
+		WRITE_CACHE_DATA_INT(n, fp);
+		g_node_traverse(root, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+				procmsg_write_thread_entry, fp);
+		if (fclose(fp) == EOF) {
+			FILE_OP_ERROR(file, "fclose");
+			g_unlink(file);
 		}
+	}
 
-		node = g_node_insert_data_before
-			(parent, parent == root ? parent->children : NULL,
-			 msginfo);
-		if ((msgid = msginfo->msgid) &&
-		    g_hash_table_lookup(table, msgid) == NULL)
-			g_hash_table_insert(table, (gchar *)msgid, node);
-	}
-
-	/* complete the unfinished threads */
-	for (node = root->children; node != NULL; ) {
-		next = node->next;
-		msginfo = (MsgInfo *)node->data;
-		parent = NULL;
-
-		if (msginfo->inreplyto)
-			parent = g_hash_table_lookup(table, msginfo->inreplyto);
-
-		/* try looking for the indirect parent */
-		if (!parent && msginfo->references) {
-			for (reflist = msginfo->references;
-			     reflist != NULL; reflist = reflist->next)
-				if ((parent = g_hash_table_lookup
-					(table, reflist->data)) != NULL)
-					break;
+	g_free(file);
+}
+
+static void procmsg_thread_mark_ref(GHashTable *id_table, gboolean *rethread,
+				    const gchar *msgid)
+{
+	guint i;
+
+	if (msgid && (i = GPOINTER_TO_UINT
+		(g_hash_table_lookup(id_table, msgid))) > 0)
+		rethread[i - 1] = TRUE;
+}
+
+/* return TRUE if the message refers to one of the Message-IDs */
+static gboolean procmsg_thread_refers_to(const MsgInfo *msginfo,
+					 GHashTable *id_table)
+{
+	GSList *cur;
+
+	if (msginfo->inreplyto &&
+	    g_hash_table_lookup(id_table, msginfo->inreplyto))
+		return TRUE;
+	for (cur = msginfo->references; cur != NULL; cur = cur->next) {
+		if (g_hash_table_lookup(id_table, cur->data))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static gboolean procmsg_thread_subject_exist(GHashTable *subject_table,
+					     const MsgInfo *msginfo)
+{
+	gchar *base;
+	gboolean ret;
+
+	if (!msginfo->subject)
+		return FALSE;
+
+	base = procthread_get_base_subject(msginfo->subject);
+	ret = g_hash_table_lookup(subject_table, base) != NULL;
+	g_free(base);
+
+	return ret;
+}
+
+typedef struct _ThreadApplyData
+{
+	GHashTable *index_table;	/* MsgInfo -> index + 1 */
+	GNode **nodes;
+	GNode **parents;
+	GNode *root;
+} ThreadApplyData;
+
+/* move the new and the top-level messages to the parents given by the
+   thread engine. the other messages keep their indexed parents */
+static gboolean procmsg_thread_apply_func(GNode *tnode, gpointer data)
+{
+	ThreadApplyData *adata = (ThreadApplyData *)data;
+	GNode *node, *parent;
+	guint i, j;
+
+	if (!tnode->data || !tnode->parent->data)
+		return FALSE;
+
+	i = GPOINTER_TO_UINT(g_hash_table_lookup(adata->index_table,
+						 tnode->data)) - 1;
+	j = GPOINTER_TO_UINT(g_hash_table_lookup(adata->index_table,
+						 tnode->parent->data)) - 1;
+	if (adata->parents[i] != NULL && adata->parents[i] != adata->root)
+		return FALSE;
+
+	node = adata->nodes[i];
+	parent = adata->nodes[j];
+	if (node->parent != parent && parent != node &&
+	    !g_node_is_ancestor(node, parent)) {
+		g_node_unlink(node);
+		g_node_insert_before(parent, parent->children, node);
+	}
+
+	return FALSE;
+}
+
+/* return the same tree as procmsg_get_thread_tree(), using the parent
+   links stored in the thread index of the folder. Only the messages
+   that are not in the index (or whose parent was removed) and the
+   messages they may affect are threaded again, and the index is
+   rewritten if it changed. */
+GNode *procmsg_get_thread_tree_full(FolderItem *item, GSList *mlist)
+{
+	GNode *root, *node;
+	GNode **nodes, **parents;
+	guint32 *parent_nums;
+	GHashTable *entry_table, *num_table;
+	guint32 *entries;
+	guint n_entries = 0, n_matched = 0, n_new = 0;
+	guint n, i;
+	GSList *cur;
+
+	if (!item || !item->path || item->stype == F_VIRTUAL)
+		return procmsg_get_thread_tree(mlist);
+
+	entries = procmsg_read_thread_index(item, &n_entries);
+	if (!entries) {
+		root = procmsg_get_thread_tree(mlist);
+		procmsg_write_thread_index(item, root);
+		return root;
+	}
+
+	debug_print("Building threads from the thread index of %s ...\n",
+		    item->path);
+
+	entry_table = g_hash_table_new(NULL, NULL);
+	for (i = 0; i < n_entries; i++)
+		g_hash_table_insert
+			(entry_table,
+			 GUINT_TO_POINTER(entries[i * THREAD_ENTRY_SIZE]),
+			 &entries[i * THREAD_ENTRY_SIZE]);
+
+	n = g_slist_length(mlist);
+	root = g_node_new(NULL);
+	nodes = g_new(GNode *, n);
+	parents = g_new0(GNode *, n);
+	parent_nums = g_new(guint32, n);
+	num_table = g_hash_table_new(NULL, NULL);
+
+	/* only the messages that still match their index entry are
+	   registered, so that a reused number is never taken as a parent */
+	for (cur = mlist, i = 0; cur != NULL; cur = cur->next, i++) {
+		MsgInfo *msginfo = (MsgInfo *)cur->data;
+		guint32 *entry;
+
+		nodes[i] = g_node_new(msginfo);
+		entry = g_hash_table_lookup(entry_table,
+					    GUINT_TO_POINTER(msginfo->msgnum));
+		if (entry && entry[2] == procmsg_thread_id_hash(msginfo)) {
+			parent_nums[i] = entry[1];
+			g_hash_table_insert(num_table,
+					    GUINT_TO_POINTER(msginfo->msgnum),
+					    nodes[i]);
+			n_matched++;
+		} else
+			parent_nums[i] = G_MAXUINT32;
+	}
+
+	g_hash_table_destroy(entry_table);
+	g_free(entries);
+
+	/* parents[i] == NULL means that the message must be threaded by
+	   Message-ID */
+	for (i = 0; i < n; i++) {
+		if (parent_nums[i] == 0)
+			parents[i] = root;
+		else if (parent_nums[i] != G_MAXUINT32)
+			parents[i] = g_hash_table_lookup
+				(num_table, GUINT_TO_POINTER(parent_nums[i]));
+	}
+
+	/* children keep the list order. a link which would make a cycle
+	   comes from a broken index, so the message is threaded again */
+	for (i = n; i > 0; i--) {
+		node = nodes[i - 1];
+		if (parents[i - 1] == root || parents[i - 1] == NULL)
+			continue;
+		if (parents[i - 1] == node ||
+		    g_node_is_ancestor(node, parents[i - 1])) {
+			debug_print("thread index: cycle at %u\n",
+				    ((MsgInfo *)node->data)->msgnum);
+			parents[i - 1] = NULL;
+			continue;
+		}
+		g_node_prepend(parents[i - 1], node);
+	}
+
+	/* top-level nodes are reversed */
+	for (i = 0; i < n; i++) {
+		if (parents[i] == root || parents[i] == NULL)
+			g_node_prepend(root, nodes[i]);
+		if (!parents[i])
+			n_new++;
+	}
+
+	if (n_new > 0) {
+		MsgThreader *threader;
+		GHashTable *id_table, *new_id_table;
+		GHashTable *subject_table = NULL;
+		ThreadApplyData adata;
+		gboolean *rethread;
+		GNode *tree;
+		gchar *base;
+
+		id_table = g_hash_table_new(g_str_hash, g_str_equal);
+		adata.index_table = g_hash_table_new(NULL, NULL);
+		for (i = 0; i < n; i++) {
+			MsgInfo *msginfo = (MsgInfo *)nodes[i]->data;
+
+			g_hash_table_insert(adata.index_table, msginfo,
+					    GUINT_TO_POINTER(i + 1));
+			if (msginfo->msgid &&
+			    !g_hash_table_lookup(id_table, msginfo->msgid))
+				g_hash_table_insert(id_table, msginfo->msgid,
+						    GUINT_TO_POINTER(i + 1));
 		}
 
-		/* node should not be the parent, and node should not
-		   be an ancestor of parent (circular reference) */
-		if (parent && parent != node &&
-		    !g_node_is_ancestor(node, parent)) {
-			g_node_unlink(node);
-			g_node_insert_before
-				(parent, parent->children, node);
+		/* the new messages, the messages they refer to, and the
+		   top-level messages which refer to them or share their
+		   subject are threaded by the same engine as
+		   procmsg_get_thread_tree() */
+		rethread = g_new0(gboolean, n);
+		new_id_table = g_hash_table_new(g_str_hash, g_str_equal);
+		if (prefs_common.thread_by_subject)
+			subject_table = g_hash_table_new_full
+				(g_str_hash, g_str_equal, g_free, NULL);
+		for (i = 0; i < n; i++) {
+			MsgInfo *msginfo = (MsgInfo *)nodes[i]->data;
+
+			if (parents[i] != NULL)
+				continue;
+
+			rethread[i] = TRUE;
+			procmsg_thread_mark_ref(id_table, rethread,
+						msginfo->inreplyto);
+			for (cur = msginfo->references; cur != NULL;
+			     cur = cur->next)
+				procmsg_thread_mark_ref(id_table, rethread,
+							(gchar *)cur->data);
+			if (msginfo->msgid)
+				g_hash_table_insert(new_id_table,
+						    msginfo->msgid,
+						    GINT_TO_POINTER(1));
+			if (subject_table && msginfo->subject) {
+				base = procthread_get_base_subject
+					(msginfo->subject);
+				if (*base != '\0')
+					g_hash_table_replace
+						(subject_table, base,
+						 GINT_TO_POINTER(1));
+				else
+					g_free(base);
+			}
+		}
+		for (i = 0; i < n; i++) {
+			MsgInfo *msginfo = (MsgInfo *)nodes[i]->data;
+
+			if (parents[i] != root || rethread[i])
+				continue;
+			if (procmsg_thread_refers_to(msginfo, new_id_table) ||
+			    (subject_table &&
+			     procmsg_thread_subject_exist(subject_table,
+							  msginfo)))
+				rethread[i] = TRUE;
 		}
-		node = next;
+		g_hash_table_destroy(new_id_table);
+		if (subject_table)
+			g_hash_table_destroy(subject_table);
+
+		threader = procthread_new(prefs_common.thread_by_subject);
+		for (i = 0; i < n; i++) {
+			if (rethread[i])
+				procthread_insert(threader,
+						  (MsgInfo *)nodes[i]->data);
+		}
+		tree = procthread_get_tree(threader);
+		procthread_free(threader);
+
+		adata.nodes = nodes;
+		adata.parents = parents;
+		adata.root = root;
+		g_node_traverse(tree, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+				procmsg_thread_apply_func, &adata);
+
+		g_node_destroy(tree);
+		g_free(rethread);
+		g_hash_table_destroy(adata.index_table);
+		g_hash_table_destroy(id_table);
 	}
 
-	g_hash_table_destroy(table);
+	g_hash_table_destroy(num_table);
+	g_free(parent_nums);
+	g_free(parents);
+	g_free(nodes);
+
+	if (n_new > 0 || n_matched < n_entries)
+		procmsg_write_thread_index(item, root);
 
 	return root;
 }
@@ -1578,17 +2908,9 @@ FILE *procmsg_open_message_decrypted(MsgInfo *msginfo, MimeInfo **mimeinfo)
 
 gboolean procmsg_msg_exist(MsgInfo *msginfo)
 {
-	gchar *path;
-	gboolean ret;
-
 	if (!msginfo) return FALSE;
 
-	path = folder_item_get_path(msginfo->folder);
-	change_dir(path);
-	ret = !folder_item_is_msg_changed(msginfo->folder, msginfo);
-	g_free(path);
-
-	return ret;
+	return !folder_item_is_msg_changed(msginfo->folder, msginfo);
 }
 
 gboolean procmsg_trash_messages_exist(void)
@@ -2149,16 +3471,14 @@ static gboolean procmsg_get_flags(FolderItem *item, gint num,
 		if (fread(&idata, sizeof(idata), 1, fp) != 1)
 			break;
 		perm_flags = idata;
+		/* later records in the journal override earlier ones */
 		if (read_num == num) {
 			*flags = perm_flags;
 			found = TRUE;
-			break;
 		}
 	}
 
 	fclose(fp);
-	if (found)
-		return TRUE;
 
 	for (cur = item->mark_queue; cur != NULL; cur = cur->next) {
 		MsgFlagInfo *flaginfo = (MsgFlagInfo *)cur->data;
@@ -2207,6 +3527,23 @@ MsgInfo *procmsg_get_msginfo(FolderItem *item, gint num)
 	return msginfo;
 }
 
+/* move the MsgInfo out of its arena so that it does not keep the whole
+   arena alive. The old pointer must not be used after this */
+MsgInfo *procmsg_msginfo_promote(MsgInfo *msginfo)
+{
+	MsgInfo *newmsginfo;
+
+	if (msginfo == NULL || msginfo->arena == NULL)
+		return msginfo;
+
+	newmsginfo = g_new(MsgInfo, 1);
+	*newmsginfo = *msginfo;
+	newmsginfo->arena = NULL;
+	procmsg_arena_unref(msginfo->arena);
+
+	return newmsginfo;
+}
+
 MsgInfo *procmsg_msginfo_copy(MsgInfo *msginfo)
 {
 	MsgInfo *newmsginfo;
@@ -2312,24 +3649,107 @@ gboolean procmsg_msginfo_equal(MsgInfo *msginfo_a, MsgInfo *msginfo_b)
 	return FALSE;
 }
 
+/* interned strings are owned by msginfo->string_table */
+#define STRING_TABLE_CONTAINS(table, str)			\
+	((table) != NULL && (str) != NULL &&			\
+	 string_table_lookup_string((table), (str)) == (str))
+
+static gchar *procmsg_msginfo_intern_str(MsgInfo *msginfo, StringTable *table,
+					 gchar *str)
+{
+	gchar *istr;
+
+	if (!str || CACHE_MAP_CONTAINS(msginfo->cache_map, str) ||
+	    STRING_TABLE_CONTAINS(table, str))
+		return str;
+
+	istr = string_table_insert_string(table, str);
+	g_free(str);
+	return istr;
+}
+
+void procmsg_msginfo_intern(MsgInfo *msginfo)
+{
+	StringTable *table;
+	GSList *cur;
+
+	g_return_if_fail(msginfo != NULL);
+
+	/* keep interning into the table which already owns the strings */
+	table = msginfo->string_table;
+	if (!table && msginfo->folder && msginfo->folder->folder)
+		table = folder_get_string_table(msginfo->folder->folder);
+	if (!table)
+		return;
+	msginfo->string_table = table;
+
+#define INTERN(mmb) \
+	msginfo->mmb = procmsg_msginfo_intern_str(msginfo, table, msginfo->mmb)
+
+	INTERN(fromname);
+	INTERN(from);
+	INTERN(to);
+	INTERN(cc);
+	INTERN(newsgroups);
+	INTERN(inreplyto);
+
+#undef INTERN
+
+	for (cur = msginfo->references; cur != NULL; cur = cur->next)
+		cur->data = procmsg_msginfo_intern_str(msginfo, table,
+						       (gchar *)cur->data);
+}
+
+static void procmsg_msginfo_free_str(MsgInfo *msginfo, StringTable *table,
+				     gchar *str)
+{
+	if (!str || CACHE_MAP_CONTAINS(msginfo->cache_map, str))
+		return;
+	if (STRING_TABLE_CONTAINS(table, str))
+		string_table_free_string(table, str);
+	else
+		g_free(str);
+}
+
+/* replaces a string member, releasing the old value wherever it lives */
+void procmsg_msginfo_set_str(MsgInfo *msginfo, gchar **str,
+			     const gchar *value)
+{
+	gchar *old;
+
+	g_return_if_fail(msginfo != NULL);
+	g_return_if_fail(str != NULL);
+
+	old = *str;
+	*str = g_strdup(value);
+	procmsg_msginfo_free_str(msginfo, msginfo->string_table, old);
+}
+
 void procmsg_msginfo_free(MsgInfo *msginfo)
 {
+	StringTable *table;
+	GSList *cur;
+
 	if (msginfo == NULL) return;
 
+	table = msginfo->string_table;
+
 	g_free(msginfo->xface);
 
-	g_free(msginfo->fromname);
+	procmsg_msginfo_free_str(msginfo, table, msginfo->fromname);
 
-	g_free(msginfo->date);
-	g_free(msginfo->from);
-	g_free(msginfo->to);
-	g_free(msginfo->cc);
-	g_free(msginfo->newsgroups);
-	g_free(msginfo->subject);
-	g_free(msginfo->msgid);
-	g_free(msginfo->inreplyto);
+	procmsg_msginfo_free_str(msginfo, NULL, msginfo->date);
+	procmsg_msginfo_free_str(msginfo, table, msginfo->from);
+	procmsg_msginfo_free_str(msginfo, table, msginfo->to);
+	procmsg_msginfo_free_str(msginfo, table, msginfo->cc);
+	procmsg_msginfo_free_str(msginfo, table, msginfo->newsgroups);
+	procmsg_msginfo_free_str(msginfo, NULL, msginfo->subject);
+	procmsg_msginfo_free_str(msginfo, NULL, msginfo->msgid);
+	procmsg_msginfo_free_str(msginfo, table, msginfo->inreplyto);
 
-	slist_free_strings(msginfo->references);
+	for (cur = msginfo->references; cur != NULL; cur = cur->next)
+		procmsg_msginfo_free_str(msginfo, table,
+					 (gchar *)cur->data);
 	g_slist_free(msginfo->references);
 
 	g_free(msginfo->file_path);
@@ -2341,7 +3761,13 @@ void procmsg_msginfo_free(MsgInfo *msginfo)
 		g_free(msginfo->encinfo);
 	}
 
-	g_free(msginfo);
+	if (msginfo->cache_map)
+		procmsg_cache_map_unref(msginfo->cache_map);
+
+	if (msginfo->arena)
+		procmsg_arena_unref(msginfo->arena);
+	else
+		g_free(msginfo);
 }
 
 gint procmsg_cmp_msgnum_for_sort(gconstpointer a, gconstpointer b)
@@ -2354,93 +3780,3 @@ gint procmsg_cmp_msgnum_for_sort(gconstpointer a, gconstpointer b)
 
 	return msginfo1->msgnum - msginfo2->msgnum;
 }
-
-#define CMP_FUNC_DEF(func_name, val)					\
-static gint func_name(gconstpointer a, gconstpointer b)			\
-{									\
-	const MsgInfo *msginfo1 = a;					\
-	const MsgInfo *msginfo2 = b;					\
-	gint ret;							\
-									\
-	if (!msginfo1 || !msginfo2)					\
-		return 0;						\
-									\
-	ret = (val);							\
-	if (ret == 0)							\
-		ret = msginfo1->date_t - msginfo2->date_t;		\
-									\
-	return ret * (cmp_func_sort_type == SORT_ASCENDING ? 1 : -1);	\
-}
-
-CMP_FUNC_DEF(procmsg_cmp_by_mark,
-	     MSG_IS_MARKED(msginfo1->flags) - MSG_IS_MARKED(msginfo2->flags))
-CMP_FUNC_DEF(procmsg_cmp_by_unread,
-	     MSG_IS_UNREAD(msginfo1->flags) - MSG_IS_UNREAD(msginfo2->flags))
-CMP_FUNC_DEF(procmsg_cmp_by_mime,
-	     MSG_IS_MIME(msginfo1->flags) - MSG_IS_MIME(msginfo2->flags))
-CMP_FUNC_DEF(procmsg_cmp_by_label,
-	     MSG_GET_COLORLABEL(msginfo1->flags) -
-	     MSG_GET_COLORLABEL(msginfo2->flags))
-CMP_FUNC_DEF(procmsg_cmp_by_size, msginfo1->size - msginfo2->size)
-
-#undef CMP_FUNC_DEF
-#define CMP_FUNC_DEF(func_name, val)					\
-static gint func_name(gconstpointer a, gconstpointer b)			\
-{									\
-	const MsgInfo *msginfo1 = a;					\
-	const MsgInfo *msginfo2 = b;					\
-									\
-	if (!msginfo1 || !msginfo2)					\
-		return 0;						\
-									\
-	return (val) * (cmp_func_sort_type == SORT_ASCENDING ? 1 : -1);	\
-}
-
-CMP_FUNC_DEF(procmsg_cmp_by_number, msginfo1->msgnum - msginfo2->msgnum)
-CMP_FUNC_DEF(procmsg_cmp_by_date, msginfo1->date_t - msginfo2->date_t)
-
-#undef CMP_FUNC_DEF
-#define CMP_FUNC_DEF(func_name, var_name)				\
-static gint func_name(gconstpointer a, gconstpointer b)			\
-{									\
-	const MsgInfo *msginfo1 = a;					\
-	const MsgInfo *msginfo2 = b;					\
-	gint ret;							\
-									\
-	if (!msginfo1->var_name)					\
-		return (msginfo2->var_name != NULL) *			\
-			(cmp_func_sort_type == SORT_ASCENDING ? -1 : 1);\
-	if (!msginfo2->var_name)					\
-		return (cmp_func_sort_type == SORT_ASCENDING ? 1 : -1);	\
-									\
-	ret = g_ascii_strcasecmp					\
-		(msginfo1->var_name, msginfo2->var_name);		\
-	if (ret == 0)							\
-		ret = msginfo1->date_t - msginfo2->date_t;		\
-									\
-	return ret * (cmp_func_sort_type == SORT_ASCENDING ? 1 : -1);	\
-}
-
-CMP_FUNC_DEF(procmsg_cmp_by_from, fromname)
-CMP_FUNC_DEF(procmsg_cmp_by_to, to)
-
-#undef CMP_FUNC_DEF
-
-static gint procmsg_cmp_by_subject(gconstpointer a, gconstpointer b)
-{
-	const MsgInfo *msginfo1 = a;
-	const MsgInfo *msginfo2 = b;
-	gint ret;
-
-	if (!msginfo1->subject)
-		return (msginfo2->subject != NULL) *
-			(cmp_func_sort_type == SORT_ASCENDING ? -1 : 1);
-	if (!msginfo2->subject)
-		return (cmp_func_sort_type == SORT_ASCENDING ? 1 : -1);
-
-	ret = subject_compare_for_sort(msginfo1->subject, msginfo2->subject);
-	if (ret == 0)
-		ret = msginfo1->date_t - msginfo2->date_t;
-
-	return ret * (cmp_func_sort_type == SORT_ASCENDING ? 1 : -1);
-}
@@ -34,10 +34,13 @@ typedef struct _MsgInfo		MsgInfo;
 typedef struct _MsgFlags	MsgFlags;
 typedef struct _MsgFileInfo	MsgFileInfo;
 typedef struct _MsgEncryptInfo	MsgEncryptInfo;
+typedef struct _MsgCacheMap	MsgCacheMap;
+typedef struct _MsgArena		MsgArena;
 
 #include "folder.h"
 #include "procmime.h"
 #include "utils.h"
+#include "stringtable.h"
 
 typedef enum
 {
@@ -201,6 +204,20 @@ struct _MsgInfo
 
 	/* used only for encrypted (and signed) messages */
 	MsgEncryptInfo *encinfo;
+
+	/* summary cache mapping which the string members may point into.
+	   The string members may also be interned in string_table.
+	   They must not be freed or modified directly */
+	MsgCacheMap *cache_map;
+
+	/* string table of the Folder which owns the interned strings.
+	   It is recorded when interning, since the folder member may be
+	   changed or cleared before the MsgInfo is freed */
+	StringTable *string_table;
+
+	/* block arena which the MsgInfo itself is allocated from
+	   (see procmsg_msginfo_promote()) */
+	MsgArena *arena;
 };
 
 struct _MsgFileInfo
@@ -230,6 +247,8 @@ gint procmsg_read_cache_data_str	(FILE		*fp,
 
 GSList *procmsg_read_cache		(FolderItem	*item,
 					 gboolean	 scan_file);
+MsgInfo *procmsg_get_cached_msginfo	(FolderItem	*item,
+					 guint		 num);
 void	procmsg_set_flags		(GSList		*mlist,
 					 FolderItem	*item);
 void	procmsg_mark_all_read		(FolderItem	*item);
@@ -247,6 +266,8 @@ void	procmsg_write_cache_list	(FolderItem	*item,
 					 GSList		*mlist);
 void	procmsg_write_flags_list	(FolderItem	*item,
 					 GSList		*mlist);
+void	procmsg_append_flags_list	(FolderItem	*item,
+					 GSList		*mlist);
 void	procmsg_write_flags_for_multiple_folders
 					(GSList		*mlist);
 
@@ -293,6 +314,8 @@ void	procmsg_clear_cache		(FolderItem	*item);
 void	procmsg_clear_mark		(FolderItem	*item);
 
 GNode  *procmsg_get_thread_tree		(GSList		*mlist);
+GNode  *procmsg_get_thread_tree_full	(FolderItem	*item,
+					 GSList		*mlist);
 guint	procmsg_get_thread_date		(GNode		*node);
 
 gint	procmsg_move_messages		(GSList		*mlist);
@@ -343,6 +366,12 @@ gint	procmsg_concat_partial_messages	(GSList		*mlist,
 MsgInfo *procmsg_get_msginfo		(FolderItem	*item,
 					 gint		 num);
 
+void	 procmsg_msginfo_intern		(MsgInfo	*msginfo);
+void	 procmsg_msginfo_set_str	(MsgInfo	*msginfo,
+					 gchar	       **str,
+					 const gchar	*value);
+
+MsgInfo *procmsg_msginfo_promote	(MsgInfo	*msginfo);
 MsgInfo *procmsg_msginfo_copy		(MsgInfo	*msginfo);
 MsgInfo *procmsg_msginfo_get_full_info	(MsgInfo	*msginfo);
 gboolean procmsg_msginfo_equal		(MsgInfo	*msginfo_a,
@@ -0,0 +1,298 @@
+/*
+ * LibSylph -- E-Mail client library
+ * Copyright (C) 1999-2014 Hiroyuki Yamamoto
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Message threading based on the algorithm by Jamie Zawinski
+ * (http://www.jwz.org/doc/threading.html).
+ *
+ * Every Message-ID seen either as a message or in References gets a
+ * container. Containers of missing messages are kept as dummies, so
+ * that a message which arrives later fills its place and the replies
+ * already received are attached to it. A message can be inserted into
+ * an existing tree at any time, which only costs the cycle checks along
+ * the depth of the thread.
+ */
+
+#include "defs.h"
+
+#include <glib.h>
+#include <string.h>
+
+#include "procthread.h"
+#include "procmsg.h"
+#include "utils.h"
+
+/* messages more distant than this are not grouped by subject */
+#define SUBJECT_GROUP_MAX_TIME	(60 * 60 * 24 * 30)
+
+struct _MsgThreader
+{
+	/* node->data is the MsgInfo, or NULL for a dummy container */
+	GNode *root;
+	/* Message-ID -> container */
+	GHashTable *id_table;
+	/* base subject -> top-level container */
+	GHashTable *subject_table;
+	gboolean by_subject;
+};
+
+MsgThreader *procthread_new(gboolean by_subject)
+{
+	MsgThreader *threader;
+
+	threader = g_new0(MsgThreader, 1);
+	threader->root = g_node_new(NULL);
+	threader->id_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+						   g_free, NULL);
+	if (by_subject)
+		threader->subject_table = g_hash_table_new_full
+			(g_str_hash, g_str_equal, g_free, NULL);
+	threader->by_subject = by_subject;
+
+	return threader;
+}
+
+void procthread_free(MsgThreader *threader)
+{
+	if (!threader)
+		return;
+
+	g_node_destroy(threader->root);
+	g_hash_table_destroy(threader->id_table);
+	if (threader->subject_table)
+		g_hash_table_destroy(threader->subject_table);
+	g_free(threader);
+}
+
+static GNode *procthread_get_container(MsgThreader *threader,
+				       const gchar *msgid)
+{
+	GNode *node;
+
+	node = g_hash_table_lookup(threader->id_table, msgid);
+	if (!node) {
+		node = g_node_prepend_data(threader->root, NULL);
+		g_hash_table_insert(threader->id_table, g_strdup(msgid), node);
+	}
+
+	return node;
+}
+
+/* return TRUE if node was moved */
+static gboolean procthread_set_parent(MsgThreader *threader, GNode *node,
+				      GNode *parent)
+{
+	if (node->parent == parent)
+		return FALSE;
+	/* node must not be an ancestor of the new parent */
+	if (parent == node || g_node_is_ancestor(node, parent))
+		return FALSE;
+
+	g_node_unlink(node);
+	g_node_prepend(parent, node);
+	return TRUE;
+}
+
+static gboolean procthread_subject_is_reply(const gchar *subject)
+{
+	while (g_ascii_isspace(*subject))
+		subject++;
+	return g_ascii_strncasecmp(subject, "Re:", 3) == 0;
+}
+
+/* return the lowercased subject without "Re:" and the mailing list tag,
+   which is used to group the messages by subject */
+gchar *procthread_get_base_subject(const gchar *subject)
+{
+	gchar *base;
+
+	base = g_strdup(subject);
+	trim_subject_for_sort(base);
+	g_strdown(base);
+
+	return base;
+}
+
+/* group top-level messages which have the same base subject, and return
+   TRUE if a message other than node was moved */
+static gboolean procthread_group_by_subject(MsgThreader *threader,
+					    GNode *node)
+{
+	MsgInfo *msginfo = (MsgInfo *)node->data;
+	MsgInfo *top_msginfo;
+	GNode *top;
+	gchar *base;
+	gboolean is_reply;
+	gboolean moved = FALSE;
+
+	if (!msginfo->subject)
+		return FALSE;
+
+	base = procthread_get_base_subject(msginfo->subject);
+	if (*base == '\0') {
+		g_free(base);
+		return FALSE;
+	}
+
+	is_reply = procthread_subject_is_reply(msginfo->subject);
+	top = g_hash_table_lookup(threader->subject_table, base);
+	if (!top || top == node || top->parent != threader->root ||
+	    !top->data) {
+		g_hash_table_replace(threader->subject_table, base, node);
+		return FALSE;
+	}
+
+	top_msginfo = (MsgInfo *)top->data;
+	if (ABS(msginfo->date_t - top_msginfo->date_t) >
+	    SUBJECT_GROUP_MAX_TIME) {
+		g_hash_table_replace(threader->subject_table, base, node);
+		return FALSE;
+	}
+
+	if (is_reply) {
+		/* "Re: foo" goes under "foo" or the first "Re: foo" */
+		procthread_set_parent(threader, node, top);
+		g_free(base);
+	} else if (procthread_subject_is_reply(top_msginfo->subject)) {
+		/* "foo" arrived after the replies */
+		moved = procthread_set_parent(threader, top, node);
+		g_hash_table_replace(threader->subject_table, base, node);
+	} else
+		g_free(base);
+
+	return moved;
+}
+
+/* insert a message into the tree, and return the message under which it
+   should be shown, or NULL if it is a top-level message */
+MsgInfo *procthread_insert(MsgThreader *threader, MsgInfo *msginfo)
+{
+	return procthread_insert_full(threader, msginfo, NULL);
+}
+
+/* same as procthread_insert(), and *moved is set to TRUE if messages
+   already in the tree were moved under another message. They must be
+   placed again by the caller which shows the tree incrementally */
+MsgInfo *procthread_insert_full(MsgThreader *threader, MsgInfo *msginfo,
+				gboolean *moved)
+{
+	GNode *node = NULL, *prev = NULL, *parent;
+	GSList *refs, *cur;
+	const gchar *msgid = msginfo->msgid;
+	gboolean moved_ = FALSE;
+
+	g_return_val_if_fail(threader != NULL, NULL);
+
+	if (msgid && *msgid) {
+		node = g_hash_table_lookup(threader->id_table, msgid);
+		if (node && !node->data) {
+			/* the replies received before are adopted */
+			node->data = msginfo;
+			if (node->children)
+				moved_ = TRUE;
+		} else if (node)
+			/* duplicated Message-ID: thread it separately */
+			node = NULL;
+		else {
+			node = g_node_prepend_data(threader->root, msginfo);
+			g_hash_table_insert(threader->id_table,
+					    g_strdup(msgid), node);
+		}
+	}
+	if (!node)
+		node = g_node_prepend_data(threader->root, msginfo);
+
+	/* link the references from the oldest one. existing links are
+	   preferred, because they may come from the real messages */
+	refs = g_slist_reverse(g_slist_copy(msginfo->references));
+	if (msginfo->inreplyto &&
+	    (!msginfo->references ||
+	     strcmp(msginfo->inreplyto, msginfo->references->data) != 0))
+		refs = g_slist_append(refs, msginfo->inreplyto);
+
+	for (cur = refs; cur != NULL; cur = cur->next) {
+		GNode *ref_node;
+
+		if (msgid && !strcmp((gchar *)cur->data, msgid))
+			continue;
+		ref_node = procthread_get_container(threader, cur->data);
+		if (prev && ref_node->parent == threader->root &&
+		    procthread_set_parent(threader, ref_node, prev) &&
+		    (ref_node->data || ref_node->children))
+			moved_ = TRUE;
+		prev = ref_node;
+	}
+	g_slist_free(refs);
+
+	/* the nearest reference (In-Reply-To first) becomes the parent */
+	if (prev)
+		procthread_set_parent(threader, node, prev);
+
+	if (threader->by_subject && node->parent == threader->root &&
+	    procthread_group_by_subject(threader, node))
+		moved_ = TRUE;
+
+	if (moved)
+		*moved = moved_;
+
+	for (parent = node->parent; parent != threader->root;
+	     parent = parent->parent) {
+		if (parent->data)
+			return (MsgInfo *)parent->data;
+	}
+
+	return NULL;
+}
+
+/* children of the dummy containers are moved up to their parent */
+static void procthread_copy_children(GNode *src, GNode *dest)
+{
+	GNode *child, *node;
+
+	for (child = src->children; child != NULL; child = child->next) {
+		if (child->data) {
+			node = g_node_prepend_data(dest, child->data);
+			procthread_copy_children(child, node);
+		} else
+			procthread_copy_children(child, dest);
+	}
+}
+
+/* return the thread tree in the same form as procmsg_get_thread_tree():
+   top-level messages are in the reverse order of insertion, and the
+   replies are in the order of insertion */
+GNode *procthread_get_tree(MsgThreader *threader)
+{
+	GNode *root, *child, *node;
+
+	g_return_val_if_fail(threader != NULL, NULL);
+
+	root = g_node_new(NULL);
+
+	for (child = g_node_last_child(threader->root); child != NULL;
+	     child = child->prev) {
+		if (child->data) {
+			node = g_node_prepend_data(root, child->data);
+			procthread_copy_children(child, node);
+		} else
+			procthread_copy_children(child, root);
+	}
+
+	return root;
+}
@@ -0,0 +1,41 @@
+/*
+ * LibSylph -- E-Mail client library
+ * Copyright (C) 1999-2014 Hiroyuki Yamamoto
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __PROCTHREAD_H__
+#define __PROCTHREAD_H__
+
+#include <glib.h>
+
+typedef struct _MsgThreader	MsgThreader;
+
+#include "procmsg.h"
+
+MsgThreader *procthread_new	(gboolean	 by_subject);
+void	 procthread_free	(MsgThreader	*threader);
+
+MsgInfo *procthread_insert	(MsgThreader	*threader,
+				 MsgInfo	*msginfo);
+MsgInfo *procthread_insert_full	(MsgThreader	*threader,
+				 MsgInfo	*msginfo,
+				 gboolean	*moved);
+GNode	*procthread_get_tree	(MsgThreader	*threader);
+
+gchar	*procthread_get_base_subject	(const gchar	*subject);
+
+#endif /* __PROCTHREAD_H__ */
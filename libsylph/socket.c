@@ -55,6 +55,9 @@
 #if USE_SSL
 #  include "ssl.h"
 #endif
+#if USE_ZLIB
+#  include <zlib.h>
+#endif
 
 #include "utils.h"
 
@@ -117,7 +120,26 @@ struct _SockAddrData {
 struct _SockSource {
 	GSource parent;
 	SockInfo *sock;
+	GPollFD pollfd;		/* sock_fd_watch_funcs only */
+};
+
+#if USE_ZLIB
+/* raw DEFLATE streams of RFC 4978, layered above SSL */
+struct _SockCompress {
+	z_stream in;
+	z_stream out;
+	gchar inbuf[BUFFSIZE];	/* compressed data not inflated yet */
+	gchar buf[BUFFSIZE];	/* inflated data not read yet */
+	gchar *bufp;
+	gint buflen;
+	gboolean more_out;	/* the last inflate() filled buf */
+
+	guint64 raw_in;
+	guint64 data_in;
+	guint64 raw_out;
+	guint64 data_out;
 };
+#endif
 
 static guint io_timeout = 60;
 
@@ -138,8 +160,44 @@ GSourceFuncs sock_watch_funcs = {
 	NULL
 };
 
+#ifndef G_OS_WIN32
+static gboolean sock_fd_prepare		(GSource	*source,
+					 gint		*timeout);
+static gboolean sock_fd_check		(GSource	*source);
+
+static GSourceFuncs sock_fd_watch_funcs = {
+	sock_fd_prepare,
+	sock_fd_check,
+	sock_dispatch,
+	NULL
+};
+#endif
+
 static SockInfo *sock_find_from_fd	(gint	fd);
 
+static gint sock_read_raw		(SockInfo	*sock,
+					 gchar		*buf,
+					 gint		 len);
+static gint sock_write_all_raw		(SockInfo	*sock,
+					 const gchar	*buf,
+					 gint		 len);
+#if USE_ZLIB
+static gint sock_compress_read		(SockInfo	*sock,
+					 gchar		*buf,
+					 gint		 len,
+					 gboolean	 peek);
+static gint sock_compress_write		(SockInfo	*sock,
+					 const gchar	*buf,
+					 gint		 len);
+static gint sock_compress_gets		(SockInfo	*sock,
+					 gchar		*buf,
+					 gint		 len);
+static gint sock_compress_getline	(SockInfo	*sock,
+					 gchar	       **line);
+static gboolean sock_compress_has_data	(SockInfo	*sock);
+static void sock_compress_free		(SockInfo	*sock);
+#endif
+
 static gint sock_connect_with_timeout	(gint			 sock,
 					 const struct sockaddr	*serv_addr,
 					 gint			 addrlen,
@@ -504,6 +562,10 @@ gboolean sock_has_read_data(SockInfo *sock)
 #ifdef G_OS_WIN32
 	gulong val;
 
+#if USE_ZLIB
+	if (sock_compress_has_data(sock))
+		return TRUE;
+#endif
 #if USE_SSL
 	if (sock->ssl)
 		return TRUE;
@@ -537,6 +599,10 @@ static gboolean sock_check(GSource *source)
 	fd_set fds;
 	GIOCondition condition = sock->condition;
 
+#if USE_ZLIB
+	if ((condition & G_IO_IN) && sock_compress_has_data(sock))
+		return TRUE;
+#endif
 #if USE_SSL
 	if (sock->ssl) {
 		if (condition & G_IO_IN) {
@@ -564,6 +630,59 @@ static gboolean sock_check(GSource *source)
 	return FD_ISSET(sock->sock, &fds) != 0;
 }
 
+#ifndef G_OS_WIN32
+/* returns TRUE if data is buffered above the socket, which poll() does
+   not report */
+static gboolean sock_has_buffered_data(SockInfo *sock)
+{
+#if USE_ZLIB
+	if (sock_compress_has_data(sock))
+		return TRUE;
+#endif
+#if USE_SSL
+	if (sock->ssl && SSL_pending(sock->ssl) > 0)
+		return TRUE;
+#endif
+	return FALSE;
+}
+
+static gboolean sock_fd_prepare(GSource *source, gint *timeout)
+{
+	SockSource *ssource = (SockSource *)source;
+	SockInfo *sock = ssource->sock;
+	GIOCondition condition = sock->condition;
+
+	*timeout = -1;
+
+	if ((condition & G_IO_IN) && sock_has_buffered_data(sock))
+		return TRUE;
+
+#if USE_SSL
+	if (sock->ssl) {
+		if ((condition & G_IO_IN) && SSL_want_write(sock->ssl))
+			condition |= G_IO_OUT;
+		if ((condition & G_IO_OUT) && SSL_want_read(sock->ssl))
+			condition |= G_IO_IN;
+	}
+#endif
+	ssource->pollfd.events = condition;
+
+	return FALSE;
+}
+
+static gboolean sock_fd_check(GSource *source)
+{
+	SockSource *ssource = (SockSource *)source;
+	SockInfo *sock = ssource->sock;
+
+	if ((sock->condition & G_IO_IN) && sock_has_buffered_data(sock))
+		return TRUE;
+
+	return (ssource->pollfd.revents &
+		(ssource->pollfd.events | G_IO_ERR | G_IO_HUP)) != 0;
+}
+#endif
+
 static gboolean sock_dispatch(GSource *source, GSourceFunc callback,
 			      gpointer user_data)
 {
@@ -590,6 +709,11 @@ guint sock_add_watch(SockInfo *sock, GIOCondition condition, SockFunc func,
 	sock->condition = condition;
 	sock->data = data;
 
+#if USE_ZLIB
+	/* inflated data may be left in the buffer with no socket event */
+	if (sock->compress)
+		return sock_add_watch_poll(sock, condition, func, data);
+#endif
 #if USE_SSL
 	if (sock->ssl) {
 		GSource *source;
@@ -605,6 +729,38 @@ guint sock_add_watch(SockInfo *sock, GIOCondition condition, SockFunc func,
 	return g_io_add_watch(sock->sock_ch, condition, sock_watch_cb, sock);
 }
 
+/* same as sock_add_watch(), but SSL and compressed sockets are waited on
+   with poll() instead of being checked every millisecond. used for the
+   watches which last long, such as IMAP IDLE */
+guint sock_add_watch_persistent(SockInfo *sock, GIOCondition condition,
+				SockFunc func, gpointer data)
+{
+#ifndef G_OS_WIN32
+	GSource *source;
+	SockSource *ssource;
+
+	if (!sock->ssl && !sock->compress)
+		return sock_add_watch(sock, condition, func, data);
+
+	sock->callback = func;
+	sock->condition = condition;
+	sock->data = data;
+
+	source = g_source_new(&sock_fd_watch_funcs, sizeof(SockSource));
+	ssource = (SockSource *)source;
+	ssource->sock = sock;
+	ssource->pollfd.fd = sock->sock;
+	ssource->pollfd.events = condition;
+	g_source_add_poll(source, &ssource->pollfd);
+	g_source_set_priority(source, G_PRIORITY_DEFAULT);
+	g_source_set_can_recurse(source, FALSE);
+
+	return g_source_attach(source, NULL);
+#else
+	return sock_add_watch(sock, condition, func, data);
+#endif
+}
+
 guint sock_add_watch_poll(SockInfo *sock, GIOCondition condition, SockFunc func,
 			  gpointer data)
 {
@@ -1787,6 +1943,15 @@ gint sock_read(SockInfo *sock, gchar *buf, gint len)
 {
 	g_return_val_if_fail(sock != NULL, -1);
 
+#if USE_ZLIB
+	if (sock->compress)
+		return sock_compress_read(sock, buf, len, FALSE);
+#endif
+	return sock_read_raw(sock, buf, len);
+}
+
+static gint sock_read_raw(SockInfo *sock, gchar *buf, gint len)
+{
 #if USE_SSL
 	if (sock->ssl)
 		return ssl_read(sock->ssl, buf, len);
@@ -1845,6 +2010,10 @@ gint sock_write(SockInfo *sock, const gchar *buf, gint len)
 {
 	g_return_val_if_fail(sock != NULL, -1);
 
+#if USE_ZLIB
+	if (sock->compress)
+		return sock_compress_write(sock, buf, len);
+#endif
 #if USE_SSL
 	if (sock->ssl)
 		return ssl_write(sock->ssl, buf, len);
@@ -1900,6 +2069,15 @@ gint sock_write_all(SockInfo *sock, const gchar *buf, gint len)
 {
 	g_return_val_if_fail(sock != NULL, -1);
 
+#if USE_ZLIB
+	if (sock->compress)
+		return sock_compress_write(sock, buf, len);
+#endif
+	return sock_write_all_raw(sock, buf, len);
+}
+
+static gint sock_write_all_raw(SockInfo *sock, const gchar *buf, gint len)
+{
 #if USE_SSL
 	if (sock->ssl)
 		return ssl_write_all(sock->ssl, buf, len);
@@ -2015,6 +2193,10 @@ gint sock_gets(SockInfo *sock, gchar *buf, gint len)
 {
 	g_return_val_if_fail(sock != NULL, -1);
 
+#if USE_ZLIB
+	if (sock->compress)
+		return sock_compress_gets(sock, buf, len);
+#endif
 #if USE_SSL
 	if (sock->ssl)
 		return ssl_gets(sock->ssl, buf, len);
@@ -2079,6 +2261,10 @@ gint sock_getline(SockInfo *sock, gchar **line)
 	g_return_val_if_fail(sock != NULL, -1);
 	g_return_val_if_fail(line != NULL, -1);
 
+#if USE_ZLIB
+	if (sock->compress)
+		return sock_compress_getline(sock, line);
+#endif
 #if USE_SSL
 	if (sock->ssl)
 		return ssl_getline(sock->ssl, line);
@@ -2130,6 +2316,10 @@ gint sock_peek(SockInfo *sock, gchar *buf, gint len)
 {
 	g_return_val_if_fail(sock != NULL, -1);
 
+#if USE_ZLIB
+	if (sock->compress)
+		return sock_compress_read(sock, buf, len, TRUE);
+#endif
 #if USE_SSL
 	if (sock->ssl)
 		return ssl_peek(sock->ssl, buf, len);
@@ -2146,6 +2336,10 @@ gint sock_close(SockInfo *sock)
 
 	debug_print("sock_close: %s:%u (%p)\n", sock->hostname ? sock->hostname : "(none)", sock->port, sock);
 
+#if USE_ZLIB
+	if (sock->compress)
+		sock_compress_free(sock);
+#endif
 #if USE_SSL
 	if (sock->ssl)
 		ssl_done_socket(sock);
@@ -2169,6 +2363,207 @@ gint sock_close(SockInfo *sock)
 	return 0;
 }
 
+#if USE_ZLIB
+/* starts compressing the stream in both directions. it must be called
+   just after the peer has agreed, with no unread data left */
+gint sock_set_compress(SockInfo *sock)
+{
+	SockCompress *comp;
+
+	g_return_val_if_fail(sock != NULL, -1);
+
+	if (sock->compress)
+		return 0;
+
+	comp = g_new0(SockCompress, 1);
+	if (inflateInit2(&comp->in, -MAX_WBITS) != Z_OK) {
+		g_warning("sock_set_compress(): inflateInit2() failed\n");
+		g_free(comp);
+		return -1;
+	}
+	if (deflateInit2(&comp->out, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+			 -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		g_warning("sock_set_compress(): deflateInit2() failed\n");
+		inflateEnd(&comp->in);
+		g_free(comp);
+		return -1;
+	}
+	comp->bufp = comp->buf;
+
+	sock->compress = comp;
+
+	return 0;
+}
+
+/* returns TRUE if data can be read without a socket event: inflated data
+   in the buffer, received data not inflated yet, or output left in zlib
+   after an inflate() which filled the buffer */
+static gboolean sock_compress_has_data(SockInfo *sock)
+{
+	SockCompress *comp = sock->compress;
+
+	if (!comp)
+		return FALSE;
+
+	return comp->buflen > 0 || comp->in.avail_in > 0 || comp->more_out;
+}
+
+/* inflates the received data until some output is available */
+static gint sock_compress_fill(SockInfo *sock)
+{
+	SockCompress *comp = sock->compress;
+	gint ret, n;
+
+	if (comp->buflen > 0)
+		return comp->buflen;
+
+	for (;;) {
+		comp->in.next_out = (Bytef *)comp->buf;
+		comp->in.avail_out = sizeof(comp->buf);
+		ret = inflate(&comp->in, Z_SYNC_FLUSH);
+		if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			g_warning("sock_compress_fill(): inflate() failed: %d\n",
+				  ret);
+			return -1;
+		}
+
+		comp->bufp = comp->buf;
+		comp->buflen = sizeof(comp->buf) - comp->in.avail_out;
+		comp->more_out = (comp->in.avail_out == 0);
+		if (comp->buflen > 0) {
+			comp->data_in += comp->buflen;
+			return comp->buflen;
+		}
+
+		/* all the input was consumed */
+		if ((n = sock_read_raw(sock, comp->inbuf,
+				       sizeof(comp->inbuf))) <= 0)
+			return n;
+		comp->raw_in += n;
+		comp->in.next_in = (Bytef *)comp->inbuf;
+		comp->in.avail_in = n;
+	}
+}
+
+static gint sock_compress_read(SockInfo *sock, gchar *buf, gint len,
+			       gboolean peek)
+{
+	SockCompress *comp = sock->compress;
+	gint n;
+
+	if ((n = sock_compress_fill(sock)) <= 0)
+		return n;
+
+	n = MIN(len, comp->buflen);
+	memcpy(buf, comp->bufp, n);
+	if (!peek) {
+		comp->bufp += n;
+		comp->buflen -= n;
+	}
+
+	return n;
+}
+
+static gint sock_compress_write(SockInfo *sock, const gchar *buf, gint len)
+{
+	SockCompress *comp = sock->compress;
+	gchar outbuf[BUFFSIZE];
+	gint ret, n;
+
+	comp->out.next_in = (Bytef *)buf;
+	comp->out.avail_in = len;
+
+	do {
+		comp->out.next_out = (Bytef *)outbuf;
+		comp->out.avail_out = sizeof(outbuf);
+		ret = deflate(&comp->out, Z_SYNC_FLUSH);
+		if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			g_warning("sock_compress_write(): "
+				  "deflate() failed: %d\n", ret);
+			return -1;
+		}
+
+		n = sizeof(outbuf) - comp->out.avail_out;
+		if (n > 0 && sock_write_all_raw(sock, outbuf, n) < 0)
+			return -1;
+		comp->raw_out += n;
+	} while (comp->out.avail_out == 0);
+
+	comp->data_out += len;
+
+	return len;
+}
+
+static gint sock_compress_gets(SockInfo *sock, gchar *buf, gint len)
+{
+	gchar *newline, *bp = buf;
+	gint n;
+
+	if (--len < 1)
+		return -1;
+	do {
+		if ((n = sock_compress_read(sock, bp, len, TRUE)) <= 0)
+			return -1;
+		if ((newline = memchr(bp, '\n', n)) != NULL)
+			n = newline - bp + 1;
+		if ((n = sock_compress_read(sock, bp, n, FALSE)) < 0)
+			return -1;
+		bp += n;
+		len -= n;
+	} while (!newline && len);
+
+	*bp = '\0';
+	return bp - buf;
+}
+
+static gint sock_compress_getline(SockInfo *sock, gchar **line)
+{
+	gchar buf[BUFFSIZE];
+	gchar *str = NULL;
+	gint len;
+	gulong size = 0;
+	gulong cur_offset = 0;
+
+	while ((len = sock_compress_gets(sock, buf, sizeof(buf))) > 0) {
+		size += len;
+		str = g_realloc(str, size + 1);
+		memcpy(str + cur_offset, buf, len + 1);
+		cur_offset += len;
+		if (buf[len - 1] == '\n')
+			break;
+	}
+
+	*line = str;
+
+	if (!str)
+		return -1;
+	else
+		return (gint)size;
+}
+
+static void sock_compress_free(SockInfo *sock)
+{
+	SockCompress *comp = sock->compress;
+
+	log_print("%s:%u: compression: received %" G_GUINT64_FORMAT
+		  " bytes (%" G_GUINT64_FORMAT " uncompressed, %d%%), "
+		  "sent %" G_GUINT64_FORMAT " bytes (%" G_GUINT64_FORMAT
+		  " uncompressed, %d%%)\n",
+		  sock->hostname ? sock->hostname : "(none)", sock->port,
+		  comp->raw_in, comp->data_in,
+		  comp->data_in ? (gint)(comp->raw_in * 100 / comp->data_in)
+		  : 100,
+		  comp->raw_out, comp->data_out,
+		  comp->data_out ? (gint)(comp->raw_out * 100 / comp->data_out)
+		  : 100);
+
+	inflateEnd(&comp->in);
+	deflateEnd(&comp->out);
+	g_free(comp);
+	sock->compress = NULL;
+}
+#endif /* USE_ZLIB */
+
 gint fd_close(gint fd)
 {
 #ifdef G_OS_WIN32
@@ -33,6 +33,7 @@
 #endif
 
 typedef struct _SockInfo	SockInfo;
+typedef struct _SockCompress	SockCompress;
 
 #if USE_SSL
 #  include "ssl.h"
@@ -82,6 +83,8 @@ struct _SockInfo
 
 	SockFunc callback;
 	GIOCondition condition;
+
+	SockCompress *compress;
 };
 
 gint sock_init				(void);
@@ -100,6 +103,9 @@ guint sock_add_watch			(SockInfo *sock, GIOCondition condition,
 					 SockFunc func, gpointer data);
 guint sock_add_watch_poll		(SockInfo *sock, GIOCondition condition,
 					 SockFunc func, gpointer data);
+guint sock_add_watch_persistent		(SockInfo *sock,
+					 GIOCondition condition,
+					 SockFunc func, gpointer data);
 
 struct hostent *my_gethostbyname	(const gchar *hostname);
 
@@ -160,4 +166,9 @@ gint ssl_getline	(SSL *ssl, gchar **line);
 gint ssl_peek		(SSL *ssl, gchar *buf, gint len);
 #endif
 
+/* Functions for stream compression */
+#if USE_ZLIB
+gint sock_set_compress		(SockInfo *sock);
+#endif
+
 #endif /* __SOCKET_H__ */
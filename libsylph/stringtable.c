@@ -145,19 +145,36 @@ void string_table_free(StringTable *table)
 	g_free(table);
 }
 
+typedef struct _StringTableStats {
+	guint strings;
+	guint refs;
+	guint size;
+	guint unspilled;
+} StringTableStats;
+
 static void string_table_stats_for_each_fn(gchar *key, StringEntry *entry,
-					   guint *totals)
+					   StringTableStats *stats)
 {
+	guint len;
+
+	len = strlen(key) + 1;
+	stats->strings++;
+	stats->refs += entry->ref_count;
+	stats->size += len;
 	if (entry->ref_count > 1) {
-		*totals += strlen(key) * (entry->ref_count - 1);
+		stats->unspilled += len * (entry->ref_count - 1);
 	}
 }
 
 void string_table_get_stats(StringTable *table)
 {
-	guint totals = 0;
+	StringTableStats stats = {0, 0, 0, 0};
+
+	g_return_if_fail(table != NULL);
 
 	g_hash_table_foreach(table->hash_table,
-			     (GHFunc)string_table_stats_for_each_fn, &totals);
-	XXX_DEBUG ("TOTAL UNSPILLED %d (%dK)\n", totals, totals / 1024);
+			     (GHFunc)string_table_stats_for_each_fn, &stats);
+	debug_print("string table (%p): %u strings, %u refs, %u bytes "
+		    "(%uK unspilled)\n", table, stats.strings, stats.refs,
+		    stats.size, stats.unspilled / 1024);
 }
@@ -65,6 +65,8 @@ enum {
 	MOVE_FOLDER,
 	FOLDERLIST_UPDATED,
 	ACCOUNT_UPDATED,
+	UPDATE_FOLDER,
+	REMOTE_FOLDER_CHANGED,
 	LAST_SIGNAL
 };
 
@@ -182,6 +184,26 @@ static void syl_app_class_init(SylAppClass *klass)
 			     syl_marshal_VOID__VOID,
 			     G_TYPE_NONE,
 			     0);
+	app_signals[UPDATE_FOLDER] =
+		g_signal_new("update-folder",
+			     G_TYPE_FROM_CLASS(gobject_class),
+			     G_SIGNAL_RUN_FIRST,
+			     0,
+			     NULL, NULL,
+			     syl_marshal_VOID__POINTER,
+			     G_TYPE_NONE,
+			     1,
+			     G_TYPE_POINTER);
+	app_signals[REMOTE_FOLDER_CHANGED] =
+		g_signal_new("remote-folder-changed",
+			     G_TYPE_FROM_CLASS(gobject_class),
+			     G_SIGNAL_RUN_FIRST,
+			     0,
+			     NULL, NULL,
+			     syl_marshal_VOID__POINTER,
+			     G_TYPE_NONE,
+			     1,
+			     G_TYPE_POINTER);
 }
 
 GObject *syl_app_create(void)
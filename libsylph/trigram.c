@@ -0,0 +1,177 @@
+/*
+ * LibSylph -- E-Mail client library
+ * Copyright (C) 1999-2014 Hiroyuki Yamamoto
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Substring index over short texts such as message headers.
+ *
+ * Every document (identified by a number) is broken into overlapping
+ * three-byte sequences, folded to ASCII lower case in the same way as
+ * str_case_find(). A document can contain a key only if it contains all
+ * the trigrams of the key, so intersecting their posting lists gives a
+ * small set of candidates which the caller verifies with the real match.
+ */
+
+#include "defs.h"
+
+#include <glib.h>
+#include <string.h>
+
+#include "trigram.h"
+
+struct _TrigramIndex
+{
+	/* trigram -> GArray of ascending document ids */
+	GHashTable *table;
+};
+
+#define TRIGRAM(p)					\
+	(((guint)(guchar)g_ascii_tolower((p)[0]) << 16) |	\
+	 ((guint)(guchar)g_ascii_tolower((p)[1]) << 8) |	\
+	 (guint)(guchar)g_ascii_tolower((p)[2]))
+
+static void trigram_posting_free(gpointer data)
+{
+	g_array_free((GArray *)data, TRUE);
+}
+
+TrigramIndex *trigram_index_new(void)
+{
+	TrigramIndex *index;
+
+	index = g_new(TrigramIndex, 1);
+	index->table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+					     NULL, trigram_posting_free);
+
+	return index;
+}
+
+void trigram_index_free(TrigramIndex *index)
+{
+	if (!index)
+		return;
+
+	g_hash_table_destroy(index->table);
+	g_free(index);
+}
+
+/* Documents must be added in ascending order of id, which keeps every
+   posting list sorted without any extra work. A document may be given
+   several texts by calling this repeatedly with the same id. */
+void trigram_index_add_text(TrigramIndex *index, guint id, const gchar *text)
+{
+	const gchar *p;
+	GArray *posting;
+	guint tri;
+
+	g_return_if_fail(index != NULL);
+
+	if (!text)
+		return;
+
+	for (p = text; p[0] != '\0' && p[1] != '\0' && p[2] != '\0'; p++) {
+		tri = TRIGRAM(p);
+		posting = g_hash_table_lookup(index->table,
+					      GUINT_TO_POINTER(tri));
+		if (!posting) {
+			posting = g_array_new(FALSE, FALSE, sizeof(guint));
+			g_hash_table_insert(index->table,
+					    GUINT_TO_POINTER(tri), posting);
+		} else if (g_array_index(posting, guint, posting->len - 1)
+			   == id)
+			continue;
+		g_array_append_val(posting, id);
+	}
+}
+
+static void trigram_intersect(GArray *result, GArray *posting)
+{
+	guint i = 0, j = 0, n = 0;
+	guint a, b;
+
+	while (i < result->len && j < posting->len) {
+		a = g_array_index(result, guint, i);
+		b = g_array_index(posting, guint, j);
+		if (a < b)
+			i++;
+		else if (a > b)
+			j++;
+		else {
+			g_array_index(result, guint, n++) = a;
+			i++;
+			j++;
+		}
+	}
+
+	g_array_set_size(result, n);
+}
+
+/* Narrows down candidates (all documents if NULL) to the ids of the
+   documents which may contain key. A key shorter than a trigram cannot
+   narrow anything, and candidates is returned as is; otherwise the
+   returned array is sorted and owned by the caller. */
+GArray *trigram_index_lookup(TrigramIndex *index, const gchar *key,
+			     GArray *candidates)
+{
+	GPtrArray *postings;
+	GArray *posting;
+	GArray *shortest = NULL;
+	const gchar *p;
+	guint i;
+
+	g_return_val_if_fail(index != NULL, candidates);
+	g_return_val_if_fail(key != NULL, candidates);
+
+	if (strlen(key) < 3)
+		return candidates;
+
+	postings = g_ptr_array_new();
+
+	for (p = key; p[2] != '\0'; p++) {
+		posting = g_hash_table_lookup(index->table,
+					      GUINT_TO_POINTER(TRIGRAM(p)));
+		if (!posting) {
+			g_ptr_array_free(postings, TRUE);
+			if (!candidates)
+				candidates = g_array_new(FALSE, FALSE,
+							 sizeof(guint));
+			g_array_set_size(candidates, 0);
+			return candidates;
+		}
+		g_ptr_array_add(postings, posting);
+		if (!shortest || posting->len < shortest->len)
+			shortest = posting;
+	}
+
+	if (!candidates) {
+		candidates = g_array_sized_new(FALSE, FALSE, sizeof(guint),
+					       shortest->len);
+		g_array_append_vals(candidates, shortest->data, shortest->len);
+	} else
+		trigram_intersect(candidates, shortest);
+
+	for (i = 0; i < postings->len && candidates->len > 0; i++) {
+		posting = g_ptr_array_index(postings, i);
+		if (posting != shortest)
+			trigram_intersect(candidates, posting);
+	}
+
+	g_ptr_array_free(postings, TRUE);
+
+	return candidates;
+}
@@ -349,6 +349,8 @@ static GSList *virtual_search_folder(VirtualSearchInfo *info, FolderItem *item)
 	total = g_slist_length(mlist);
 
 	memset(&fltinfo, 0, sizeof(FilterInfo));
+	if (filter_rule_uses_body_index(info->rule))
+		fltinfo.body_index = body_index_open(item, mlist);
 
 	debug_print("start query search: %s\n", item->path);
 
@@ -381,6 +383,7 @@ static GSList *virtual_search_folder(VirtualSearchInfo *info, FolderItem *item)
 			matched = (gint)g_hash_table_lookup
 				(info->search_cache_table, &sinfo);
 			if (matched == SCACHE_MATCHED) {
+				msginfo = procmsg_msginfo_promote(msginfo);
 				match_list = g_slist_prepend
 					(match_list, msginfo);
 				cur->data = NULL;
@@ -410,6 +413,8 @@ static GSList *virtual_search_folder(VirtualSearchInfo *info, FolderItem *item)
 			continue;
 
 		if (filter_match_rule(info->rule, msginfo, hlist, &fltinfo)) {
+			/* the rest of mlist is freed below */
+			msginfo = procmsg_msginfo_promote(msginfo);
 			match_list = g_slist_prepend(match_list, msginfo);
 			cur->data = NULL;
 			virtual_write_search_cache(info->fp, NULL, msginfo,
@@ -425,6 +430,7 @@ static GSList *virtual_search_folder(VirtualSearchInfo *info, FolderItem *item)
 	debug_print("%d cache hits (%d total)\n", ncachehit, total);
 
 	virtual_write_search_cache(info->fp, NULL, NULL, 0);
+	body_index_close(fltinfo.body_index);
 	procmsg_msg_list_free(mlist);
 
 	return g_slist_reverse(match_list);
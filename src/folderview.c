@@ -1001,6 +1001,14 @@ static void folderview_rescan_tree(FolderView *folderview, Folder *folder)
 	inc_unlock();
 }
 
+typedef struct _FolderCheckItem
+{
+	FolderItem *item;
+	GtkTreeIter iter;
+	gint prev_new;
+	gint prev_unread;
+} FolderCheckItem;
+
 gint folderview_check_new(Folder *folder)
 {
 	FolderItem *item;
@@ -1008,7 +1016,10 @@ gint folderview_check_new(Folder *folder)
 	GtkTreeModel *model;
 	GtkTreeIter iter;
 	gboolean valid;
-	gint prev_new, prev_unread, n_updated = 0;
+	GSList *check_list = NULL, *item_list = NULL, *cur;
+	FolderCheckItem *citem;
+	gboolean scanned = FALSE;
+	gint n_updated = 0;
 
 	folderview = (FolderView *)folderview_list->data;
 	model = GTK_TREE_MODEL(folderview->store);
@@ -1034,23 +1045,50 @@ gint folderview_check_new(Folder *folder)
 		if (folder && folder != item->folder) continue;
 		if (!folder && FOLDER_IS_REMOTE(item->folder)) continue;
 
-		prev_new = item->new;
-		prev_unread = item->unread;
-		folderview_scan_tree_func(item->folder, item, NULL);
-		if (folder_item_scan(item) < 0) {
-			if (folder && FOLDER_IS_REMOTE(folder) &&
-			    REMOTE_FOLDER(folder)->session == NULL)
-				break;
+		citem = g_new(FolderCheckItem, 1);
+		citem->item = item;
+		citem->iter = iter;
+		citem->prev_new = item->new;
+		citem->prev_unread = item->unread;
+		check_list = g_slist_prepend(check_list, citem);
+		item_list = g_slist_prepend(item_list, item);
+	}
+	check_list = g_slist_reverse(check_list);
+	item_list = g_slist_reverse(item_list);
+
+	/* check all the IMAP folders with one pipelined request */
+	if (folder && FOLDER_TYPE(folder) == F_IMAP && item_list) {
+		folderview_scan_tree_func
+			(folder, FOLDER_ITEM(item_list->data), NULL);
+		folder_item_scan_list(item_list);
+		scanned = TRUE;
+	}
+
+	for (cur = check_list; cur != NULL; cur = cur->next) {
+		citem = (FolderCheckItem *)cur->data;
+		item = citem->item;
+
+		if (!scanned) {
+			folderview_scan_tree_func(item->folder, item, NULL);
+			if (folder_item_scan(item) < 0) {
+				if (folder && FOLDER_IS_REMOTE(folder) &&
+				    REMOTE_FOLDER(folder)->session == NULL)
+					break;
+			}
 		}
-		folderview_update_row(folderview, &iter);
+		folderview_update_row(folderview, &citem->iter);
 		if (item->stype != F_TRASH && item->stype != F_JUNK) {
-			if (prev_unread < item->unread)
-				n_updated += item->unread - prev_unread;
-			else if (prev_new < item->new)
-				n_updated += item->new - prev_new;
+			if (citem->prev_unread < item->unread)
+				n_updated += item->unread - citem->prev_unread;
+			else if (citem->prev_new < item->new)
+				n_updated += item->new - citem->prev_new;
 		}
 	}
 
+	slist_free_strings(check_list);
+	g_slist_free(check_list);
+	g_slist_free(item_list);
+
 	gtk_widget_set_sensitive(folderview->treeview, TRUE);
 	main_window_unlock(folderview->mainwin);
 	inc_unlock();
@@ -1446,7 +1484,8 @@ void folderview_update_item(FolderItem *item, gboolean update_summary)
 		 COL_FOLDER_ITEM, item)) {
 		folderview_update_row(folderview, &iter);
 		if (update_summary &&
-		    folderview->summaryview->folder_item == item)
+		    folderview->summaryview->folder_item == item &&
+		    !summary_update_queued_msgs(folderview->summaryview))
 			summary_show(folderview->summaryview, item, FALSE);
 	}
 }
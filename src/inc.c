@@ -63,6 +63,7 @@
 #include "folder.h"
 #include "procheader.h"
 #include "plugin.h"
+#include "sylmain.h"
 
 
 typedef struct _IncAccountNewMsgCount
@@ -105,7 +106,8 @@ static void inc_result_free		(IncResult		*result,
 					 gboolean		 free_self);
 
 static gint inc_remote_account_mail	(MainWindow		*mainwin,
-					 PrefsAccount		*account);
+					 PrefsAccount		*account,
+					 gboolean		 inbox_only);
 static gint inc_account_mail_real	(MainWindow		*mainwin,
 					 PrefsAccount		*account,
 					 IncResult		*result);
@@ -172,6 +174,14 @@ static gint get_spool			(FolderItem	*dest,
 static void inc_autocheck_timer_set_interval	(guint		 interval);
 static gint inc_autocheck_func			(gpointer	 data);
 
+static void inc_imap_idle_process		(void);
+static gint inc_imap_idle_retry_func		(gpointer	 data);
+static void inc_imap_idle_changed_cb		(GObject	*obj,
+						 FolderItem	*item,
+						 gpointer	 data);
+static void inc_imap_idle_account_updated_cb	(GObject	*obj,
+						 gpointer	 data);
+
 
 /**
  * inc_finished:
@@ -380,7 +390,8 @@ void inc_mail(MainWindow *mainwin)
 	inc_autocheck_timer_set();
 }
 
-static gint inc_remote_account_mail(MainWindow *mainwin, PrefsAccount *account)
+static gint inc_remote_account_mail(MainWindow *mainwin, PrefsAccount *account,
+				   gboolean inbox_only)
 {
 	FolderItem *item = mainwin->summaryview->folder_item;
 	gint new_msgs = 0;
@@ -441,6 +452,8 @@ static gint inc_remote_account_mail(MainWindow *mainwin, PrefsAccount *account)
 			if (msginfo->flags.perm_flags !=
 			    fltinfo->flags.perm_flags) {
 				msginfo->flags = fltinfo->flags;
+				MSG_SET_TMP_FLAGS(msginfo->flags,
+						  MSG_FLAG_CHANGED);
 				inbox->mark_dirty = TRUE;
 				if (fltinfo->actions[FLT_ACTION_MARK])
 					imap_msg_set_perm_flags
@@ -489,7 +502,8 @@ static gint inc_remote_account_mail(MainWindow *mainwin, PrefsAccount *account)
 			update_summary = TRUE;
 	}
 
-	if (account->protocol == A_IMAP4 && account->imap_check_inbox_only) {
+	if (account->protocol == A_IMAP4 &&
+	    (inbox_only || account->imap_check_inbox_only)) {
 		FolderItem *inbox = FOLDER(account->folder)->inbox;
 
 		new_msgs += folderview_check_new_item(inbox);
@@ -519,7 +533,7 @@ static gint inc_account_mail_real(MainWindow *mainwin, PrefsAccount *account,
 	g_return_val_if_fail(account != NULL, 0);
 
 	if (account->protocol == A_IMAP4 || account->protocol == A_NNTP)
-		return inc_remote_account_mail(mainwin, account);
+		return inc_remote_account_mail(mainwin, account, FALSE);
 
 	session = inc_session_new(account);
 	if (!session) return 0;
@@ -601,7 +615,15 @@ void inc_all_account_mail(MainWindow *mainwin, gboolean autocheck)
 		PrefsAccount *account = list->data;
 		if ((account->protocol == A_IMAP4 ||
 		     account->protocol == A_NNTP) && account->recv_at_getall) {
-			new_msgs = inc_remote_account_mail(mainwin, account);
+			/* new messages in INBOX are notified by IDLE. the
+			   other folders still have to be checked */
+			if (autocheck && account->protocol == A_IMAP4 &&
+			    account->imap_check_inbox_only &&
+			    account->folder &&
+			    imap_idle_is_active(FOLDER(account->folder)))
+				continue;
+			new_msgs = inc_remote_account_mail(mainwin, account,
+							   FALSE);
 			result.count_list = inc_add_message_count(result.count_list, account, new_msgs);
 		}
 	}
@@ -1887,6 +1909,12 @@ void inc_autocheck_timer_init(MainWindow *mainwin)
 {
 	autocheck_data = mainwin;
 	inc_autocheck_timer_set();
+
+	g_signal_connect(syl_app_get(), "remote-folder-changed",
+			 G_CALLBACK(inc_imap_idle_changed_cb), NULL);
+	g_signal_connect(syl_app_get(), "account-updated",
+			 G_CALLBACK(inc_imap_idle_account_updated_cb), NULL);
+	inc_imap_idle_update();
 }
 
 static void inc_autocheck_timer_set_interval(guint interval)
@@ -1934,3 +1962,135 @@ static gint inc_autocheck_func(gpointer data)
 
 	return FALSE;
 }
+
+/* IMAP4 IDLE: INBOX is checked as soon as the server reports changes */
+
+static GSList *idle_pending_list = NULL;
+static guint idle_retry_timer = 0;
+
+void inc_imap_idle_update(void)
+{
+	GList *list;
+	PrefsAccount *account;
+
+	for (list = account_get_list(); list != NULL; list = list->next) {
+		account = (PrefsAccount *)list->data;
+		if (account->protocol != A_IMAP4 || !account->folder)
+			continue;
+
+		if (account->imap_use_idle && prefs_common.online_mode)
+			imap_idle_start(FOLDER(account->folder));
+		else
+			imap_idle_stop(FOLDER(account->folder));
+	}
+}
+
+void inc_imap_idle_stop_all(void)
+{
+	GList *list;
+	PrefsAccount *account;
+
+	for (list = account_get_list(); list != NULL; list = list->next) {
+		account = (PrefsAccount *)list->data;
+		if (account->protocol == A_IMAP4 && account->folder)
+			imap_idle_stop(FOLDER(account->folder));
+	}
+
+	if (idle_retry_timer) {
+		g_source_remove(idle_retry_timer);
+		idle_retry_timer = 0;
+	}
+	g_slist_free(idle_pending_list);
+	idle_pending_list = NULL;
+}
+
+static void inc_imap_idle_account_mail(MainWindow *mainwin,
+				       PrefsAccount *account)
+{
+	IncResult result = {NULL, NULL};
+	gint new_msgs;
+
+	debug_print("inc_imap_idle_account_mail: %s\n",
+		    account->account_name ? account->account_name : "");
+
+	inc_is_running = TRUE;
+
+	inc_autocheck_timer_remove();
+	summary_write_cache(mainwin->summaryview);
+	main_window_lock(mainwin);
+
+	syl_plugin_signal_emit("inc-mail-start", account);
+
+	new_msgs = inc_remote_account_mail(mainwin, account, TRUE);
+	result.count_list = inc_add_message_count(result.count_list, account,
+						  new_msgs);
+
+	inc_finished(mainwin, &result);
+	inc_result_free(&result, FALSE);
+
+	inc_is_running = FALSE;
+
+	main_window_unlock(mainwin);
+	inc_autocheck_timer_set();
+}
+
+static void inc_imap_idle_process(void)
+{
+	MainWindow *mainwin = (MainWindow *)autocheck_data;
+	PrefsAccount *account;
+	gint id;
+
+	if (!mainwin)
+		return;
+
+	if (inc_lock_count || inc_is_active()) {
+		if (idle_retry_timer == 0)
+			idle_retry_timer = g_timeout_add_full
+				(G_PRIORITY_LOW, 1000,
+				 inc_imap_idle_retry_func, NULL, NULL);
+		return;
+	}
+
+	while (idle_pending_list != NULL) {
+		id = GPOINTER_TO_INT(idle_pending_list->data);
+		idle_pending_list = g_slist_remove(idle_pending_list,
+						   idle_pending_list->data);
+
+		account = account_find_from_id(id);
+		if (account && account->folder && prefs_common.online_mode)
+			inc_imap_idle_account_mail(mainwin, account);
+	}
+}
+
+static gint inc_imap_idle_retry_func(gpointer data)
+{
+	gdk_threads_enter();
+	idle_retry_timer = 0;
+	inc_imap_idle_process();
+	gdk_threads_leave();
+
+	return FALSE;
+}
+
+static void inc_imap_idle_changed_cb(GObject *obj, FolderItem *item,
+				     gpointer data)
+{
+	gpointer id;
+
+	if (!item || !item->folder || !item->folder->account ||
+	    FOLDER_TYPE(item->folder) != F_IMAP)
+		return;
+
+	id = GINT_TO_POINTER(item->folder->account->account_id);
+	if (!g_slist_find(idle_pending_list, id))
+		idle_pending_list = g_slist_append(idle_pending_list, id);
+
+	gdk_threads_enter();
+	inc_imap_idle_process();
+	gdk_threads_leave();
+}
+
+static void inc_imap_idle_account_updated_cb(GObject *obj, gpointer data)
+{
+	inc_imap_idle_update();
+}
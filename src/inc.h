@@ -112,4 +112,7 @@ void inc_autocheck_timer_init	(MainWindow	*mainwin);
 void inc_autocheck_timer_set	(void);
 void inc_autocheck_timer_remove	(void);
 
+void inc_imap_idle_update	(void);
+void inc_imap_idle_stop_all	(void);
+
 #endif /* __INC_H__ */
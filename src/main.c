@@ -74,6 +74,7 @@
 #include "compose.h"
 #include "logwindow.h"
 #include "folder.h"
+#include "mh.h"
 #include "setup.h"
 #include "sylmain.h"
 #include "utils.h"
@@ -215,6 +216,11 @@ static void load_cb(GObject *obj, GModule *module, gpointer data)
 	debug_print("load_cb: %p (%s), %p\n", module, module ? g_module_name(module) : "(null)", data);
 }
 
+static void update_folder_cb(GObject *obj, FolderItem *item, gpointer data)
+{
+	folderview_update_item(item, TRUE);
+}
+
 int main(int argc, char *argv[])
 {
 	MainWindow *mainwin;
@@ -370,6 +376,11 @@ int main(int argc, char *argv[])
 
 	inc_autocheck_timer_init(mainwin);
 
+	g_signal_connect(syl_app, "update-folder",
+			 G_CALLBACK(update_folder_cb), NULL);
+	if (prefs_common.watch_local_folders)
+		mh_watch_start();
+
 	plugin_init();
 
 	g_signal_emit_by_name(syl_app, "init-done");
@@ -964,6 +975,8 @@ void app_will_exit(gboolean force)
 	g_signal_emit_by_name(syl_app_get(), "app-exit");
 
 	inc_autocheck_timer_remove();
+	inc_imap_idle_stop_all();
+	mh_watch_stop();
 
 	if (prefs_common.clean_on_exit)
 		main_window_empty_trash(mainwin,
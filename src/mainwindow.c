@@ -3104,6 +3104,7 @@ static void online_switch_clicked(GtkWidget *widget, gpointer data)
 		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(menuitem),
 					       TRUE);
 		inc_autocheck_timer_remove();
+		inc_imap_idle_stop_all();
 		folder_remote_folder_destroy_all_sessions();
 	} else {
 		prefs_common.online_mode = TRUE;
@@ -3116,6 +3117,7 @@ static void online_switch_clicked(GtkWidget *widget, gpointer data)
 		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(menuitem),
 					       FALSE);
 		inc_autocheck_timer_set();
+		inc_imap_idle_update();
 	}
 }
 
@@ -99,6 +99,7 @@ static struct Receive {
 	GtkWidget *imap_auth_type_optmenu;
 	GtkWidget *imap_check_inbox_chkbtn;
 	GtkWidget *imap_filter_inbox_chkbtn;
+	GtkWidget *imap_use_idle_chkbtn;
 
 	GtkWidget *nntp_frame;
 	GtkWidget *maxarticle_spinbtn;
@@ -285,6 +286,8 @@ static PrefsUIData ui_data[] = {
 	 prefs_set_data_from_toggle, prefs_set_toggle},
 	{"imap_filter_inbox_on_receive", &receive.imap_filter_inbox_chkbtn,
 	 prefs_set_data_from_toggle, prefs_set_toggle},
+	{"imap_use_idle", &receive.imap_use_idle_chkbtn,
+	 prefs_set_data_from_toggle, prefs_set_toggle},
 	{"imap_auth_method", &receive.imap_auth_type_optmenu,
 	 prefs_account_imap_auth_type_set_data_from_optmenu,
 	 prefs_account_imap_auth_type_set_optmenu},
@@ -889,6 +892,7 @@ static void prefs_account_receive_create(void)
 	GtkWidget *menuitem;
 	GtkWidget *imap_check_inbox_chkbtn;
 	GtkWidget *imap_filter_inbox_chkbtn;
+	GtkWidget *imap_use_idle_chkbtn;
 
 	GtkWidget *nntp_frame;
 	GtkWidget *maxarticle_label;
@@ -1043,6 +1047,9 @@ static void prefs_account_receive_create(void)
 			   _("Only check INBOX on receiving"));
 	PACK_CHECK_BUTTON (vbox2, imap_filter_inbox_chkbtn,
 			   _("Filter new messages in INBOX on receiving"));
+	PACK_CHECK_BUTTON (vbox2, imap_use_idle_chkbtn,
+			   _("Check INBOX immediately when the server "
+			     "reports changes (IDLE)"));
 
 	PACK_FRAME (vbox1, nntp_frame, _("News"));
 
@@ -1095,6 +1102,7 @@ static void prefs_account_receive_create(void)
 	receive.imap_auth_type_optmenu   = optmenu;
 	receive.imap_check_inbox_chkbtn  = imap_check_inbox_chkbtn;
 	receive.imap_filter_inbox_chkbtn = imap_filter_inbox_chkbtn;
+	receive.imap_use_idle_chkbtn     = imap_use_idle_chkbtn;
 
 	receive.nntp_frame             = nntp_frame;
 	receive.maxarticle_spinbtn     = maxarticle_spinbtn;
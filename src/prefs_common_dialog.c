@@ -56,9 +56,14 @@
 #include "gtkutils.h"
 #include "alertpanel.h"
 #include "folder.h"
+#include "mh.h"
 #include "socket.h"
 #include "plugin.h"
 
+#if defined(HAVE_SYS_INOTIFY_H) && defined(HAVE_INOTIFY_INIT)
+#  define USE_FOLDER_WATCH	1
+#endif
+
 static PrefsDialog dialog;
 
 static struct Receive {
@@ -68,6 +73,9 @@ static struct Receive {
 
 	GtkWidget *checkbtn_chkonstartup;
 	GtkWidget *checkbtn_scan_after_inc;
+#ifdef USE_FOLDER_WATCH
+	GtkWidget *checkbtn_watch_folders;
+#endif
 
 	GtkWidget *checkbtn_newmsg_notify_window;
 	GtkWidget *spinbtn_notifywin;
@@ -324,6 +332,10 @@ static PrefsUIData ui_data[] = {
 	 prefs_set_data_from_toggle, prefs_set_toggle},
 	{"scan_all_after_inc", &receive.checkbtn_scan_after_inc,
 	 prefs_set_data_from_toggle, prefs_set_toggle},
+#ifdef USE_FOLDER_WATCH
+	{"watch_local_folders", &receive.checkbtn_watch_folders,
+	 prefs_set_data_from_toggle, prefs_set_toggle},
+#endif
 	{"enable_newmsg_notify", &receive.checkbtn_newmsg_notify,
 	 prefs_set_data_from_toggle, prefs_set_toggle},
 	{"newmsg_notify_command", &receive.entry_newmsg_notify,
@@ -864,6 +876,9 @@ static void prefs_receive_create(void)
 	GtkWidget *label_autochk2;
 	GtkWidget *checkbtn_chkonstartup;
 	GtkWidget *checkbtn_scan_after_inc;
+#ifdef USE_FOLDER_WATCH
+	GtkWidget *checkbtn_watch_folders;
+#endif
 
 	GtkWidget *frame_notify;
 	GtkWidget *checkbtn_newmsg_notify_window;
@@ -932,6 +947,10 @@ static void prefs_receive_create(void)
 			   _("Check new mail on startup"));
 	PACK_CHECK_BUTTON (vbox2, checkbtn_scan_after_inc,
 			   _("Update all local folders after incorporation"));
+#ifdef USE_FOLDER_WATCH
+	PACK_CHECK_BUTTON (vbox2, checkbtn_watch_folders,
+			   _("Watch local folders for changes by other programs"));
+#endif
 
 	/* New message notify */
 	PACK_FRAME(vbox1, frame_notify, _("New message notification"));
@@ -1082,6 +1101,9 @@ static void prefs_receive_create(void)
 
 	receive.checkbtn_chkonstartup   = checkbtn_chkonstartup;
 	receive.checkbtn_scan_after_inc = checkbtn_scan_after_inc;
+#ifdef USE_FOLDER_WATCH
+	receive.checkbtn_watch_folders  = checkbtn_watch_folders;
+#endif
 
 	receive.checkbtn_newmsg_notify_window = checkbtn_newmsg_notify_window;
 	receive.spinbtn_notifywin       = spinbtn_notifywin;
@@ -4797,6 +4819,11 @@ static void prefs_common_apply(void)
 
 	inc_autocheck_timer_remove();
 	inc_autocheck_timer_set();
+
+	if (prefs_common.watch_local_folders)
+		mh_watch_start();
+	else
+		mh_watch_stop();
 }
 
 static void prefs_common_cancel(void)
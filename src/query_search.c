@@ -47,6 +47,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "query_search.h"
 #include "summaryview.h"
@@ -74,6 +75,7 @@ enum
 	COL_FROM,
 	COL_DATE,
 	COL_MSGINFO,
+	COL_SEQ,
 	N_COLS
 };
 
@@ -131,11 +133,16 @@ static FilterRule *query_search_dialog_to_rule	(const gchar	*name,
 
 static void query_search_query			(void);
 static void query_search_folder			(FolderItem	*item);
+static void query_search_folders_serial		(GSList		*folders);
+#if USE_THREADS
+static gboolean query_search_folders_parallel	(GSList		*folders);
+#endif
 
 static gboolean query_search_recursive_func	(GNode		*node,
 						 gpointer	 data);
 
-static void query_search_append_msg	(MsgInfo	*msginfo);
+static void query_search_append_msg	(MsgInfo	*msginfo,
+					 guint64	 seq);
 static void query_search_clear_list	(void);
 
 static void query_search_hbox_added	(CondHBox	*hbox);
@@ -359,7 +366,7 @@ static void query_search_create(void)
 
 	store = gtk_list_store_new(N_COLS,
 				   G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING,
-				   G_TYPE_STRING, G_TYPE_POINTER);
+				   G_TYPE_STRING, G_TYPE_POINTER, G_TYPE_UINT64);
 	treeview = gtk_tree_view_new_with_model(GTK_TREE_MODEL(store));
 	g_object_unref(store);
 	gtk_tree_view_set_rules_hint(GTK_TREE_VIEW(treeview), TRUE);
@@ -502,6 +509,7 @@ static FilterRule *query_search_dialog_to_rule(const gchar *name,
 static void query_search_query(void)
 {
 	FolderItem *item;
+	GSList *folders = NULL;
 	gchar *msg;
 
 	if (search_window.on_search)
@@ -533,11 +541,20 @@ static void query_search_query(void)
 			     GTK_STOCK_STOP);
 	query_search_clear_list();
 
-	if (search_window.rule->recursive)
+	if (search_window.rule->recursive) {
 		g_node_traverse(item->node, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
-				query_search_recursive_func, NULL);
-	else
-		query_search_folder(item);
+				query_search_recursive_func, &folders);
+		folders = g_slist_reverse(folders);
+	} else
+		folders = g_slist_append(folders, item);
+
+#if USE_THREADS
+	if (!query_search_folders_parallel(folders))
+		query_search_folders_serial(folders);
+#else
+	query_search_folders_serial(folders);
+#endif
+	g_slist_free(folders);
 
 	filter_rule_free(search_window.rule);
 	search_window.rule = NULL;
@@ -607,7 +624,7 @@ static gboolean query_search_progress_func(gpointer data)
 					  g_atomic_int_get(&qdata->count),
 					  qdata->total);
 	while ((msginfo = g_async_queue_try_pop(qdata->queue)))
-		query_search_append_msg(msginfo);
+		query_search_append_msg(msginfo, 0);
 	gdk_threads_leave();
 
 	return TRUE;
@@ -630,6 +647,8 @@ static gpointer query_search_folder_func(gpointer data)
 	mlist = qdata->mlist;
 
 	memset(&fltinfo, 0, sizeof(FilterInfo));
+	if (filter_rule_uses_body_index(search_window.rule))
+		fltinfo.body_index = body_index_open(qdata->item, mlist);
 
 	debug_print("requires_full_headers: %d\n",
 		    search_window.requires_full_headers);
@@ -672,10 +691,12 @@ static gpointer query_search_folder_func(gpointer data)
 
 		if (filter_match_rule(search_window.rule, msginfo, hlist,
 				      &fltinfo)) {
+			/* the result outlives the message list */
+			msginfo = procmsg_msginfo_promote(msginfo);
 #if USE_THREADS
 			g_async_queue_push(qdata->queue, msginfo);
 #else
-			query_search_append_msg(msginfo);
+			query_search_append_msg(msginfo, 0);
 #endif
 			cur->data = NULL;
 			search_window.n_found++;
@@ -684,6 +705,8 @@ static gpointer query_search_folder_func(gpointer data)
 		procheader_header_list_destroy(hlist);
 	}
 
+	body_index_close(fltinfo.body_index);
+
 #if USE_THREADS
 	g_async_queue_unref(qdata->queue);
 #endif
@@ -742,7 +765,7 @@ static void query_search_folder(FolderItem *item)
 	log_window_flush();
 
 	while ((msginfo = g_async_queue_try_pop(data.queue)))
-		query_search_append_msg(msginfo);
+		query_search_append_msg(msginfo, 0);
 
 	g_source_remove(data.timer_tag);
 	g_thread_join(thread);
@@ -758,8 +781,371 @@ static void query_search_folder(FolderItem *item)
 	g_free(data.folder_name);
 }
 
+static void query_search_folders_serial(GSList *folders)
+{
+	GSList *cur;
+
+	for (cur = folders; cur != NULL; cur = cur->next) {
+		query_search_folder(FOLDER_ITEM(cur->data));
+		if (search_window.cancelled)
+			break;
+	}
+}
+
+#if USE_THREADS
+/* messages of a folder are searched in chunks of this size */
+#define QUERY_SEARCH_CHUNK_MSGS		256
+#define QUERY_SEARCH_THREAD_MAX		8
+
+/* remote folders share the session of their account. the main thread
+   only tries to take it, so that it never waits for a search */
+G_LOCK_DEFINE_STATIC(query_search_remote);
+
+typedef struct _QuerySearchPool		QuerySearchPool;
+typedef struct _QuerySearchFolder	QuerySearchFolder;
+typedef struct _QuerySearchTask		QuerySearchTask;
+typedef struct _QuerySearchMatch	QuerySearchMatch;
+
+struct _QuerySearchPool
+{
+	GThreadPool *pool;
+	GAsyncQueue *queue;	/* GArray of QuerySearchMatch */
+	GAsyncQueue *done_queue;	/* finished QuerySearchFolder */
+	gboolean use_body_index;
+
+	gchar *folder_name;
+	gint count;
+	gint total;
+	gint pending;		/* tasks not finished yet */
+};
+
+struct _QuerySearchFolder
+{
+	FolderItem *item;
+	gboolean is_local;
+	GSList *mlist;
+	GSList **links;
+	guint n_msgs;
+	guint folder_index;	/* order of the folder in the search */
+	BodyIndex *body_index;
+	gint remaining;		/* chunks not finished yet */
+};
+
+struct _QuerySearchTask
+{
+	QuerySearchFolder *qfolder;
+	guint start;		/* G_MAXUINT: split the folder into chunks */
+	guint end;
+};
+
+struct _QuerySearchMatch
+{
+	MsgInfo *msginfo;
+	guint64 seq;
+};
+
+static gint query_search_get_threads(void)
+{
+	glong n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return CLAMP(n, 1, QUERY_SEARCH_THREAD_MAX);
+}
+
+static void query_search_push_task(QuerySearchPool *qpool,
+				   QuerySearchFolder *qfolder,
+				   guint start, guint end)
+{
+	QuerySearchTask *task;
+
+	task = g_new(QuerySearchTask, 1);
+	task->qfolder = qfolder;
+	task->start = start;
+	task->end = end;
+	g_atomic_int_inc(&qpool->pending);
+	g_thread_pool_push(qpool->pool, task, NULL);
+}
+
+/* this must be called in the main thread, since freeing the messages
+   modifies the string table of the folder */
+static void query_search_folder_free(QuerySearchFolder *qfolder)
+{
+	body_index_close(qfolder->body_index);
+	procmsg_msg_list_free(qfolder->mlist);
+	g_free(qfolder->links);
+	g_free(qfolder);
+}
+
+static void query_search_chunk(QuerySearchPool *qpool,
+			       QuerySearchFolder *qfolder,
+			       guint start, guint end)
+{
+	FilterInfo fltinfo;
+	GArray *matches = NULL;
+	QuerySearchMatch match;
+	guint i;
+
+	memset(&fltinfo, 0, sizeof(FilterInfo));
+	fltinfo.body_index = qfolder->body_index;
+
+	for (i = start; i < end; i++) {
+		MsgInfo *msginfo = (MsgInfo *)qfolder->links[i]->data;
+		GSList *hlist;
+
+		if (search_window.cancelled)
+			break;
+
+		g_atomic_int_inc(&qpool->count);
+
+		fltinfo.flags = msginfo->flags;
+		if (search_window.requires_full_headers) {
+			gchar *file;
+
+			file = procmsg_get_message_file(msginfo);
+			hlist = procheader_get_header_list_from_file(file);
+			g_free(file);
+		} else
+			hlist = procheader_get_header_list_from_msginfo
+				(msginfo);
+		if (!hlist)
+			continue;
+
+		if (filter_match_rule(search_window.rule, msginfo, hlist,
+				      &fltinfo)) {
+			/* the result outlives the message list */
+			match.msginfo = procmsg_msginfo_promote(msginfo);
+			match.seq = ((guint64)qfolder->folder_index << 32) | i;
+			qfolder->links[i]->data = NULL;
+			if (!matches)
+				matches = g_array_new(FALSE, FALSE,
+						      sizeof(QuerySearchMatch));
+			g_array_append_val(matches, match);
+		}
+
+		procheader_header_list_destroy(hlist);
+	}
+
+	if (matches)
+		g_async_queue_push(qpool->queue, matches);
+}
+
+static void query_search_split_folder(QuerySearchPool *qpool,
+				      QuerySearchFolder *qfolder)
+{
+	GSList *cur;
+	guint i, n_chunks;
+
+	if (!qfolder->is_local) {
+		G_LOCK(query_search_remote);
+		if (!search_window.cancelled)
+			qfolder->mlist = folder_item_get_msg_list
+				(qfolder->item, TRUE);
+		G_UNLOCK(query_search_remote);
+		qfolder->n_msgs = g_slist_length(qfolder->mlist);
+		g_atomic_int_add(&qpool->total, qfolder->n_msgs);
+	}
+
+	if (qfolder->n_msgs == 0 || search_window.cancelled) {
+		g_async_queue_push(qpool->done_queue, qfolder);
+		return;
+	}
+
+	if (qpool->use_body_index)
+		qfolder->body_index = body_index_open(qfolder->item,
+						      qfolder->mlist);
+
+	qfolder->links = g_new(GSList *, qfolder->n_msgs);
+	for (cur = qfolder->mlist, i = 0; cur != NULL; cur = cur->next, i++)
+		qfolder->links[i] = cur;
+
+	/* remote folders are not searched in parallel. their chunks are
+	   searched in this task, releasing the lock between them */
+	if (!qfolder->is_local) {
+		for (i = 0; i < qfolder->n_msgs && !search_window.cancelled;
+		     i += QUERY_SEARCH_CHUNK_MSGS) {
+			G_LOCK(query_search_remote);
+			query_search_chunk(qpool, qfolder, i,
+					   MIN(i + QUERY_SEARCH_CHUNK_MSGS,
+					       qfolder->n_msgs));
+			G_UNLOCK(query_search_remote);
+		}
+		g_async_queue_push(qpool->done_queue, qfolder);
+		return;
+	}
+
+	n_chunks = (qfolder->n_msgs + QUERY_SEARCH_CHUNK_MSGS - 1) /
+		QUERY_SEARCH_CHUNK_MSGS;
+	g_atomic_int_set(&qfolder->remaining, n_chunks);
+
+	for (i = 0; i < n_chunks; i++)
+		query_search_push_task(qpool, qfolder,
+				       i * QUERY_SEARCH_CHUNK_MSGS,
+				       MIN((i + 1) * QUERY_SEARCH_CHUNK_MSGS,
+					   qfolder->n_msgs));
+}
+
+static void query_search_task_func(gpointer data, gpointer user_data)
+{
+	QuerySearchTask *task = (QuerySearchTask *)data;
+	QuerySearchPool *qpool = (QuerySearchPool *)user_data;
+	QuerySearchFolder *qfolder = task->qfolder;
+
+	if (task->start == G_MAXUINT)
+		query_search_split_folder(qpool, qfolder);
+	else {
+		query_search_chunk(qpool, qfolder, task->start, task->end);
+		if (g_atomic_int_dec_and_test(&qfolder->remaining))
+			g_async_queue_push(qpool->done_queue, qfolder);
+	}
+
+	g_free(task);
+
+	if (g_atomic_int_dec_and_test(&qpool->pending))
+		g_main_context_wakeup(NULL);
+}
+
+static void query_search_pool_flush(QuerySearchPool *qpool)
+{
+	GArray *matches;
+	QuerySearchMatch *match;
+	QuerySearchFolder *qfolder;
+	GSList *busy = NULL, *cur;
+	guint i;
+
+	while ((matches = g_async_queue_try_pop(qpool->queue))) {
+		for (i = 0; i < matches->len; i++) {
+			match = &g_array_index(matches, QuerySearchMatch, i);
+			query_search_append_msg(match->msginfo, match->seq);
+			search_window.n_found++;
+		}
+		g_array_free(matches, TRUE);
+	}
+
+	while ((qfolder = g_async_queue_try_pop(qpool->done_queue))) {
+		if (qfolder->is_local)
+			query_search_folder_free(qfolder);
+		else if (G_TRYLOCK(query_search_remote)) {
+			/* a thread may be loading a folder which shares the
+			   string table */
+			query_search_folder_free(qfolder);
+			G_UNLOCK(query_search_remote);
+		} else
+			busy = g_slist_prepend(busy, qfolder);
+	}
+
+	/* freed on the next call */
+	for (cur = busy; cur != NULL; cur = cur->next)
+		g_async_queue_push(qpool->done_queue, cur->data);
+	g_slist_free(busy);
+}
+
+static gboolean query_search_pool_progress_func(gpointer data)
+{
+	QuerySearchPool *qpool = (QuerySearchPool *)data;
+
+	gdk_threads_enter();
+	if (qpool->folder_name)
+		query_search_folder_show_progress
+			(qpool->folder_name, g_atomic_int_get(&qpool->count),
+			 g_atomic_int_get(&qpool->total));
+	query_search_pool_flush(qpool);
+	gdk_threads_leave();
+
+	return TRUE;
+}
+
+/* Searches the folders with a pool of threads, each taking a folder or a
+   chunk of its messages. The matches are shown as they are found, and
+   sorted in the order of a serial search at the end. */
+static gboolean query_search_folders_parallel(GSList *folders)
+{
+	QuerySearchPool qpool;
+	GSList *cur;
+	gint n_threads;
+	guint folder_index = 0;
+	guint timer_tag;
+
+	n_threads = query_search_get_threads();
+	if (n_threads < 2 || !g_thread_supported())
+		return FALSE;
+
+	memset(&qpool, 0, sizeof(qpool));
+	qpool.pool = g_thread_pool_new(query_search_task_func, &qpool,
+				       n_threads, FALSE, NULL);
+	if (!qpool.pool)
+		return FALSE;
+	qpool.queue = g_async_queue_new();
+	qpool.done_queue = g_async_queue_new();
+	qpool.use_body_index = filter_rule_uses_body_index(search_window.rule);
+
+	debug_print("query_search_folders_parallel: %d threads\n", n_threads);
+
+	procmsg_set_auto_decrypt_message(FALSE);
+	timer_tag = g_timeout_add(PROGRESS_UPDATE_INTERVAL,
+				  query_search_pool_progress_func, &qpool);
+
+	for (cur = folders; cur != NULL; cur = cur->next) {
+		FolderItem *item = FOLDER_ITEM(cur->data);
+		QuerySearchFolder *qfolder;
+
+		if (search_window.cancelled)
+			break;
+		if (!item->path || item->stype == F_VIRTUAL)
+			continue;
+
+		g_free(qpool.folder_name);
+		qpool.folder_name = g_path_get_basename(item->path);
+
+		if (item->opened)
+			summary_write_cache(main_window_get()->summaryview);
+
+		qfolder = g_new0(QuerySearchFolder, 1);
+		qfolder->item = item;
+		qfolder->is_local = FOLDER_IS_LOCAL(item->folder);
+		qfolder->folder_index = folder_index++;
+		/* a remote folder is loaded by the thread which searches
+		   it */
+		if (qfolder->is_local) {
+			qfolder->mlist = folder_item_get_msg_list(item, TRUE);
+			qfolder->n_msgs = g_slist_length(qfolder->mlist);
+			g_atomic_int_add(&qpool.total, qfolder->n_msgs);
+		}
+
+		query_search_push_task(&qpool, qfolder, G_MAXUINT, 0);
+
+		while (gtk_events_pending())
+			gtk_main_iteration();
+	}
+
+	while (g_atomic_int_get(&qpool.pending) > 0)
+		gtk_main_iteration();
+	log_window_flush();
+
+	g_thread_pool_free(qpool.pool, FALSE, TRUE);
+	g_source_remove(timer_tag);
+	query_search_pool_flush(&qpool);
+	g_async_queue_unref(qpool.queue);
+	g_async_queue_unref(qpool.done_queue);
+	g_free(qpool.folder_name);
+	procmsg_set_auto_decrypt_message(TRUE);
+
+	gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE
+					     (search_window.store),
+					     COL_SEQ, GTK_SORT_ASCENDING);
+	gtkut_tree_sortable_unset_sort_column_id
+		(GTK_TREE_SORTABLE(search_window.store));
+
+	debug_print("query_search_folders_parallel: done\n");
+
+	return TRUE;
+}
+#endif /* USE_THREADS */
+
 static gboolean query_search_recursive_func(GNode *node, gpointer data)
 {
+	GSList **folders = (GSList **)data;
 	FolderItem *item;
 
 	g_return_val_if_fail(node->data != NULL, FALSE);
@@ -771,15 +1157,12 @@ static gboolean query_search_recursive_func(GNode *node, gpointer data)
 	if (search_window.exclude_trash && item->stype == F_TRASH)
 		return FALSE;
 
-	query_search_folder(item);
-
-	if (search_window.cancelled)
-		return TRUE;
+	*folders = g_slist_prepend(*folders, item);
 
 	return FALSE;
 }
 
-static void query_search_append_msg(MsgInfo *msginfo)
+static void query_search_append_msg(MsgInfo *msginfo, guint64 seq)
 {
 	GtkListStore *store = search_window.store;
 	GtkTreeIter iter;
@@ -809,6 +1192,7 @@ static void query_search_append_msg(MsgInfo *msginfo)
 			   COL_FROM, from,
 			   COL_DATE, date,
 			   COL_MSGINFO, msginfo,
+			   COL_SEQ, seq,
 			   -1);
 
 	g_free(folder);
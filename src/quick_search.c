@@ -54,6 +54,9 @@ static const struct {
 
 static GdkColor dim_color = {0, COLOR_DIM, COLOR_DIM, COLOR_DIM};
 
+static TrigramIndex *quick_search_get_index
+					(QuickSearch	*qsearch);
+
 static void menu_activated		(GtkWidget	*menuitem,
 					 QuickSearch	*qsearch);
 static gboolean entry_focus_in		(GtkWidget	*entry,
@@ -217,6 +220,8 @@ GSList *quick_search_filter(QuickSearch *qsearch, QSearchCondType type,
 	GSList *rule_list = NULL;
 	GSList *flt_mlist = NULL;
 	GSList *cur;
+	GArray *candidates = NULL;
+	guint i = 0;
 	gint count = 0, total = 0;
 	gchar status_text[1024];
 	gboolean dmode;
@@ -279,9 +284,10 @@ GSList *quick_search_filter(QuickSearch *qsearch, QSearchCondType type,
 	}
 
 	if (key) {
+		TrigramIndex *index;
 		gchar **keys;
-		gint i;
 
+		index = quick_search_get_index(qsearch);
 		keys = g_strsplit(key, " ", -1);
 		for (i = 0; keys[i] != NULL; i++) {
 			cond_list = NULL;
@@ -306,6 +312,10 @@ GSList *quick_search_filter(QuickSearch *qsearch, QSearchCondType type,
 						       FLT_OR, cond_list, NULL);
 				rule_list = g_slist_append(rule_list, rule);
 			}
+
+			/* narrow down the messages to be matched */
+			candidates = trigram_index_lookup(index, keys[i],
+							  candidates);
 		}
 		g_strfreev(keys);
 	}
@@ -314,12 +324,30 @@ GSList *quick_search_filter(QuickSearch *qsearch, QSearchCondType type,
 	dmode = get_debug_mode();
 	set_debug_mode(FALSE);
 
-	for (cur = summaryview->all_mlist; cur != NULL; cur = cur->next) {
-		MsgInfo *msginfo = (MsgInfo *)cur->data;
+	if (candidates)
+		total = qsearch->index_msgs->len;
+	cur = summaryview->all_mlist;
+	i = 0;
+
+	for (;;) {
+		MsgInfo *msginfo;
 		GSList *hlist = NULL;
 		gboolean matched = TRUE;
 
-		total++;
+		if (candidates) {
+			if (i >= candidates->len)
+				break;
+			msginfo = g_ptr_array_index
+				(qsearch->index_msgs,
+				 g_array_index(candidates, guint, i));
+			i++;
+		} else {
+			if (!cur)
+				break;
+			msginfo = (MsgInfo *)cur->data;
+			cur = cur->next;
+			total++;
+		}
 
 		if (status_rule) {
 			if (type == QS_IN_ADDRESSBOOK)
@@ -376,10 +404,77 @@ GSList *quick_search_filter(QuickSearch *qsearch, QSearchCondType type,
 
 	filter_rule_list_free(rule_list);
 	filter_rule_free(status_rule);
+	if (candidates)
+		g_array_free(candidates, TRUE);
 
 	return flt_mlist;
 }
 
+static void quick_search_index_add(QuickSearch *qsearch, GSList *mlist)
+{
+	FolderItem *item = qsearch->summaryview->folder_item;
+	gboolean index_to;
+	GSList *cur;
+	guint id;
+
+	/* index the same headers as quick_search_filter() matches */
+	index_to = FOLDER_ITEM_IS_SENT_FOLDER(item);
+
+	for (cur = mlist; cur != NULL; cur = cur->next) {
+		MsgInfo *msginfo = (MsgInfo *)cur->data;
+
+		id = qsearch->index_msgs->len;
+		g_ptr_array_add(qsearch->index_msgs, msginfo);
+		trigram_index_add_text(qsearch->index, id, msginfo->subject);
+		trigram_index_add_text(qsearch->index, id, msginfo->from);
+		if (index_to) {
+			trigram_index_add_text(qsearch->index, id, msginfo->to);
+			trigram_index_add_text(qsearch->index, id, msginfo->cc);
+		}
+	}
+}
+
+static TrigramIndex *quick_search_get_index(QuickSearch *qsearch)
+{
+	GTimer *timer;
+
+	if (qsearch->index)
+		return qsearch->index;
+
+	timer = g_timer_new();
+
+	qsearch->index = trigram_index_new();
+	qsearch->index_msgs = g_ptr_array_new();
+	quick_search_index_add(qsearch, qsearch->summaryview->all_mlist);
+
+	debug_print("quick_search_get_index: indexed %u messages (%.3f sec)\n",
+		    qsearch->index_msgs->len, g_timer_elapsed(timer, NULL));
+	g_timer_destroy(timer);
+
+	return qsearch->index;
+}
+
+/* Keeps the index in sync with messages appended to all_mlist. */
+void quick_search_index_append(QuickSearch *qsearch, GSList *mlist)
+{
+	if (!qsearch || !qsearch->index)
+		return;
+
+	quick_search_index_add(qsearch, mlist);
+}
+
+/* Drops the index whenever all_mlist is replaced, reordered or shrunk. */
+void quick_search_index_clear(QuickSearch *qsearch)
+{
+	if (!qsearch || !qsearch->index)
+		return;
+
+	trigram_index_free(qsearch->index);
+	qsearch->index = NULL;
+	g_ptr_array_free(qsearch->index_msgs, TRUE);
+	qsearch->index_msgs = NULL;
+}
+
 static void menu_activated(GtkWidget *menuitem, QuickSearch *qsearch)
 {
 	summary_qsearch(qsearch->summaryview);
@@ -25,6 +25,7 @@
 typedef struct _QuickSearch	QuickSearch;
 
 #include "summaryview.h"
+#include "trigram.h"
 
 typedef enum
 {
@@ -53,6 +54,10 @@ struct _QuickSearch
 	SummaryView *summaryview;
 
 	gboolean entry_entered;
+
+	/* keyword index over summaryview->all_mlist, built on demand */
+	TrigramIndex *index;
+	GPtrArray *index_msgs;
 };
 
 QuickSearch *quick_search_create(SummaryView		*summaryview);
@@ -63,4 +68,8 @@ GSList *quick_search_filter	(QuickSearch		*qsearch,
 				 QSearchCondType	 type,
 				 const gchar		*key);
 
+void quick_search_index_append	(QuickSearch		*qsearch,
+				 GSList			*mlist);
+void quick_search_index_clear	(QuickSearch		*qsearch);
+
 #endif /* __QUICK_SEARCH_H__ */
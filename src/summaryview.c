@@ -119,6 +119,8 @@
 #define SUMMARY_DISPLAY_TOTAL_NUM(item) \
 	(summaryview->on_filter ? summaryview->flt_msg_total : item->total)
 
+#define SUMMARY_ROW_CACHE_SIZE	512
+
 #ifdef G_OS_WIN32
 #  define SUMMARY_COL_MARK_WIDTH	23
 #  define SUMMARY_COL_UNREAD_WIDTH	26
@@ -129,6 +131,16 @@
 #  define SUMMARY_COL_MIME_WIDTH	19
 #endif
 
+/* texts of a row, formatted on demand when the row becomes visible */
+typedef struct _SummaryRowData
+{
+	MsgInfo *msginfo;
+	gchar *subject;
+	gchar *from;
+	gchar *date;
+	gchar *to;
+} SummaryRowData;
+
 static GdkPixbuf *mark_pixbuf;
 static GdkPixbuf *deleted_pixbuf;
 
@@ -143,6 +155,8 @@ static GdkPixbuf *html_pixbuf;
 
 static void summary_clear_list_full	(SummaryView		*summaryview,
 					 gboolean		 is_refresh);
+static void summary_append_queued_msgs	(SummaryView		*summaryview,
+					 gboolean		 scroll_to_new);
 
 static GList *summary_get_selected_rows	(SummaryView		*summaryview);
 static void summary_selection_list_free	(SummaryView		*summaryview);
@@ -157,6 +171,12 @@ static void summary_update_msg_list	(SummaryView		*summaryview);
 static void summary_msgid_table_create	(SummaryView		*summaryview);
 static void summary_msgid_table_destroy	(SummaryView		*summaryview);
 
+static void summary_threader_create	(SummaryView		*summaryview);
+static void summary_threader_destroy	(SummaryView		*summaryview);
+static void summary_update_thread_date	(SummaryView		*summaryview,
+					 GtkTreeIter		*iter,
+					 MsgInfo		*msginfo);
+
 static void summary_set_menu_sensitive	(SummaryView		*summaryview);
 
 static void summary_scroll_to_selected	(SummaryView		*summaryview,
@@ -207,6 +227,19 @@ static void summary_status_show		(SummaryView		*summaryview);
 static void summary_set_row		(SummaryView		*summaryview,
 					 GtkTreeIter		*iter,
 					 MsgInfo		*msginfo);
+static SummaryRowData *summary_row_data_get
+					(SummaryView		*summaryview,
+					 MsgInfo		*msginfo);
+static void summary_row_data_remove	(SummaryView		*summaryview,
+					 MsgInfo		*msginfo);
+static void summary_row_data_clear	(SummaryView		*summaryview);
+static const gchar *summary_get_toname	(SummaryView		*summaryview,
+					 MsgInfo		*msginfo);
+static void summary_cell_data_func	(GtkTreeViewColumn	*column,
+					 GtkCellRenderer	*renderer,
+					 GtkTreeModel		*model,
+					 GtkTreeIter		*iter,
+					 gpointer		 data);
 static void summary_set_tree_model_from_list
 					(SummaryView		*summaryview,
 					 GSList			*mlist);
@@ -284,6 +317,10 @@ static void summary_row_collapsed	(GtkTreeView		*treeview,
 					 GtkTreePath		*path,
 					 SummaryView		*summaryview);
 
+static void summary_row_deleted		(GtkTreeModel		*model,
+					 GtkTreePath		*path,
+					 SummaryView		*summaryview);
+
 static void summary_columns_changed	(GtkTreeView		*treeview,
 					 SummaryView		*summaryview);
 
@@ -1023,6 +1060,7 @@ static void summary_clear_list_full(SummaryView *summaryview,
 	summaryview->copied = 0;
 
 	summary_msgid_table_destroy(summaryview);
+	summary_threader_destroy(summaryview);
 
 	summaryview->tmp_mlist = NULL;
 	summaryview->to_folder = NULL;
@@ -1062,10 +1100,12 @@ static void summary_clear_list_full(SummaryView *summaryview,
 	}
 	summaryview->on_filter = FALSE;
 
+	quick_search_index_clear(summaryview->qsearch);
 	procmsg_msg_list_free(summaryview->all_mlist);
 	summaryview->all_mlist = NULL;
 
 	gtkut_tree_view_fast_clear(treeview, summaryview->store);
+	summary_row_data_clear(summaryview);
 
 	/* ensure that the "value-changed" signal is always emitted */
 	adj = gtk_tree_view_get_vadjustment(treeview);
@@ -1086,10 +1126,6 @@ void summary_clear_all(SummaryView *summaryview)
 void summary_show_queued_msgs(SummaryView *summaryview)
 {
 	FolderItem *item;
-	GSList *qlist, *cur;
-	MsgInfo *msginfo;
-	GtkTreeStore *store = GTK_TREE_STORE(summaryview->store);
-	GtkTreeIter iter;
 
 	if (summary_is_locked(summaryview))
 		return;
@@ -1099,7 +1135,78 @@ void summary_show_queued_msgs(SummaryView *summaryview)
 	    item->stype == F_VIRTUAL)
 		return;
 
-	debug_print("summary_show_queued_msgs: appending queued messages to summary (%s)\n", item->path);
+	summary_append_queued_msgs(summaryview, TRUE);
+}
+
+/* append the new messages of the displayed folder to the current list
+   instead of reloading the whole summary. Returns FALSE if the summary
+   must be reloaded with summary_show() */
+gboolean summary_update_queued_msgs(SummaryView *summaryview)
+{
+	FolderItem *item;
+	GtkTreeModel *model = GTK_TREE_MODEL(summaryview->store);
+	GtkTreePath *start_path = NULL, *end_path = NULL;
+	GtkTreeRowReference *top_ref = NULL;
+	GtkTreeIter iter;
+
+	if (summary_is_locked(summaryview))
+		return FALSE;
+
+	item = summaryview->folder_item;
+	if (!item || !item->path || !item->cache_queue ||
+	    item->stype == F_VIRTUAL || summaryview->on_filter)
+		return FALSE;
+
+	/* messages may also have been removed */
+	if (item->total != g_slist_length(summaryview->all_mlist) +
+	    g_slist_length(item->cache_queue))
+		return FALSE;
+
+	debug_print("summary_update_queued_msgs: updating summary (%s)\n",
+		    item->path);
+
+	/* keep the row at the top of the view */
+#if GTK_CHECK_VERSION(2, 8, 0)
+	if (gtk_tree_view_get_visible_range
+		(GTK_TREE_VIEW(summaryview->treeview), &start_path, &end_path)) {
+		top_ref = gtk_tree_row_reference_new(model, start_path);
+		gtk_tree_path_free(end_path);
+		gtk_tree_path_free(start_path);
+	}
+#endif
+
+	summary_append_queued_msgs(summaryview, FALSE);
+
+	if (top_ref) {
+		if (gtkut_tree_row_reference_get_iter(model, top_ref, &iter)) {
+			GtkTreePath *path;
+
+			path = gtk_tree_model_get_path(model, &iter);
+			gtk_tree_view_scroll_to_cell
+				(GTK_TREE_VIEW(summaryview->treeview), path,
+				 NULL, TRUE, 0.0, 0.0);
+			gtk_tree_path_free(path);
+		}
+		gtk_tree_row_reference_free(top_ref);
+	}
+
+	return TRUE;
+}
+
+static void summary_append_queued_msgs(SummaryView *summaryview,
+				       gboolean scroll_to_new)
+{
+	FolderItem *item = summaryview->folder_item;
+	GSList *qlist, *cur;
+	MsgInfo *msginfo;
+	GtkTreeStore *store = GTK_TREE_STORE(summaryview->store);
+	GtkTreeIter iter, *parent_iter;
+	gboolean rethread = FALSE;
+
+	if (item->threaded && !summaryview->threader)
+		summary_threader_create(summaryview);
+
+	debug_print("summary_append_queued_msgs: appending queued messages to summary (%s)\n", item->path);
 
 	qlist = g_slist_reverse(item->cache_queue);
 	item->cache_queue = NULL;
@@ -1111,13 +1218,33 @@ void summary_show_queued_msgs(SummaryView *summaryview)
 	for (cur = qlist; cur != NULL; cur = cur->next) {
 		msginfo = (MsgInfo *)cur->data;
 
-		debug_print("summary_show_queued_msgs: appending msg %u\n",
+		debug_print("summary_append_queued_msgs: appending msg %u\n",
 			    msginfo->msgnum);
 		msginfo->folder = item;
-		gtk_tree_store_append(store, &iter, NULL);
+		parent_iter = NULL;
+		if (summaryview->threader) {
+			MsgInfo *parent;
+			gboolean moved = FALSE;
+
+			parent = procthread_insert_full(summaryview->threader,
+							msginfo, &moved);
+			if (moved)
+				rethread = TRUE;
+			if (parent)
+				parent_iter = g_hash_table_lookup
+					(summaryview->threader_iter_table,
+					 parent);
+		}
+		gtk_tree_store_append(store, &iter, parent_iter);
 		summary_set_row(summaryview, &iter, msginfo);
+		if (summaryview->threader) {
+			summary_update_thread_date(summaryview, &iter,
+						   msginfo);
+			g_hash_table_insert(summaryview->threader_iter_table,
+					    msginfo, gtk_tree_iter_copy(&iter));
+		}
 
-		if (cur == qlist) {
+		if (cur == qlist && scroll_to_new) {
 			GtkTreePath *path;
 
 			path = gtk_tree_model_get_path(GTK_TREE_MODEL(store),
@@ -1131,14 +1258,23 @@ void summary_show_queued_msgs(SummaryView *summaryview)
 		summaryview->total_size += msginfo->size;
 	}
 
+	quick_search_index_append(summaryview->qsearch, qlist);
 	summaryview->all_mlist = g_slist_concat(summaryview->all_mlist, qlist);
 
+	/* a new message adopted rows which are already shown. they are
+	   under their old parents, so the threads are built again */
+	if (rethread) {
+		debug_print("summary_append_queued_msgs: rebuilding threads\n");
+		summary_unthread(summaryview);
+		summary_thread_build(summaryview);
+	}
+
 	item->cache_dirty = TRUE;
 	summary_selection_list_free(summaryview);
 
 	summary_status_show(summaryview);
 
-	debug_print("summary_show_queued_msgs: done.\n");
+	debug_print("summary_append_queued_msgs: done.\n");
 }
 
 void summary_lock(SummaryView *summaryview)
@@ -1356,6 +1492,7 @@ static void summary_update_msg_list(SummaryView *summaryview)
 	if (summaryview->on_filter)
 		return;
 
+	quick_search_index_clear(summaryview->qsearch);
 	g_slist_free(summaryview->all_mlist);
 	summaryview->all_mlist = NULL;
 
@@ -1407,6 +1544,67 @@ static void summary_msgid_table_create(SummaryView *summaryview)
 	summaryview->msgid_table = msgid_table;
 }
 
+static gboolean summary_threader_create_func(GtkTreeModel *model,
+					     GtkTreePath *path,
+					     GtkTreeIter *iter, gpointer data)
+{
+	SummaryView *summaryview = (SummaryView *)data;
+	MsgInfo *msginfo;
+
+	gtk_tree_model_get(model, iter, S_COL_MSG_INFO, &msginfo, -1);
+	if (msginfo) {
+		procthread_insert(summaryview->threader, msginfo);
+		g_hash_table_insert(summaryview->threader_iter_table, msginfo,
+				    gtk_tree_iter_copy(iter));
+	}
+
+	return FALSE;
+}
+
+/* build the thread engine from the current rows. It is discarded when
+   any row is removed, because the iters are no longer valid */
+static void summary_threader_create(SummaryView *summaryview)
+{
+	g_return_if_fail(summaryview->threader == NULL);
+
+	summaryview->threader =
+		procthread_new(prefs_common.thread_by_subject);
+	summaryview->threader_iter_table =
+		g_hash_table_new_full(NULL, NULL, NULL,
+				      (GDestroyNotify)gtk_tree_iter_free);
+
+	gtk_tree_model_foreach(GTK_TREE_MODEL(summaryview->store),
+			       summary_threader_create_func, summaryview);
+}
+
+static void summary_threader_destroy(SummaryView *summaryview)
+{
+	if (!summaryview->threader)
+		return;
+
+	procthread_free(summaryview->threader);
+	summaryview->threader = NULL;
+	g_hash_table_destroy(summaryview->threader_iter_table);
+	summaryview->threader_iter_table = NULL;
+}
+
+static void summary_update_thread_date(SummaryView *summaryview,
+				       GtkTreeIter *iter, MsgInfo *msginfo)
+{
+	GtkTreeModel *model = GTK_TREE_MODEL(summaryview->store);
+	GtkTreeIter top, parent;
+	guint tdate = 0;
+
+	top = *iter;
+	while (gtk_tree_model_iter_parent(model, &parent, &top))
+		top = parent;
+
+	gtk_tree_model_get(model, &top, S_COL_TDATE, &tdate, -1);
+	if (tdate < msginfo->date_t)
+		gtk_tree_store_set(summaryview->store, &top,
+				   S_COL_TDATE, (guint)msginfo->date_t, -1);
+}
+
 static void summary_msgid_table_destroy(SummaryView *summaryview)
 {
 	if (!summaryview->msgid_table)
@@ -2412,14 +2610,6 @@ static void summary_set_row(SummaryView *summaryview, GtkTreeIter *iter,
 			    MsgInfo *msginfo)
 {
 	GtkTreeStore *store = GTK_TREE_STORE(summaryview->store);
-	gchar date_modified[80];
-	const gchar *date_s;
-	gchar *sw_from_s = NULL;
-	gchar *subject_s = NULL;
-	gchar *to_s = NULL;
-	GdkPixbuf *mark_pix = NULL;
-	GdkPixbuf *unread_pix = NULL;
-	GdkPixbuf *mime_pix = NULL;
 	GdkColor *foreground = NULL;
 	PangoWeight weight = PANGO_WEIGHT_NORMAL;
 	MsgFlags flags;
@@ -2430,64 +2620,16 @@ static void summary_set_row(SummaryView *summaryview, GtkTreeIter *iter,
 		GET_MSG_INFO(msginfo, iter);
 	}
 
-	if (msginfo->date_t) {
-		procheader_date_get_localtime(date_modified,
-					      sizeof(date_modified),
-					      msginfo->date_t);
-		date_s = date_modified;
-	} else if (msginfo->date)
-		date_s = msginfo->date;
-	else
-		date_s = _("(No Date)");
-	if (prefs_common.swap_from && msginfo->from && msginfo->to) {
-		gchar from[BUFFSIZE];
-
-		strncpy2(from, msginfo->from, sizeof(from));
-		extract_address(from);
-		if (account_address_exist(from))
-			sw_from_s = g_strconcat("-->", msginfo->to, NULL);
-	}
-
-	if (msginfo->subject && *msginfo->subject) {
-		if (msginfo->folder && msginfo->folder->trim_summary_subject) {
-			subject_s = g_strdup(msginfo->subject);
-			trim_subject(subject_s);
-		}
-	}
-
-	if (msginfo->to)
-		to_s = procheader_get_toname(msginfo->to);
+	/* texts and pixbufs are rendered lazily by summary_cell_data_func();
+	   only the cheap attributes are stored in the model */
+	summary_row_data_remove(summaryview, msginfo);
 
 	flags = msginfo->flags;
 
-	/* set flag pixbufs */
-	if (MSG_IS_DELETED(flags)) {
-		mark_pix = deleted_pixbuf;
+	if (MSG_IS_DELETED(flags))
 		foreground = &summaryview->color_dim;
-	} else if (MSG_IS_MOVE(flags)) {
-		/* mark_pix = move_pixbuf; */
+	else if (MSG_IS_MOVE(flags) || MSG_IS_COPY(flags))
 		foreground = &summaryview->color_marked;
-	} else if (MSG_IS_COPY(flags)) {
-		/* mark_pix = copy_pixbuf; */
-		foreground = &summaryview->color_marked;
-	} else if (MSG_IS_MARKED(flags))
-		mark_pix = mark_pixbuf;
-
-	if (MSG_IS_NEW(flags))
-		unread_pix = new_pixbuf;
-	else if (MSG_IS_UNREAD(flags))
-		unread_pix = unread_pixbuf;
-	else if (MSG_IS_REPLIED(flags))
-		unread_pix = replied_pixbuf;
-	else if (MSG_IS_FORWARDED(flags))
-		unread_pix = forwarded_pixbuf;
-
-	if (MSG_IS_MIME(flags)) {
-		mime_pix = clip_pixbuf;
-	}
-	if (MSG_IS_MIME_HTML(flags)) {
-		mime_pix = html_pixbuf;
-	}
 
 	if (prefs_common.bold_unread) {
 		if (MSG_IS_UNREAD(flags))
@@ -2513,19 +2655,7 @@ static void summary_set_row(SummaryView *summaryview, GtkTreeIter *iter,
 	}
 
 	gtk_tree_store_set(store, iter,
-			   S_COL_MARK, mark_pix,
-			   S_COL_UNREAD, unread_pix,
-			   S_COL_MIME, mime_pix,
-			   S_COL_SUBJECT, subject_s ? subject_s :
-			   		  msginfo->subject && *msginfo->subject ? msginfo->subject :
-					  _("(No Subject)"),
-			   S_COL_FROM, sw_from_s ? sw_from_s :
-			   	       msginfo->fromname ? msginfo->fromname :
-				       _("(No From)"),
-			   S_COL_DATE, date_s,
-			   S_COL_SIZE, to_human_readable(msginfo->size),
 			   S_COL_NUMBER, msginfo->msgnum,
-			   S_COL_TO, to_s ? to_s : "",
 
 			   S_COL_MSG_INFO, msginfo,
 
@@ -2534,13 +2664,222 @@ static void summary_set_row(SummaryView *summaryview, GtkTreeIter *iter,
 			   S_COL_FOREGROUND, foreground,
 			   S_COL_BOLD, weight,
 			   -1);
+}
+
+static void summary_row_data_free(SummaryRowData *data)
+{
+	g_free(data->subject);
+	g_free(data->from);
+	g_free(data->date);
+	g_free(data->to);
+	g_free(data);
+}
+
+static SummaryRowData *summary_row_data_get(SummaryView *summaryview,
+					    MsgInfo *msginfo)
+{
+	SummaryRowData *data;
+	GList *link;
+	gchar date_modified[80];
+
+	if (!summaryview->row_cache) {
+		summaryview->row_cache = g_hash_table_new(NULL, NULL);
+		summaryview->row_lru = g_queue_new();
+	}
+
+	link = g_hash_table_lookup(summaryview->row_cache, msginfo);
+	if (link) {
+		/* move to the head of the LRU list */
+		if (link != summaryview->row_lru->head) {
+			g_queue_unlink(summaryview->row_lru, link);
+			g_queue_push_head_link(summaryview->row_lru, link);
+		}
+		return (SummaryRowData *)link->data;
+	}
+
+	if (g_queue_get_length(summaryview->row_lru) >=
+	    SUMMARY_ROW_CACHE_SIZE) {
+		link = g_queue_pop_tail_link(summaryview->row_lru);
+		data = (SummaryRowData *)link->data;
+		g_hash_table_remove(summaryview->row_cache, data->msginfo);
+		summary_row_data_free(data);
+		g_list_free_1(link);
+	}
+
+	data = g_new0(SummaryRowData, 1);
+	data->msginfo = msginfo;
+
+	if (msginfo->subject && *msginfo->subject) {
+		data->subject = g_strdup(msginfo->subject);
+		if (msginfo->folder && msginfo->folder->trim_summary_subject)
+			trim_subject(data->subject);
+	} else
+		data->subject = g_strdup(_("(No Subject)"));
+
+	if (prefs_common.swap_from && msginfo->from && msginfo->to) {
+		gchar from[BUFFSIZE];
+
+		strncpy2(from, msginfo->from, sizeof(from));
+		extract_address(from);
+		if (account_address_exist(from))
+			data->from = g_strconcat("-->", msginfo->to, NULL);
+	}
+	if (!data->from)
+		data->from = g_strdup(msginfo->fromname ? msginfo->fromname
+					: _("(No From)"));
+
+	if (msginfo->date_t) {
+		procheader_date_get_localtime(date_modified,
+					      sizeof(date_modified),
+					      msginfo->date_t);
+		data->date = g_strdup(date_modified);
+	} else if (msginfo->date)
+		data->date = g_strdup(msginfo->date);
+	else
+		data->date = g_strdup(_("(No Date)"));
+
+	if (msginfo->to)
+		data->to = procheader_get_toname(msginfo->to);
+	else
+		data->to = g_strdup("");
+
+	g_queue_push_head(summaryview->row_lru, data);
+	g_hash_table_insert(summaryview->row_cache, msginfo,
+			    summaryview->row_lru->head);
+
+	return data;
+}
+
+static void summary_row_data_remove(SummaryView *summaryview,
+				    MsgInfo *msginfo)
+{
+	GList *link;
+
+	if (summaryview->toname_table)
+		g_hash_table_remove(summaryview->toname_table, msginfo);
+	if (!summaryview->row_cache)
+		return;
+
+	link = g_hash_table_lookup(summaryview->row_cache, msginfo);
+	if (link) {
+		g_hash_table_remove(summaryview->row_cache, msginfo);
+		g_queue_unlink(summaryview->row_lru, link);
+		summary_row_data_free((SummaryRowData *)link->data);
+		g_list_free_1(link);
+	}
+}
+
+static void summary_row_data_clear(SummaryView *summaryview)
+{
+	SummaryRowData *data;
+
+	if (summaryview->toname_table) {
+		g_hash_table_destroy(summaryview->toname_table);
+		summaryview->toname_table = NULL;
+	}
+	if (!summaryview->row_cache)
+		return;
 
-	if (to_s)
-		g_free(to_s);
-	if (subject_s)
-		g_free(subject_s);
-	if (sw_from_s)
-		g_free(sw_from_s);
+	while ((data = g_queue_pop_head(summaryview->row_lru)) != NULL)
+		summary_row_data_free(data);
+	g_hash_table_destroy(summaryview->row_cache);
+	summaryview->row_cache = g_hash_table_new(NULL, NULL);
+}
+
+static const gchar *summary_get_toname(SummaryView *summaryview,
+				       MsgInfo *msginfo)
+{
+	gchar *to;
+
+	if (!summaryview->toname_table)
+		summaryview->toname_table = g_hash_table_new_full
+			(NULL, NULL, NULL, g_free);
+
+	to = g_hash_table_lookup(summaryview->toname_table, msginfo);
+	if (!to) {
+		to = msginfo->to ? procheader_get_toname(msginfo->to)
+			: g_strdup("");
+		g_hash_table_insert(summaryview->toname_table, msginfo, to);
+	}
+
+	return to;
+}
+
+static void summary_cell_data_func(GtkTreeViewColumn *column,
+				   GtkCellRenderer *renderer,
+				   GtkTreeModel *model, GtkTreeIter *iter,
+				   gpointer data)
+{
+	SummaryView *summaryview = (SummaryView *)data;
+	SummaryColumnType type;
+	SummaryRowData *row;
+	MsgInfo *msginfo = NULL;
+	GdkPixbuf *pixbuf = NULL;
+	MsgFlags flags;
+
+	type = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(column),
+						 "column_id"));
+	gtk_tree_model_get(model, iter, S_COL_MSG_INFO, &msginfo, -1);
+	if (!msginfo) {
+		if (GTK_IS_CELL_RENDERER_PIXBUF(renderer))
+			g_object_set(renderer, "pixbuf", NULL, NULL);
+		else
+			g_object_set(renderer, "text", NULL, NULL);
+		return;
+	}
+
+	flags = msginfo->flags;
+
+	switch (type) {
+	case S_COL_MARK:
+		if (MSG_IS_DELETED(flags))
+			pixbuf = deleted_pixbuf;
+		else if (MSG_IS_MARKED(flags) && !MSG_IS_MOVE(flags) &&
+			 !MSG_IS_COPY(flags))
+			pixbuf = mark_pixbuf;
+		g_object_set(renderer, "pixbuf", pixbuf, NULL);
+		break;
+	case S_COL_UNREAD:
+		if (MSG_IS_NEW(flags))
+			pixbuf = new_pixbuf;
+		else if (MSG_IS_UNREAD(flags))
+			pixbuf = unread_pixbuf;
+		else if (MSG_IS_REPLIED(flags))
+			pixbuf = replied_pixbuf;
+		else if (MSG_IS_FORWARDED(flags))
+			pixbuf = forwarded_pixbuf;
+		g_object_set(renderer, "pixbuf", pixbuf, NULL);
+		break;
+	case S_COL_MIME:
+		if (MSG_IS_MIME_HTML(flags))
+			pixbuf = html_pixbuf;
+		else if (MSG_IS_MIME(flags))
+			pixbuf = clip_pixbuf;
+		g_object_set(renderer, "pixbuf", pixbuf, NULL);
+		break;
+	case S_COL_SIZE:
+		g_object_set(renderer, "text",
+			     to_human_readable(msginfo->size), NULL);
+		break;
+	case S_COL_SUBJECT:
+		row = summary_row_data_get(summaryview, msginfo);
+		g_object_set(renderer, "text", row->subject, NULL);
+		break;
+	case S_COL_FROM:
+		row = summary_row_data_get(summaryview, msginfo);
+		g_object_set(renderer, "text", row->from, NULL);
+		break;
+	case S_COL_DATE:
+		row = summary_row_data_get(summaryview, msginfo);
+		g_object_set(renderer, "text", row->date, NULL);
+		break;
+	case S_COL_TO:
+		row = summary_row_data_get(summaryview, msginfo);
+		g_object_set(renderer, "text", row->to, NULL);
+		break;
+	default:
+		break;
+	}
 }
 
 static void summary_insert_gnode(SummaryView *summaryview, GtkTreeStore *store,
@@ -2616,7 +2955,10 @@ static void summary_set_tree_model_from_list(SummaryView *summaryview,
 	if (summaryview->folder_item->threaded) {
 		GNode *root, *gnode;
 
-		root = procmsg_get_thread_tree(mlist);
+		/* the thread index is kept only for the whole folder */
+		root = procmsg_get_thread_tree_full
+			(summaryview->on_filter ? NULL
+			 : summaryview->folder_item, mlist);
 
 		for (gnode = root->children; gnode != NULL;
 		     gnode = gnode->next) {
@@ -2682,18 +3024,13 @@ static void summary_set_tree_model_from_list(SummaryView *summaryview,
 	STATUSBAR_POP(summaryview->mainwin);
 }
 
-struct wcachefp
-{
-	FILE *cache_fp;
-	FILE *mark_fp;
-};
-
 gint summary_write_cache(SummaryView *summaryview)
 {
-	struct wcachefp fps;
+	FILE *mark_fp = NULL;
 	FolderItem *item;
 	gchar *buf;
 	GSList *cur;
+	gboolean cache_dirty;
 
 	item = summaryview->folder_item;
 	if (!item || !item->path)
@@ -2703,25 +3040,20 @@ gint summary_write_cache(SummaryView *summaryview)
 	if (!item->cache_dirty && !item->mark_dirty)
 		return 0;
 
-	if (item->cache_dirty) {
-		fps.cache_fp = procmsg_open_cache_file(item, DATA_WRITE);
-		if (fps.cache_fp == NULL)
-			return -1;
+	cache_dirty = item->cache_dirty;
+	if (cache_dirty)
 		item->mark_dirty = TRUE;
-	} else
-		fps.cache_fp = NULL;
 
-	if (item->mark_dirty && item->stype != F_VIRTUAL) {
-		fps.mark_fp = procmsg_open_mark_file(item, DATA_WRITE);
-		if (fps.mark_fp == NULL) {
-			if (fps.cache_fp)
-				fclose(fps.cache_fp);
+	/* only the cache rewrite needs to rewrite the whole mark file;
+	   otherwise the changed flags are appended to it */
+	if (cache_dirty && item->stype != F_VIRTUAL) {
+		mark_fp = procmsg_open_mark_file(item, DATA_WRITE);
+		if (mark_fp == NULL)
 			return -1;
-		}
-	} else
-		fps.mark_fp = NULL;
+		item->mark_records = 0;
+	}
 
-	if (item->cache_dirty) {
+	if (cache_dirty) {
 		buf = g_strdup_printf(_("Writing summary cache (%s)..."),
 				      item->path);
 		debug_print("%s", buf);
@@ -2733,26 +3065,35 @@ gint summary_write_cache(SummaryView *summaryview)
 	for (cur = summaryview->all_mlist; cur != NULL; cur = cur->next) {
 		MsgInfo *msginfo = (MsgInfo *)cur->data;
 
-		if (msginfo->folder && msginfo->folder->mark_queue != NULL) {
+		if (msginfo->folder && msginfo->folder->mark_queue != NULL &&
+		    MSG_IS_NEW(msginfo->flags)) {
 			MSG_UNSET_PERM_FLAGS(msginfo->flags, MSG_NEW);
+			MSG_SET_TMP_FLAGS(msginfo->flags, MSG_FLAG_CHANGED);
+		}
+		if (mark_fp) {
+			procmsg_write_flags(msginfo, mark_fp);
+			MSG_UNSET_TMP_FLAGS(msginfo->flags, MSG_FLAG_CHANGED);
+			item->mark_records++;
 		}
-		if (fps.cache_fp)
-			procmsg_write_cache(msginfo, fps.cache_fp);
-		if (fps.mark_fp)
-			procmsg_write_flags(msginfo, fps.mark_fp);
 	}
 
-	if (item->cache_queue)
-		procmsg_flush_cache_queue(item, fps.cache_fp);
-	if (item->mark_queue)
-		procmsg_flush_mark_queue(item, fps.mark_fp);
+	/* the cache is written at once since its index is sorted */
+	if (cache_dirty)
+		procmsg_write_cache_list(item, summaryview->all_mlist);
+	else if (item->cache_queue)
+		procmsg_flush_cache_queue(item, NULL);
+	if (mark_fp) {
+		if (item->mark_queue)
+			procmsg_flush_mark_queue(item, mark_fp);
+	} else if (item->mark_dirty && item->stype != F_VIRTUAL)
+		procmsg_append_flags_list(item, summaryview->all_mlist);
+	else if (item->mark_queue)
+		procmsg_flush_mark_queue(item, NULL);
 
 	item->unmarked_num = 0;
 
-	if (fps.cache_fp)
-		fclose(fps.cache_fp);
-	if (fps.mark_fp)
-		fclose(fps.mark_fp);
+	if (mark_fp)
+		fclose(mark_fp);
 
 	if (item->stype == F_VIRTUAL) {
 		GSList *mlist;
@@ -2767,7 +3108,7 @@ gint summary_write_cache(SummaryView *summaryview)
 
 	debug_print(_("done.\n"));
 
-	if (item->cache_dirty) {
+	if (cache_dirty) {
 		STATUSBAR_POP(summaryview->mainwin);
 	}
 
@@ -4087,6 +4428,7 @@ static void summary_remove_invalid_messages(SummaryView *summaryview)
 		}
 
 		gtk_tree_store_remove(GTK_TREE_STORE(model), &iter);
+		quick_search_index_clear(summaryview->qsearch);
 		summaryview->all_mlist = g_slist_remove(summaryview->all_mlist,
 							msginfo);
 		if (summaryview->flt_mlist)
@@ -4332,7 +4674,9 @@ void summary_thread_build(SummaryView *summaryview)
 	summaryview->folder_item->threaded = TRUE;
 
 	mlist = summary_get_msg_list(summaryview);
-	root = procmsg_get_thread_tree(mlist);
+	root = procmsg_get_thread_tree_full
+		(summaryview->on_filter ? NULL : summaryview->folder_item,
+		 mlist);
 	node_table = g_hash_table_new(NULL, NULL);
 	for (node = root->children; node != NULL; node = node->next) {
 		g_hash_table_insert(node_table, node->data, node);
@@ -4586,6 +4930,7 @@ static GNode *summary_get_modified_node(SummaryView *summaryview,
 		parent = node;
 		sibling = NULL;
 	} else {
+		quick_search_index_clear(summaryview->qsearch);
 		summaryview->all_mlist = g_slist_remove(summaryview->all_mlist,
 							msginfo);
 		if (summaryview->flt_mlist)
@@ -5044,6 +5389,8 @@ static void summary_junk_func(GtkTreeModel *model, GtkTreePath *path,
 		if (ret == 0 &&
 		    msginfo->flags.perm_flags != fltinfo->flags.perm_flags) {
 			msginfo->flags = fltinfo->flags;
+			MSG_SET_TMP_FLAGS(msginfo->flags, MSG_FLAG_CHANGED);
+			summaryview->folder_item->mark_dirty = TRUE;
 			summary_set_row(summaryview, iter, msginfo);
 			if (MSG_IS_IMAP(msginfo->flags)) {
 				if (fltinfo->actions[FLT_ACTION_MARK_READ])
@@ -5466,18 +5813,25 @@ static GtkWidget *summary_tree_view_create(SummaryView *summaryview)
 {									\
 	renderer = gtk_cell_renderer_ ## type ## _new();		\
 	g_object_set(renderer, "xalign", align, "ypad", 0, NULL);	\
-	column = gtk_tree_view_column_new_with_attributes		\
-		(title, renderer, # type , col, NULL);			\
+	column = gtk_tree_view_column_new();				\
+	gtk_tree_view_column_set_title(column, title);			\
+	gtk_tree_view_column_pack_start(column, renderer, TRUE);	\
 	g_object_set_data(G_OBJECT(column), "column_id",		\
 			  GINT_TO_POINTER(col));			\
 	summaryview->columns[col] = column;				\
+	if (col == S_COL_NUMBER)					\
+		gtk_tree_view_column_add_attribute			\
+			(column, renderer, # type, col);		\
+	else								\
+		gtk_tree_view_column_set_cell_data_func			\
+			(column, renderer, summary_cell_data_func,	\
+			 summaryview, NULL);				\
 	if (text_attr) {						\
-		gtk_tree_view_column_set_attributes			\
+		gtk_tree_view_column_add_attribute			\
 			(column, renderer,				\
-			 # type, col,					\
-			 "foreground-gdk", S_COL_FOREGROUND,		\
-			 "weight", S_COL_BOLD,				\
-			 NULL);						\
+			 "foreground-gdk", S_COL_FOREGROUND);		\
+		gtk_tree_view_column_add_attribute			\
+			(column, renderer, "weight", S_COL_BOLD);	\
 		gtk_tree_view_column_set_resizable(column, TRUE);	\
 	}								\
 	gtk_tree_view_column_set_alignment(column, align);		\
@@ -5563,6 +5917,9 @@ static GtkWidget *summary_tree_view_create(SummaryView *summaryview)
 	g_signal_connect(G_OBJECT(treeview), "columns-changed",
 			 G_CALLBACK(summary_columns_changed), summaryview);
 
+	g_signal_connect(G_OBJECT(store), "row-deleted",
+			 G_CALLBACK(summary_row_deleted), summaryview);
+
 	gtk_tree_view_enable_model_drag_source
 		(GTK_TREE_VIEW(treeview),
 		 GDK_BUTTON1_MASK, summary_drag_types, N_DRAG_TYPES,
@@ -6186,6 +6543,12 @@ static void summary_set_bold_recursive(SummaryView *summaryview,
 	}
 }
 
+static void summary_row_deleted(GtkTreeModel *model, GtkTreePath *path,
+				SummaryView *summaryview)
+{
+	summary_threader_destroy(summaryview);
+}
+
 static void summary_row_expanded(GtkTreeView *treeview, GtkTreeIter *iter,
 				 GtkTreePath *path, SummaryView *summaryview)
 {
@@ -6620,25 +6983,18 @@ static gint summary_cmp_by_to(GtkTreeModel *model,
 				   GtkTreeIter *a, GtkTreeIter *b,
 				   gpointer data)
 {
+	SummaryView *summaryview = (SummaryView *)data;
 	MsgInfo *msginfo_a = NULL, *msginfo_b = NULL;
-	gchar *to_a = NULL, *to_b = NULL;
 	gint ret;
 
-	gtk_tree_model_get(model, a, S_COL_MSG_INFO, &msginfo_a,
-			   S_COL_TO, &to_a, -1);
-	gtk_tree_model_get(model, b, S_COL_MSG_INFO, &msginfo_b,
-			   S_COL_TO, &to_b, -1);
+	gtk_tree_model_get(model, a, S_COL_MSG_INFO, &msginfo_a, -1);
+	gtk_tree_model_get(model, b, S_COL_MSG_INFO, &msginfo_b, -1);
 
-	if (!msginfo_a || !msginfo_b) {
-		g_free(to_b);
-		g_free(to_a);
+	if (!msginfo_a || !msginfo_b)
 		return 0;
-	}
-
-	ret = g_ascii_strcasecmp(to_a ? to_a : "", to_b ? to_b : "");
 
-	g_free(to_b);
-	g_free(to_a);
+	ret = g_ascii_strcasecmp(summary_get_toname(summaryview, msginfo_a),
+				 summary_get_toname(summaryview, msginfo_b));
 
 	return (ret != 0) ? ret :
 		(msginfo_a->date_t - msginfo_b->date_t);
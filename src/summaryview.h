@@ -41,6 +41,7 @@ typedef struct _SummaryColumnState	SummaryColumnState;
 #include "filter.h"
 #include "folder.h"
 #include "procmsg.h"
+#include "procthread.h"
 
 typedef enum
 {
@@ -163,6 +164,17 @@ private:
 	/* junk filter list */
 	GSList *junk_fltlist;
 
+	/* LRU cache of formatted row texts (MsgInfo -> GList link) */
+	GHashTable *row_cache;
+	GQueue *row_lru;
+	/* recipient names, filled only while sorting by To */
+	GHashTable *toname_table;
+
+	/* threading of the messages appended to a threaded folder
+	   (MsgInfo -> GtkTreeIter) */
+	MsgThreader *threader;
+	GHashTable *threader_iter_table;
+
 	/* generic flag */
 	gint tmp_flag;
 };
@@ -177,6 +189,7 @@ void summary_clear_list		  (SummaryView		*summaryview);
 void summary_clear_all		  (SummaryView		*summaryview);
 
 void summary_show_queued_msgs	  (SummaryView		*summaryview);
+gboolean summary_update_queued_msgs (SummaryView		*summaryview);
 
 /* full lock */
 void summary_lock		  (SummaryView		*summaryview);